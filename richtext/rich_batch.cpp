@@ -1,6 +1,7 @@
 #include "rich_batch.h"
 #include "rich_widget.h"
 #include "Urho3D/core/profiler.h"
+#include "Urho3D/Graphics/Material.h"
 
 namespace Urho3D {
 
@@ -56,6 +57,44 @@ void AddQuadToUIBatch(UIBatch* batch, const Quad& q)
     dest[35] = q.tex_coords_.max_.y_;
 }
 
+/// Utility function to copy the corners of a Quad to UIBatch, the triangles come from the index buffer.
+void AddIndexedQuadToUIBatch(UIBatch* batch, const Quad& q)
+{
+    unsigned color = q.color_.ToUInt();
+    unsigned begin = batch->vertexData_->Size();
+    batch->vertexData_->Resize(begin + 4 * UI_VERTEX_SIZE);
+    float* dest = &(batch->vertexData_->At(begin));
+    batch->vertexEnd_ = batch->vertexData_->Size();
+
+    dest[0] = q.vertices_.min_.x_;
+    dest[1] = q.vertices_.min_.y_;
+    dest[2] = q.z_;
+    ((unsigned&)dest[3]) = color;
+    dest[4] = q.tex_coords_.min_.x_;
+    dest[5] = q.tex_coords_.min_.y_;
+
+    dest[6] = q.vertices_.max_.x_;
+    dest[7] = q.vertices_.min_.y_;
+    dest[8] = q.z_;
+    ((unsigned&)dest[9]) = color;
+    dest[10] = q.tex_coords_.max_.x_;
+    dest[11] = q.tex_coords_.min_.y_;
+
+    dest[12] = q.vertices_.min_.x_;
+    dest[13] = q.vertices_.max_.y_;
+    dest[14] = q.z_;
+    ((unsigned&)dest[15]) = color;
+    dest[16] = q.tex_coords_.min_.x_;
+    dest[17] = q.tex_coords_.max_.y_;
+
+    dest[18] = q.vertices_.max_.x_;
+    dest[19] = q.vertices_.max_.y_;
+    dest[20] = q.z_;
+    ((unsigned&)dest[21]) = color;
+    dest[22] = q.tex_coords_.max_.x_;
+    dest[23] = q.tex_coords_.max_.y_;
+}
+
 namespace {
 
 inline void move_quad(const Urho3D::Vector3& vector, Rect& vertices)
@@ -127,10 +166,27 @@ inline bool clip_quad(Rect& vertices, Rect& texcoords, const Rect& clip_region)
     return true;
 }
 
+/// Tests the bounds of quads against the clip region.
+inline Intersection clip_intersection(const Rect& bounds, const Rect& clip_region)
+{
+    if (bounds.max_.x_ <= clip_region.min_.x_ || bounds.min_.x_ >= clip_region.max_.x_ ||
+        bounds.max_.y_ <= clip_region.min_.y_ || bounds.min_.y_ >= clip_region.max_.y_)
+        return OUTSIDE;
+    if (bounds.min_.x_ < clip_region.min_.x_ || bounds.max_.x_ > clip_region.max_.x_ ||
+        bounds.min_.y_ < clip_region.min_.y_ || bounds.max_.y_ > clip_region.max_.y_)
+        return INTERSECTS;
+    return INSIDE;
+}
+
 } // namespace
 
 RichWidgetBatch::RichWidgetBatch(Context* context)
  : is_dirty_(false)
+ , quad_ranges_dirty_(true)
+ , indexed_quads_(false)
+ , transform_quads_(false)
+ , quad_offset_(Vector3::ZERO)
+ , quad_alpha_(1.0f)
  , use_count_(0)
  , parent_widget_(0)
  , Object(context)
@@ -152,15 +208,85 @@ void RichWidgetBatch::SetParentWidget(RichWidget* parent)
 void RichWidgetBatch::AddQuad(const Rect& vertices, float z, const Rect& texcoords, const Urho3D::Color& color)
 {
     quads_.Push(Quad(vertices, z, texcoords, color));
+    quad_ranges_dirty_ = true;
+    SetDirty();
+}
+
+void RichWidgetBatch::AddQuads(const PODVector<Quad>& quads, const Vector3& offset)
+{
+    unsigned begin = quads_.Size();
+    quads_.Resize(begin + quads.Size());
+    for (unsigned i = 0; i < quads.Size(); ++i)
+    {
+        Quad& q = quads_[begin + i];
+        q = quads[i];
+        move_quad(offset, q.vertices_);
+        q.z_ += offset.z_;
+    }
+    quad_ranges_dirty_ = true;
     SetDirty();
 }
 
 void RichWidgetBatch::ClearQuads()
 {
     quads_.Clear();
+    line_starts_.Clear();
+    quad_ranges_dirty_ = true;
     SetDirty();
 }
 
+void RichWidgetBatch::MarkLineStart(unsigned line)
+{
+    while (line_starts_.Size() <= line)
+        line_starts_.Push(quads_.Size());
+    quad_ranges_dirty_ = true;
+}
+
+void RichWidgetBatch::RemoveLeadingLines(unsigned count, float offset_y)
+{
+    if (!count)
+        return;
+
+    unsigned first_quad = count < line_starts_.Size() ? line_starts_[count] : quads_.Size();
+    quads_.Erase(0, first_quad);
+    for (auto& quad : quads_)
+    {
+        quad.vertices_.min_.y_ -= offset_y;
+        quad.vertices_.max_.y_ -= offset_y;
+    }
+
+    line_starts_.Erase(0, Min(count, line_starts_.Size()));
+    for (auto& start : line_starts_)
+        start -= first_quad;
+    quad_ranges_dirty_ = true;
+    SetDirty();
+}
+
+void RichWidgetBatch::UpdateQuadRanges()
+{
+    if (!quad_ranges_dirty_)
+        return;
+    quad_ranges_dirty_ = false;
+    quad_ranges_.Clear();
+
+    unsigned begin = 0;
+    for (unsigned line = 0; line <= line_starts_.Size(); ++line)
+    {
+        unsigned end = line < line_starts_.Size() ? line_starts_[line] : quads_.Size();
+        if (end <= begin)
+            continue;
+
+        QuadRange range;
+        range.begin = begin;
+        range.end = end;
+        range.bounds = quads_[begin].vertices_;
+        for (unsigned i = begin + 1; i < end; ++i)
+            range.bounds.Merge(quads_[i].vertices_);
+        quad_ranges_.Push(range);
+        begin = end;
+    }
+}
+
 void RichWidgetBatch::GetBatches(PODVector<UIBatch>& batches, PODVector<float>& vertexData, const IntRect& currentScissor, UIElement* uiElement)
 {
     uiElement_ = uiElement;
@@ -176,8 +302,19 @@ void RichWidgetBatch::GetBatches(PODVector<UIBatch>& batches, PODVector<float>&
     float scaley = parent_widget_ ? parent_widget_->GetInternalScale().y_ : 1.0f;
 
     const Rect& cliprect = parent_widget_ ? parent_widget_->GetActualDrawArea(false) : Rect();
-    const Rect& cliprect_with_padding = parent_widget_ ? parent_widget_->GetActualDrawArea(true) : Rect();
-    Vector3 scaled_draw_origin = parent_widget_ ? parent_widget_->GetDrawOrigin() * Vector3(parent_widget_->GetInternalScale().x_, parent_widget_->GetInternalScale().y_, 1.0f) : Vector3::ZERO;
+    Rect cliprect_with_padding = parent_widget_ ? parent_widget_->GetActualDrawArea(true) : Rect();
+    Vector3 draw_origin = parent_widget_ ? parent_widget_->GetDrawOrigin() : Vector3::ZERO;
+    if (parent_widget_ && parent_widget_->GetScrollByTransform())
+    {
+        // content scrolled by transform is built at the current offset and moved from there without a rebuild, it is
+        // clipped with one window of margin so it can scroll that far
+        Vector2 built_offset = parent_widget_->GetScrollBuiltOffset();
+        draw_origin += Vector3(built_offset.x_, built_offset.y_, 0.0f);
+        Vector2 margin = cliprect_with_padding.Size();
+        cliprect_with_padding.min_ -= margin;
+        cliprect_with_padding.max_ += margin;
+    }
+    Vector3 scaled_draw_origin = draw_origin * Vector3(scalex, scaley, 1.0f);
     IntRect padding = parent_widget_ ? parent_widget_->GetPadding() : IntRect::ZERO;
     padding.left_ *= scalex;
     padding.right_ *= scalex;
@@ -190,22 +327,59 @@ void RichWidgetBatch::GetBatches(PODVector<UIBatch>& batches, PODVector<float>&
         padding.top_ += uiElement_->GetPosition().y_;
     }
 
+    const bool clip = !cliprect.Equals(Rect::ZERO);
+
+    UpdateQuadRanges();
+
     bool quads_added = false;
-    for (auto& quad : quads_)
+    for (const QuadRange& range : quad_ranges_)
     {
-        Quad q = quad; // NOTE: uses copy constructor
-        scale_quad(scale_vector, q.vertices_);
-        move_quad(scaled_draw_origin, q.vertices_);
-        q.vertices_.min_.x_ += padding.left_;
-        q.vertices_.max_.x_ += padding.left_;
-        q.vertices_.min_.y_ += padding.top_;
-        q.vertices_.max_.y_ += padding.top_;
-        if (!cliprect.Equals(Rect::ZERO) && !clip_quad(q.vertices_, q.tex_coords_, cliprect_with_padding))
-          continue;
-
-        AddQuadToUIBatch(&batch, q);
-        if (!quads_added)
-          quads_added = true;
+        // lines fully outside the clip region are skipped, lines fully inside need no clipping
+        Intersection range_clip = INSIDE;
+        if (clip)
+        {
+            Rect bounds = range.bounds;
+            scale_quad(scale_vector, bounds);
+            move_quad(scaled_draw_origin, bounds);
+            bounds.min_.x_ += padding.left_;
+            bounds.max_.x_ += padding.left_;
+            bounds.min_.y_ += padding.top_;
+            bounds.max_.y_ += padding.top_;
+            range_clip = clip_intersection(bounds, cliprect_with_padding);
+            if (range_clip == OUTSIDE)
+                continue;
+        }
+
+        for (unsigned i = range.begin; i < range.end; ++i)
+        {
+            Quad q = quads_[i]; // NOTE: uses copy constructor
+            scale_quad(scale_vector, q.vertices_);
+            move_quad(scaled_draw_origin, q.vertices_);
+            q.vertices_.min_.x_ += padding.left_;
+            q.vertices_.max_.x_ += padding.left_;
+            q.vertices_.min_.y_ += padding.top_;
+            q.vertices_.max_.y_ += padding.top_;
+            if (range_clip != INSIDE && !clip_quad(q.vertices_, q.tex_coords_, cliprect_with_padding))
+              continue;
+
+            if (transform_quads_)
+            {
+              const float scale = RichWidget::unitsPerPixel;
+              q.vertices_.min_.x_ = (q.vertices_.min_.x_ + quad_offset_.x_) * scale;
+              q.vertices_.max_.x_ = (q.vertices_.max_.x_ + quad_offset_.x_) * scale;
+              q.vertices_.min_.y_ = -(q.vertices_.min_.y_ + quad_offset_.y_) * scale;
+              q.vertices_.max_.y_ = -(q.vertices_.max_.y_ + quad_offset_.y_) * scale;
+              q.z_ = (q.z_ + quad_offset_.z_) * scale;
+              q.color_.a_ *= quad_alpha_;
+            }
+
+            if (indexed_quads_)
+              AddIndexedQuadToUIBatch(&batch, q);
+            else
+              AddQuadToUIBatch(&batch, q);
+            if (!quads_added)
+              quads_added = true;
+        }
     }
 
     int batch_count_before = batches.Size();
@@ -226,4 +400,16 @@ bool RichWidgetBatch::IsEmpty() const
     return quads_.Empty();
 }
 
+SharedPtr<Material> RichWidgetBatch::GetMaterial(Texture* texture, int zbias)
+{
+    if (material_ && texture) {
+        material_->SetTexture(TU_DIFFUSE, texture);
+        material_->SetRenderOrder(zbias);
+#if defined(TARGET_LINUX)
+        material_->SetDepthBias(Urho3D::BiasParameters(-0.0000023f - zbias * 0.0000023f, -0.0000023f - zbias * 0.0000023f));
+#endif
+    }
+    return material_;
+}
+
 } // namespace Urho3D
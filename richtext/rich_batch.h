@@ -34,6 +34,8 @@ struct Quad
 
 /// An utility function for copying Quad data to UIBatch.
 void AddQuadToUIBatch(UIBatch* batch, const Quad& q);
+/// Copy the 4 corners of a Quad to UIBatch, for geometry drawn with a quad index buffer.
+void AddIndexedQuadToUIBatch(UIBatch* batch, const Quad& q);
 
 /// A batch for rendering inside a widget.
 class RichWidgetBatch: public Object
@@ -45,7 +47,7 @@ public:
 
     /// The texture used on the quads.
     SharedPtr<Texture> texture_;
-    /// The material used to render.
+    /// A material replacing the shared material of the batch, it gets the texture and bias of every draw.
     SharedPtr<Material> material_;
     /// The output batch.
     UIBatch* batch_;
@@ -60,10 +62,18 @@ public:
     void SetDirty() { is_dirty_ = true; }
     /// Add a quad.
     void AddQuad(const Rect& vertices, float z, const Rect& texcoords, const Color& color);
+    /// Add quads moved by offset.
+    void AddQuads(const PODVector<Quad>& quads, const Vector3& offset);
     /// Remove all quads.
     void ClearQuads();
+    /// Mark the start of a layout line at the current quad, lines without a mark yet start here too.
+    void MarkLineStart(unsigned line);
+    /// Remove the quads of the first lines and move the remaining quads up by offset_y pixels.
+    void RemoveLeadingLines(unsigned count, float offset_y);
     /// Is the render item empty (has no quads)?
     virtual bool IsEmpty() const;
+    /// Get the material drawing a texture of the batch in 3D, material_ if set.
+    virtual SharedPtr<Material> GetMaterial(Texture* texture, int zbias);
     /// Get UI batches from this widget.
     virtual void GetBatches(PODVector<UIBatch>& batches, PODVector<float>& vertexData, const IntRect& currentScissor);
     /// Get UI batches from this widget.
@@ -76,8 +86,32 @@ protected:
     bool is_dirty_;
     /// List of quads.
     PODVector<Quad> quads_;
+    /// Index of the first quad of each marked layout line.
+    PODVector<unsigned> line_starts_;
+    /// A range of quads, a marked layout line or the quads before the first mark.
+    struct QuadRange
+    {
+        unsigned begin;
+        unsigned end;
+        /// Bounds of the quads.
+        Rect bounds;
+    };
+    /// Quad ranges for clip rejection, see UpdateQuadRanges().
+    PODVector<QuadRange> quad_ranges_;
+    /// Do the quad ranges need an update ?
+    bool quad_ranges_dirty_;
+    /// Split the quads into ranges at the marked lines and compute their bounds.
+    void UpdateQuadRanges();
     /// The parent widget (if any).
     RichWidget* parent_widget_;
+    /// Emit 4 vertices per quad for indexed drawing instead of 2 triangles.
+    bool indexed_quads_;
+    /// Move the emitted quads by quad_offset_ pixels, scale them to 3D units and flip Y.
+    bool transform_quads_;
+    /// Offset of the emitted quads.
+    Vector3 quad_offset_;
+    /// Alpha multiplier of the emitted quads.
+    float quad_alpha_;
     /// Use count in the last draw call.
     int use_count_;
     /// number of batches in the last GetBatches call.
@@ -1,6 +1,7 @@
 #include "rich_batch_image.h"
 #include "rich_widget.h"
 #include "rich_image_provider.h"
+#include "rich_material_cache.h"
 #include "Urho3D/Graphics/Drawable.h"
 #include "Urho3D/Core/Context.h"
 #include "Urho3D/Graphics/Texture.h"
@@ -17,13 +18,6 @@ void RichWidgetImage::RegisterObject(Context* context)
 RichWidgetImage::RichWidgetImage(Context* context)
  : RichWidgetBatch(context)
 {
-     ResourceCache* cache = GetSubsystem<ResourceCache>();
-     Material* material = cache->GetResource<Material>("Materials/RichImage.xml");
-     material_ = material->Clone();
-     material_->SetTexture(TU_DIFFUSE, 0);
-     material_->SetTexture(TU_NORMAL, 0);
-     material_->SetTexture(TU_SPECULAR, 0);
-     material_->SetName("RichWidgetImage");
 }
 
 
@@ -47,12 +41,8 @@ void RichWidgetImage::SetImageSource(const String& sourceUrl)
           auto image_provider = context_->GetSubsystem<RichImageProvider>();
           image_provider->RequestImageResource(this, sourceUrl);
         }
-        if (texture_ && material_)
-        {
-            material_->SetTexture(TU_DIFFUSE, texture_);
-            if (parent_widget_)
-                parent_widget_->SetFlags(WidgetFlags_ContentChanged);
-        }
+        if (texture_ && parent_widget_)
+            parent_widget_->SetFlags(WidgetFlags_ContentChanged);
     }
 }
 
@@ -75,6 +65,13 @@ void RichWidgetImage::AddImage(const Vector3 pos, float width, float height)
     AddQuad(Rect(pos.x_, pos.y_, pos.x_ + width, pos.y_ + height), pos.z_, Rect(0.0f, 0.0f, 1.0f, 1.0f), Color::WHITE);
 }
 
+SharedPtr<Material> RichWidgetImage::GetMaterial(Texture* texture, int zbias)
+{
+    if (material_ || !texture)
+        return RichWidgetBatch::GetMaterial(texture, zbias);
+    return RichMaterialCache::Get(context_)->GetMaterial(texture, RichMaterialCache::MODE_IMAGE, zbias);
+}
+
 int RichWidgetImage::GetImageWidth() const
 {
     if (texture_)
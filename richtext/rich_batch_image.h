@@ -25,6 +25,8 @@ public:
     String GetImageSource() const { return source_url_; }
     /// Add an image quad.
     void AddImage(const Vector3 pos, float width, float height);
+    /// Get the shared image material of a texture.
+    SharedPtr<Material> GetMaterial(Texture* texture, int zbias) override;
     /// Get image width.
     int GetImageWidth() const;
     /// Get image height.
@@ -3,8 +3,7 @@
 //#include "Urho3D/core/logger.h"
 #include "rich_widget.h"
 #include "rich_font_provider.h"
-#include "Urho3D/Graphics/Technique.h"
-#include "Urho3D/Graphics/Graphics.h"
+#include "rich_material_cache.h"
 #include "Urho3D/UI/FontFace.h"
 #include "Urho3D/Graphics/Texture.h"
 #include "Urho3D/Graphics/Texture2D.h"
@@ -12,6 +11,32 @@
 namespace Urho3D
 {
 
+namespace
+{
+
+/// Maximum number of quads in the text run cache of a batch, every run counts as at least one.
+const unsigned MAX_TEXT_RUN_QUADS = 16384;
+/// Maximum number of runs in the text run cache of a batch.
+const unsigned MAX_TEXT_RUNS = 1024;
+
+/// Cache cost of a run, runs without any quads still take an entry.
+inline unsigned GetRunCost(const PODVector<Quad>& quads)
+{
+    return Max(quads.Size(), 1U);
+}
+
+inline void AddGlyphQuad(PODVector<Quad>& quads, const Rect& texCoords, float x, float y, float z, float width, float height, const Color& color)
+{
+    Rect vertices;
+    vertices.min_.x_ = x;
+    vertices.min_.y_ = y;
+    vertices.max_.x_ = x + width;
+    vertices.max_.y_ = y + height;
+    quads.Push(Quad(vertices, z, texCoords, color));
+}
+
+} // namespace
+
 /// Register object factory. Drawable must be registered first.
 void RichWidgetText::RegisterObject(Context* context)
 {
@@ -21,17 +46,6 @@ void RichWidgetText::RegisterObject(Context* context)
 RichWidgetText::RichWidgetText(Context* context)
  : RichWidgetBatch(context)
 {
-    Material* material = new Material(context_);
-    Technique* tech = new Technique(context_);
-    Pass* pass = tech->CreatePass("alpha");
-    pass->SetVertexShader("Text");
-    pass->SetPixelShader("Text");
-    pass->SetBlendMode(BLEND_ALPHA);
-    pass->SetDepthWrite(false);
-    material->SetTechnique(0, tech);
-    material->SetCullMode(CULL_NONE);
-    material_ = material;
-    material_->SetName("RichWidgetText");
 }
 
 RichWidgetText::~RichWidgetText()
@@ -54,6 +68,11 @@ void RichWidgetText::SetFont(const String& fontname, int pointsize, bool bold, b
     pending_font_request_ = true;
 }
 
+unsigned RichWidgetText::MakeFontKey(const String& fontname, unsigned pointsize, bool bold, bool italic)
+{
+    return FontState::MakeKey(fontname, pointsize, bold, italic);
+}
+
 void RichWidgetText::SetFontResource(Font* font)
 {
     font_ = font;
@@ -63,35 +82,26 @@ void RichWidgetText::SetFontResource(Font* font)
       return;
 
     font_face_ = font_->GetFace(pointsize_);
+    latin1_metrics_.Clear();
+    text_runs_.Clear();
+    num_text_run_quads_ = 0;
 
     if (font_face_ && !texture_)
       texture_ = font_face_->GetTextures()[0];
 
     if (font_->IsSDFFont() && font_face_)
       bitmap_font_rescale_ = Vector2((float)pointsize_ / font_face_->GetPointSize(), (float)pointsize_ / font_face_->GetPointSize());
+}
 
-    if (font_->IsSDFFont())
-    {
-      // Note: custom defined material is assumed to have right shader defines; they aren't modified here
-      if (material_)
-      {
-        Technique* tech = material_->GetTechnique(0);
-        Pass* pass = tech ? tech->GetPass("alpha") : (Pass*)0;
-        if (pass)
-          pass->SetPixelShaderDefines("SIGNED_DISTANCE_FIELD");
-      }
-    } else
-    {
-      Technique* tech = material_->GetTechnique(0);
-      Pass* pass = tech ? tech->GetPass("alpha") : (Pass*)0;
-      if (pass)
-      {
-        if (texture_ && texture_->GetFormat() == Graphics::GetAlphaFormat())
-          pass->SetPixelShaderDefines("ALPHAMAP");
-        else
-          pass->SetPixelShaderDefines("");
-      }
-    }
+SharedPtr<Material> RichWidgetText::GetMaterial(Texture* texture, int zbias)
+{
+    // Note: custom defined material is assumed to have right shader defines; they aren't modified here
+    if (material_ || !texture)
+        return RichWidgetBatch::GetMaterial(texture, zbias);
+
+    bool sdf = font_ && font_->IsSDFFont();
+    return RichMaterialCache::Get(context_)->GetMaterial(texture,
+        sdf ? RichMaterialCache::MODE_TEXT_SDF : RichMaterialCache::MODE_TEXT, zbias);
 }
 
 void RichWidgetText::DrawQuad(const Rect& vertices, float z, const Rect& texCoords, const Color& color)
@@ -124,24 +134,100 @@ void RichWidgetText::DrawGlyphScaled(const Rect& texCoords, float x, float y, fl
     DrawQuad(vertices, z, texCoords, color);
 }
 
-void RichWidgetText::AddText(const String& text, const Vector3& pos, const Color& color)
+float RichWidgetText::AddText(const String& text, const Vector3& pos, const Color& color)
 {
     if (!font_ || !font_face_)
-        return;
-
-    Vector3 p = pos;
-
-    Texture2D* texture = font_face_->GetTextures()[0];
-    Vector2 inverse_size(1.0f / texture->GetWidth(), 1.0f / texture->GetHeight());
+        return 0.0f;
 
     PODVector<unsigned> unicodeText;
     for (unsigned i = 0; i < text.Length();)
       unicodeText.Push(text.NextUTF8Char(i));
 
+    return AddText(unicodeText, pos, color);
+}
+
+float RichWidgetText::AddText(const PODVector<unsigned>& unicodeText, const Vector3& pos, const Color& color)
+{
+    if (!font_ || !font_face_)
+        return 0.0f;
+
+    const TextRun& run = GetTextRun(unicodeText, color);
+    AddQuads(run.quads, pos);
+    return run.advance;
+}
+
+const RichWidgetText::TextRun& RichWidgetText::GetTextRun(const PODVector<unsigned>& unicodeText, const Color& color)
+{
+    const bool shadow_enabled = parent_widget_ && parent_widget_->GetShadowEnabled();
+    const Vector4 shadow_offset = parent_widget_ ? parent_widget_->GetShadowOffset() : Vector4::ZERO;
+    const Color shadow_color = parent_widget_ ? parent_widget_->GetShadowColor() : Color::BLACK;
+
+    // glyphs of a mutable face can move in its texture or be evicted, the quads are built every time and GetGlyph()
+    // marks the glyphs as used
+    if (font_face_->HasMutableGlyphs())
+    {
+        scratch_run_.chars = unicodeText;
+        scratch_run_.color = color;
+        scratch_run_.shadow_enabled = shadow_enabled;
+        scratch_run_.shadow_offset = shadow_offset;
+        scratch_run_.shadow_color = shadow_color;
+        scratch_run_.quads.Clear();
+        scratch_run_.advance = BuildTextRun(unicodeText, color, scratch_run_);
+        return scratch_run_;
+    }
+
+    unsigned hash = color.ToUInt();
+    for (unsigned i = 0; i < unicodeText.Size(); ++i)
+        hash = unicodeText[i] + (hash << 6) + (hash << 16) - hash;
+
+    HashMap<unsigned, TextRun>::Iterator it = text_runs_.Find(hash);
+    if (it != text_runs_.End())
+    {
+        const TextRun& cached = it->second_;
+        if (cached.chars == unicodeText && cached.color == color && cached.shadow_enabled == shadow_enabled &&
+            (!shadow_enabled || (cached.shadow_offset == shadow_offset && cached.shadow_color == shadow_color)))
+            return cached;
+        // hash collision, it is rebuilt below
+        num_text_run_quads_ -= GetRunCost(cached.quads);
+    }
+    else if (text_runs_.Size() >= MAX_TEXT_RUNS)
+    {
+        // keep the cache bounded, the runs still in use are rebuilt on demand
+        text_runs_.Clear();
+        num_text_run_quads_ = 0;
+    }
+
+    TextRun& run = text_runs_[hash];
+    run.chars = unicodeText;
+    run.color = color;
+    run.shadow_enabled = shadow_enabled;
+    run.shadow_offset = shadow_offset;
+    run.shadow_color = shadow_color;
+    run.quads.Clear();
+    run.advance = BuildTextRun(unicodeText, color, run);
+    num_text_run_quads_ += GetRunCost(run.quads);
+
+    if (num_text_run_quads_ > MAX_TEXT_RUN_QUADS && text_runs_.Size() > 1)
+    {
+        TextRun kept = run;
+        text_runs_.Clear();
+        num_text_run_quads_ = GetRunCost(kept.quads);
+        return text_runs_[hash] = kept;
+    }
+    return run;
+}
+
+float RichWidgetText::BuildTextRun(const PODVector<unsigned>& unicodeText, const Color& color, TextRun& run)
+{
+    Vector3 p = Vector3::ZERO;
+
+    Texture2D* texture = font_face_->GetTextures()[0];
+    Vector2 inverse_size(1.0f / texture->GetWidth(), 1.0f / texture->GetHeight());
+
     // shadow pass behind the actual text
     // TODO: all shadow passes should be made equal z-order number which is
     // below all render items in this widget
-    if (parent_widget_ && parent_widget_->GetShadowEnabled()) {
+    if (run.shadow_enabled) {
         for (unsigned i = 0; i < unicodeText.Size(); ++i) {
             const FontGlyph* glyph = font_face_->GetGlyph(unicodeText[i]);
             if (glyph == 0)
@@ -153,19 +239,19 @@ void RichWidgetText::AddText(const String& text, const Vector3& pos, const Color
             uv.max_.x_ = (glyph->x_ + glyph->width_ + 0.5f) * inverse_size.x_;
             uv.max_.y_ = (glyph->y_ + glyph->height_ + 0.5f) * inverse_size.y_;
 
-            DrawGlyph(
+            AddGlyphQuad(run.quads,
               uv, // UV rect
-              p.x_ + (bitmap_font_rescale_.x_ * glyph->offsetX_) + parent_widget_->GetShadowOffset().x_,
-              p.y_ + (bitmap_font_rescale_.y_ * glyph->offsetY_) + parent_widget_->GetShadowOffset().y_,
-              p.z_ + parent_widget_->GetShadowOffset().z_ + 0.01f,
+              p.x_ + (bitmap_font_rescale_.x_ * glyph->offsetX_) + run.shadow_offset.x_,
+              p.y_ + (bitmap_font_rescale_.y_ * glyph->offsetY_) + run.shadow_offset.y_,
+              p.z_ + run.shadow_offset.z_ + 0.01f,
               bitmap_font_rescale_.x_ * glyph->width_,
               bitmap_font_rescale_.y_ * glyph->height_,
-              parent_widget_->GetShadowColor());
+              run.shadow_color);
             p.x_ += glyph->advanceX_ * bitmap_font_rescale_.x_;
         }
     }
 
-    p = pos;
+    p = Vector3::ZERO;
 
     for (unsigned i = 0; i < unicodeText.Size(); ++i)
     {
@@ -179,7 +265,7 @@ void RichWidgetText::AddText(const String& text, const Vector3& pos, const Color
         uv.max_.x_ = (glyph->x_ + glyph->width_ + 0.5f) * inverse_size.x_;
         uv.max_.y_ = (glyph->y_ + glyph->height_ + 0.5f) * inverse_size.y_;
 
-        DrawGlyph(
+        AddGlyphQuad(run.quads,
           uv, // UV rect
           p.x_ + (bitmap_font_rescale_.x_ * glyph->offsetX_),
           p.y_ + (bitmap_font_rescale_.y_ * glyph->offsetY_),
@@ -189,6 +275,35 @@ void RichWidgetText::AddText(const String& text, const Vector3& pos, const Color
           color);
         p.x_ += glyph->advanceX_ * bitmap_font_rescale_.x_;
     }
+
+    return p.x_;
+}
+
+RichWidgetText::GlyphMetrics RichWidgetText::GetGlyphMetrics(unsigned c)
+{
+    if (c < 256 && !latin1_metrics_.Empty() && latin1_metrics_[c].advance >= 0.0f)
+        return latin1_metrics_[c];
+
+    GlyphMetrics metrics = { 0.0f, 0.0f };
+    const FontGlyph* glyph = font_face_->GetGlyph(c);
+    if (glyph)
+    {
+        metrics.advance = (float)glyph->advanceX_ * bitmap_font_rescale_.x_;
+        metrics.height = glyph->height_ * bitmap_font_rescale_.y_;
+    }
+
+    if (c < 256)
+    {
+        if (latin1_metrics_.Empty())
+        {
+            const GlyphMetrics unknown = { -1.0f, 0.0f };
+            latin1_metrics_.Resize(256);
+            for (unsigned i = 0; i < 256; ++i)
+                latin1_metrics_[i] = unknown;
+        }
+        latin1_metrics_[c] = metrics;
+    }
+    return metrics;
 }
 
 Vector2 RichWidgetText::CalculateTextExtents(const String& text)
@@ -197,22 +312,43 @@ Vector2 RichWidgetText::CalculateTextExtents(const String& text)
     if (!font_face_)
         return res;
 
-    PODVector<unsigned> unicodeText;
-    for (unsigned i = 0; i < text.Length();){
-      unicodeText.Push(text.NextUTF8Char(i));
+    for (unsigned i = 0; i < text.Length();)
+    {
+        GlyphMetrics metrics = GetGlyphMetrics(text.NextUTF8Char(i));
+        res.x_ += metrics.advance;
+        res.y_ = Max(res.y_, metrics.height);
     }
+    return res;
+}
 
-    for (unsigned i = 0; i < unicodeText.Size(); ++i)
+Vector2 RichWidgetText::CalculateTextExtents(const PODVector<unsigned>& chars)
+{
+    Vector2 res;
+    if (!font_face_)
+        return res;
+
+    for (unsigned i = 0; i < chars.Size(); ++i)
     {
-        const FontGlyph* glyph = font_face_->GetGlyph(unicodeText[i]);
-        if (!glyph)
-            continue;
-        res.x_ += (float)glyph->advanceX_ * bitmap_font_rescale_.x_;
-        res.y_ = Max(res.y_, glyph->height_ * bitmap_font_rescale_.y_);
+        GlyphMetrics metrics = GetGlyphMetrics(chars[i]);
+        res.x_ += metrics.advance;
+        res.y_ = Max(res.y_, metrics.height);
     }
     return res;
 }
 
+void RichWidgetText::CalculatePrefixWidths(const String& text, PODVector<unsigned>& char_ends, PODVector<float>& widths)
+{
+    float width = 0.0f;
+    for (unsigned i = 0; i < text.Length();)
+    {
+        unsigned c = text.NextUTF8Char(i);
+        if (font_face_)
+            width += GetGlyphMetrics(c).advance;
+        char_ends.Push(i);
+        widths.Push(width);
+    }
+}
+
 float RichWidgetText::GetRowHeight() const
 {
     if (font_face_)
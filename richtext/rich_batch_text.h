@@ -30,21 +30,58 @@ public:
     void DrawGlyph(const Rect& texCoords, float x, float y, float z, float width, float height, const Color& color);
     /// Draw a glyph, scaled depending on the bitmap font and pointsize.
     void DrawGlyphScaled(const Rect& texCoords, float x, float y, float z, float width, float height, const Vector2& scale, const Color& color);
-    /// Add text.
-    void AddText(const String& text, const Vector3& pos, const Color& color);
+    /// Add text, return its advance.
+    float AddText(const String& text, const Vector3& pos, const Color& color);
+    /// Add text decoded to UTF-32, return its advance.
+    float AddText(const PODVector<unsigned>& chars, const Vector3& pos, const Color& color);
     /// Set the font.
     void SetFont(const String& fontname, int pointsize, bool bold = false, bool italic = false);
+    /// Return a 32-bit key of a font, the id of its text batch in a widget.
+    static unsigned MakeFontKey(const String& fontname, unsigned pointsize, bool bold, bool italic);
     /// Get the font face (only valid after SetFont).
     FontFace* GetFontFace() const { return font_face_; }
     /// Calculate text extents with the current font
     Vector2 CalculateTextExtents(const String& text);
+    /// Calculate the extents of a text decoded to UTF-32 with the current font
+    Vector2 CalculateTextExtents(const PODVector<unsigned>& chars);
+    /// Calculate the width of every prefix of a text with the current font. For every character the byte offset after it
+    /// and the width of the text up to there are pushed.
+    void CalculatePrefixWidths(const String& text, PODVector<unsigned>& char_ends, PODVector<float>& widths);
     /// Row height
     float GetRowHeight() const;
     /// RichFontProvider calls this when it resolves the font
     void SetFontResource(Font* font);
     // override IsEmpty() to return false while requested a font
     bool IsEmpty() const override;
+    /// Get the shared text material of a font texture.
+    SharedPtr<Material> GetMaterial(Texture* texture, int zbias) override;
 private:
+    /// Scaled metrics of a glyph.
+    struct GlyphMetrics
+    {
+        float advance;
+        float height;
+    };
+    /// Get the scaled metrics of a character. Latin-1 metrics are looked up once and then read from a table.
+    GlyphMetrics GetGlyphMetrics(unsigned c);
+
+    /// Quads of a text run relative to the run position, reused while the text, color and shadow don't change. Runs of
+    /// faces with mutable glyphs are not cached.
+    struct TextRun
+    {
+        PODVector<unsigned> chars;
+        Color color;
+        bool shadow_enabled;
+        Vector4 shadow_offset;
+        Color shadow_color;
+        PODVector<Quad> quads;
+        float advance;
+    };
+    /// Get the cached run of a text, build it if needed.
+    const TextRun& GetTextRun(const PODVector<unsigned>& unicodeText, const Color& color);
+    /// Add the quads of a text and its shadow at the origin to a run, return the advance.
+    float BuildTextRun(const PODVector<unsigned>& unicodeText, const Color& color, TextRun& run);
+
     Font * font_{};
     FontFace* font_face_{};
     int pointsize_{};
@@ -52,6 +89,14 @@ private:
     bool italic_{};
     Vector2 bitmap_font_rescale_{Vector2::ONE};
     bool pending_font_request_{false};
+    /// Metrics of the Latin-1 characters of the font face, negative advances are not looked up yet.
+    PODVector<GlyphMetrics> latin1_metrics_;
+    /// Cached text runs by hash of the text and color.
+    HashMap<unsigned, TextRun> text_runs_;
+    /// Number of quads in the cached text runs, a run without quads counts as one.
+    unsigned num_text_run_quads_{};
+    /// Run built for faces with mutable glyphs, rebuilt on every use.
+    TextRun scratch_run_;
 };
 
 } // namespace Urho3D
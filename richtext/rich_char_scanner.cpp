@@ -0,0 +1,183 @@
+#include "rich_char_scanner.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define RICH_SCAN_AVX2
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RICH_SCAN_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace Urho3D
+{
+
+namespace
+{
+
+inline unsigned CountTrailingZeros(unsigned mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+
+#ifdef RICH_SCAN_AVX2
+inline unsigned MatchBlock32(const char* data, const unsigned char (*needles)[32], unsigned count)
+{
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+    __m256i match = _mm256_cmpeq_epi8(block, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(needles[0])));
+    for (unsigned i = 1; i < count; ++i)
+        match = _mm256_or_si256(match, _mm256_cmpeq_epi8(block, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(needles[i]))));
+    return (unsigned)_mm256_movemask_epi8(match);
+}
+#endif
+
+#ifdef RICH_SCAN_SSE2
+inline unsigned MatchBlock16(const char* data, const unsigned char (*needles)[32], unsigned count)
+{
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+    __m128i match = _mm_cmpeq_epi8(block, _mm_loadu_si128(reinterpret_cast<const __m128i*>(needles[0])));
+    for (unsigned i = 1; i < count; ++i)
+        match = _mm_or_si128(match, _mm_cmpeq_epi8(block, _mm_loadu_si128(reinterpret_cast<const __m128i*>(needles[i]))));
+    return (unsigned)_mm_movemask_epi8(match);
+}
+#endif
+
+} // namespace
+
+RichCharScanner::RichCharScanner(const char* chars)
+ : num_chars_(0)
+{
+    memset(classes_, 0, sizeof(classes_));
+    for (; *chars; ++chars)
+        AddChar(*chars, 1);
+}
+
+RichCharScanner::RichCharScanner(const char* const* class_chars, unsigned num_classes)
+ : num_chars_(0)
+{
+    memset(classes_, 0, sizeof(classes_));
+    for (unsigned i = 0; i < num_classes && i < 32; ++i)
+    {
+        for (const char* chars = class_chars[i]; *chars; ++chars)
+            AddChar(*chars, 1u << i);
+    }
+}
+
+void RichCharScanner::AddChar(char c, unsigned classes)
+{
+    unsigned char index = (unsigned char)c;
+    if (!classes_[index])
+    {
+        if (num_chars_ == 16)
+            return;
+        memset(needles_[num_chars_++], index, sizeof(needles_[0]));
+    }
+    classes_[index] |= classes;
+}
+
+template <class Handler> void RichCharScanner::ForEachMatch(const char* data, unsigned length, unsigned offset, Handler handler) const
+{
+    unsigned i = offset;
+    if (!num_chars_ || i >= length)
+        return;
+
+#ifdef RICH_SCAN_AVX2
+    for (; i + 32 <= length; i += 32)
+    {
+        unsigned mask = MatchBlock32(data + i, needles_, num_chars_);
+        for (; mask; mask &= mask - 1)
+        {
+            if (!handler(i + CountTrailingZeros(mask)))
+                return;
+        }
+    }
+#endif
+
+#ifdef RICH_SCAN_SSE2
+    for (; i + 16 <= length; i += 16)
+    {
+        unsigned mask = MatchBlock16(data + i, needles_, num_chars_);
+        for (; mask; mask &= mask - 1)
+        {
+            if (!handler(i + CountTrailingZeros(mask)))
+                return;
+        }
+    }
+#endif
+
+    for (; i < length; ++i)
+    {
+        if (classes_[(unsigned char)data[i]] && !handler(i))
+            return;
+    }
+}
+
+unsigned RichCharScanner::FindFirst(const char* data, unsigned length, unsigned offset) const
+{
+    unsigned found = String::NPOS;
+    ForEachMatch(data, length, offset, [&found](unsigned pos) { found = pos; return false; });
+    return found;
+}
+
+void RichCharScanner::FindAll(const char* data, unsigned length, PODVector<unsigned>& offsets) const
+{
+    ForEachMatch(data, length, 0, [&offsets](unsigned pos) { offsets.Push(pos); return true; });
+}
+
+unsigned RichCharScanner::Scan(const char* data, unsigned length, PODVector<RichCharMatch>& matches) const
+{
+    unsigned all_classes = 0;
+    ForEachMatch(data, length, 0, [&](unsigned pos)
+    {
+        RichCharMatch match;
+        match.offset = pos;
+        match.classes = classes_[(unsigned char)data[pos]];
+        matches.Push(match);
+        all_classes |= match.classes;
+        return true;
+    });
+    return all_classes;
+}
+
+bool SplitWords(const String& str, Vector<String>& words, const RichCharScanner& delimiters)
+{
+    PODVector<RichCharMatch> matches;
+    const bool dropped = (delimiters.Scan(str.CString(), str.Length(), matches) & ~1u) != 0;
+
+    const char* data = str.CString();
+    String word;
+    unsigned last = 0;
+    for (unsigned i = 0; i < matches.Size(); ++i)
+    {
+        unsigned pos = matches[i].offset;
+        if (!(matches[i].classes & 1))
+        {
+            // dropped, the word goes on after it
+            word.Append(data + last, pos - last);
+            last = pos + 1;
+            continue;
+        }
+        word.Append(data + last, pos - last);
+        if (!word.Empty())
+            words.Push(word);
+        words.Push(String(data + pos, 1));
+        word.Clear();
+        last = pos + 1;
+    }
+    word.Append(data + last, str.Length() - last);
+    words.Push(word);
+    return dropped;
+}
+
+} // namespace Urho3D
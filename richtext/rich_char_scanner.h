@@ -0,0 +1,65 @@
+#ifndef __RICH_CHAR_SCANNER_H__
+#define __RICH_CHAR_SCANNER_H__
+#pragma once
+
+#include "Urho3D/Container/Str.h"
+
+namespace Urho3D
+{
+
+/// A character found by RichCharScanner::Scan().
+struct RichCharMatch
+{
+    /// Offset of the character.
+    unsigned offset;
+    /// Classes of the character, bit i for the i-th class of the scanner.
+    unsigned classes;
+};
+
+/// Finds any of a small set of ASCII characters, 16 or 32 bytes at a time where SSE2/AVX2 is available. The set can
+/// be made of several classes, a single pass then reports the classes of every character found.
+class RichCharScanner
+{
+public:
+    /// Construct from a null-terminated list of up to 16 ASCII characters, they are all class 0.
+    explicit RichCharScanner(const char* chars);
+    /// Construct from several null-terminated lists of characters, list i is class i. Up to 16 distinct characters
+    /// and 32 classes.
+    RichCharScanner(const char* const* class_chars, unsigned num_classes);
+
+    /// Find the first character of the set at or after offset. Returns String::NPOS if not found.
+    unsigned FindFirst(const char* data, unsigned length, unsigned offset = 0) const;
+    /// Find the first character of the set in a String at or after offset. Returns String::NPOS if not found.
+    unsigned FindFirst(const String& str, unsigned offset = 0) const { return FindFirst(str.CString(), str.Length(), offset); }
+    /// Append the offsets of every character of the set to the list, in one pass.
+    void FindAll(const char* data, unsigned length, PODVector<unsigned>& offsets) const;
+    /// Append the offsets and classes of every character of the set to the list, in one pass. Returns the classes
+    /// of all characters found combined.
+    unsigned Scan(const char* data, unsigned length, PODVector<RichCharMatch>& matches) const;
+    /// Is the character part of the set?
+    bool Contains(char c) const { return classes_[(unsigned char)c] != 0; }
+    /// Get the classes of a character, 0 if it is not part of the set.
+    unsigned GetClasses(char c) const { return classes_[(unsigned char)c]; }
+
+private:
+    /// Add a character to a class.
+    void AddChar(char c, unsigned classes);
+    /// Call the handler with the offset of every character of the set at or after offset, stop when it returns false.
+    template <class Handler> void ForEachMatch(const char* data, unsigned length, unsigned offset, Handler handler) const;
+
+    /// The characters of the set, each repeated to the width of a vector register. Built once, loaded by the scans.
+    alignas(32) unsigned char needles_[16][32];
+    /// Number of characters in the set.
+    unsigned num_chars_;
+    /// Classes of every character, 0 if not part of the set.
+    unsigned classes_[256];
+};
+
+/// Split a string into words and single delimiter characters, e.g. "a, b" -> "a" "," " " "b". The delimiters are the
+/// class 0 characters of the scanner, characters of the other classes are dropped from the words. The last word is
+/// always added, even if empty. Returns whether characters were dropped.
+bool SplitWords(const String& str, Vector<String>& words, const RichCharScanner& delimiters);
+
+} // namespace Urho3D
+
+#endif
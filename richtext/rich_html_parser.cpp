@@ -1,4 +1,5 @@
 #include "rich_html_parser.h"
+#include "rich_char_scanner.h"
 #include <Urho3D/Core/StringUtils.h>
 
 namespace Urho3D
@@ -7,13 +8,36 @@ namespace Urho3D
 namespace
 {
 
+const RichCharScanner tag_open_scanner("<");
+const RichCharScanner tag_close_scanner(">");
+
 typedef struct
 {
     const char* name;
     const Color color;
 } ColorEntry;
 
-inline Color ParseHTMLColor(const String& str)
+inline unsigned char ParseHexByte(const char* str)
+{
+    unsigned value = 0;
+    for (unsigned i = 0; i < 2; ++i)
+    {
+        char c = str[i];
+        unsigned digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            break;
+        value = value * 16 + digit;
+    }
+    return (unsigned char)value;
+}
+
+inline Color ParseHTMLColor(const MarkupSpan& str)
 {
     static const ColorEntry color_table[] = {
       { "red", Color::RED },
@@ -33,106 +57,164 @@ inline Color ParseHTMLColor(const String& str)
 
     unsigned char R = 0, G = 0, B = 0, A = 0;
 
-    String color = str.ToLower();
-
     for (int i = 0; color_table[i].name; i++)
     {
         const ColorEntry* entry = &color_table[i];
-        if (color.Compare(entry->name) == 0)
+        if (str.EqualsNoCase(entry->name))
             return entry->color;
     }
 
-    if (color.Length() == 7 || color.Length() == 9)
+    if (str.length == 7 || str.length == 9)
     {
-        if (color.Find("#") == 0)
+        if (str.data[0] == '#')
         {
-            R = (unsigned char)strtoul(str.Substring(1, 2).CString(), 0, 16);
-            G = (unsigned char)strtoul(str.Substring(3, 2).CString(), 0, 16);
-            B = (unsigned char)strtoul(str.Substring(5, 2).CString(), 0, 16);
-            A = str.Length() == 7 ? 255 : (unsigned char)strtoul(str.Substring(7, 2).CString(), 0, 16);
+            R = ParseHexByte(str.data + 1);
+            G = ParseHexByte(str.data + 3);
+            B = ParseHexByte(str.data + 5);
+            A = str.length == 7 ? 255 : ParseHexByte(str.data + 7);
         }
     }
 
     return Color(R / 255.0f, G / 255.0f, B / 255.0f, A / 255.0f);
 }
 
-void UnescapeQuotes(String& s)
+/// Get the value of a <tag=value> style tag. Returns false if the tag has no value.
+inline bool GetTagValue(const MarkupSpan& tag, MarkupSpan& value)
 {
-  if (s.StartsWith("\"") && s.EndsWith("\""))
-  {
-      s.Erase(0);
-      s.Erase(s.Length() - 1);
-  }
+    unsigned eq = tag.Find('=');
+    if (eq == String::NPOS || eq + 1 >= tag.length)
+        return false;
+    value = tag.Substring(eq + 1).Unquoted();
+    return true;
 }
 
-StringVector QuotedSplit(const char* str, char separator) {
-  Vector<String> ret;
-  const char* strEnd = str + String::CStringLength(str);
+inline unsigned char ToLowerASCII(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? (unsigned char)(c - 'A' + 'a') : (unsigned char)c;
+}
+
+inline bool IsSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
 
-  bool in_quotes = false;
+} // namespace
 
-  for (const char* splitEnd = str; splitEnd != strEnd; ++splitEnd)
-  {
-    if (*splitEnd == '\"')
-      in_quotes = !in_quotes;
-    else if (!in_quotes && *splitEnd == separator)
+bool MarkupSpan::Equals(const char* str) const
+{
+    unsigned i = 0;
+    for (; i < length; ++i)
     {
-      const ptrdiff_t splitLen = splitEnd - str;
-      if (splitLen > 0)
-        ret.Push(String(str, splitLen));
-      str = splitEnd + 1;
+        if (str[i] != data[i])
+            return false;
     }
-  }
+    return str[i] == 0;
+}
 
-  const ptrdiff_t splitLen = strEnd - str;
-  if (splitLen > 0 && !in_quotes)
-    ret.Push(String(str, splitLen));
+bool MarkupSpan::EqualsNoCase(const char* str) const
+{
+    unsigned i = 0;
+    for (; i < length; ++i)
+    {
+        if (!str[i] || ToLowerASCII(str[i]) != ToLowerASCII(data[i]))
+            return false;
+    }
+    return str[i] == 0;
+}
 
-  return ret;
+bool MarkupSpan::StartsWith(const char* str) const
+{
+    for (unsigned i = 0; str[i]; ++i)
+    {
+        if (i >= length || str[i] != data[i])
+            return false;
+    }
+    return true;
 }
 
-} // namespace
+unsigned MarkupSpan::Find(char c, unsigned start) const
+{
+    for (unsigned i = start; i < length; ++i)
+    {
+        if (data[i] == c)
+            return i;
+    }
+    return String::NPOS;
+}
 
-/// Supported tags:
-///  <br> - line break
-///  <b></b> - bold
-///  <i></i> - italic
-///  <u></u> - underlined
-///  <sup></sup> - superscript
-///  <sub></sub> - subscript
-///  <align=left|right|center></align>
-///  <color=#FF800000></color> - change text color, supports 24/32 bit hex and color names
-///  <size=14></size> - change text size in pixels
-///  <font=Fonts/Annonymous Pro.ttf></font> - change text font
-///  <img src=image.png width=320 height=240 /> - embed an image
-///  <plugin type=typename key=val ... /> - embed a plugin
-///  TODO: <quad material=material.xml width=10 height=10 x=10 y=10 />
-void HTMLParser::Parse(const String& text, Vector<TextBlock>& blocks, const BlockFormat& default_block_format)
+MarkupSpan MarkupSpan::Substring(unsigned pos, unsigned len) const
 {
-    unsigned pos = 0, last_tag_end = 0;
-    unsigned tag_begin = 0, tag_end = 0;
-    bool closing_tag = false;
-    String tag;
+    if (pos > length)
+        pos = length;
+    if (len > length - pos)
+        len = length - pos;
+    return MarkupSpan(data + pos, len);
+}
 
-    Vector<BlockFormat> stack;
-    TextBlock block;
-    BlockFormat block_format = default_block_format;
+MarkupSpan MarkupSpan::Trimmed() const
+{
+    unsigned begin = 0, end = length;
+    while (begin < end && IsSpace(data[begin]))
+        ++begin;
+    while (end > begin && IsSpace(data[end - 1]))
+        --end;
+    return MarkupSpan(data + begin, end - begin);
+}
 
-    block.format = block_format;
+MarkupSpan MarkupSpan::Unquoted() const
+{
+    if (length >= 2 && data[0] == '\"' && data[length - 1] == '\"')
+        return MarkupSpan(data + 1, length - 2);
+    return *this;
+}
 
-    pos = text.Find('<', pos, false);
+int MarkupSpan::ToInt() const
+{
+    // numbers are short, parse them from a stack copy to avoid allocating a String
+    char buffer[32];
+    unsigned count = Min(length, (unsigned)sizeof(buffer) - 1);
+    memcpy(buffer, data, count);
+    buffer[count] = 0;
+    return Urho3D::ToInt(buffer);
+}
 
-    // in case there's no markup at all, copy everything as a block
-    if (pos == String::NPOS) {
-        block.text = text;
-        blocks.Push(block);
-        return;
+float MarkupSpan::ToFloat() const
+{
+    char buffer[32];
+    unsigned count = Min(length, (unsigned)sizeof(buffer) - 1);
+    memcpy(buffer, data, count);
+    buffer[count] = 0;
+    return Urho3D::ToFloat(buffer);
+}
+
+MarkupTokenizer::MarkupTokenizer(const String& text, unsigned offset)
+ : text_(text)
+ , pos_(offset)
+ , has_pending_tag_(false)
+{
+}
+
+bool MarkupTokenizer::Next(MarkupToken& token)
+{
+    if (has_pending_tag_)
+    {
+        token = pending_tag_;
+        has_pending_tag_ = false;
+        return true;
     }
 
-    while (String::NPOS != (pos = text.Find('<', pos, false)))
+    const unsigned length = text_.Length();
+    if (pos_ >= length)
+        return false;
+
+    const char* data = text_.CString();
+    unsigned text_begin = pos_;
+    unsigned pos = pos_;
+
+    while (String::NPOS != (pos = tag_open_scanner.FindFirst(data, length, pos)))
     {
-        tag_end = text.Find('>', pos + 1, false);
-        // skip <>
+        unsigned tag_end = tag_close_scanner.FindFirst(data, length, pos + 1);
+        // skip <>, it stays part of the text
         if (tag_end == pos + 1)
         {
             pos += 1;
@@ -140,228 +222,444 @@ void HTMLParser::Parse(const String& text, Vector<TextBlock>& blocks, const Bloc
         }
 
         // stop if there's no closing tag or text ends
-        if (pos + 1 >= text.Length() || tag_end == String::NPOS)
+        if (pos + 1 >= length || tag_end == String::NPOS)
             break;
 
-        tag_begin = pos;
-        closing_tag = text[pos + 1] == '/';
-        pos += closing_tag ? 2 : 1;
-        tag = text.Substring(pos, tag_end - pos);
-        if (last_tag_end != tag_begin)
-        {
-            block.text = text.Substring(last_tag_end, tag_begin - last_tag_end);
-            // push the current block everytime new block appears
-            blocks.Push(block);
-        }
+        MarkupToken tag;
+        tag.type = MarkupToken::TokenType_Tag;
+        tag.closing = data[pos + 1] == '/';
+        tag.offset = pos + (tag.closing ? 2 : 1);
+        tag.span = MarkupSpan(data + tag.offset, tag_end - tag.offset);
+        pos_ = tag_end + 1;
 
-        if (tag == "b")
-        {
-            block.format.font.bold = !closing_tag;
-        }
-        else if (tag == "i")
-        {
-            block.format.font.italic = !closing_tag;
-        }
-        else if (tag == "u")
-        {
-          block.format.underlined = !closing_tag;
-        }
-        else if (tag == "sub")
-        {
-          block.format.subscript = !closing_tag;
-        }
-        else if (tag == "sup")
-        {
-          block.format.superscript = !closing_tag;
-        }
-        else if (tag.StartsWith("align"))
-        {
-          auto tokens = tag.Split('=');
-          if (tokens.Size() >= 2)
-          {
-            UnescapeQuotes(tokens[1]);
-            if (tokens[1] == "center")
-              block.format.align = HA_CENTER;
-            else if (tokens[1] == "right")
-              block.format.align = HA_RIGHT;
-          }
-        }
-        else if (tag == "br")
+        if (pos == text_begin)
         {
-            TextBlock br;
-            br.type = TextBlock::BlockType_Text;
-            br.is_line_break = true;
-            blocks.Push(br);
+            token = tag;
+            return true;
         }
-        else if (tag.StartsWith("color"))
-        {
-            if (!closing_tag)
-            {
-                stack.Push(block.format);
-                auto tokens = tag.Split('=');
-                if (tokens.Size() >= 2)
-                {
-                    UnescapeQuotes(tokens[1]);
-                    block.format.color = ParseHTMLColor(tokens[1]);
-                }
-            } else {
-                // pop font style from stack
-                if (!stack.Empty())
-                {
-                    block.format = stack.Back();
-                    stack.Pop();
-                } else
-                    block.format = default_block_format;
-            }
-        }
-        else if (tag.StartsWith("size"))
-        {
-            if (!closing_tag)
-            {
-                stack.Push(block.format);
-                auto tokens = tag.Split('=');
-                if (tokens.Size() >= 2)
-                {
-                    UnescapeQuotes(tokens[1]);
-                    block.format.font.size = ToInt(tokens[1]);
-                }
-            } else {
-                // pop font style from stack
-                if (!stack.Empty())
-                {
-                    block.format = stack.Back();
-                    stack.Pop();
-                } else
-                    block.format = default_block_format;
-            }
-        }
-        else if (tag.StartsWith("font "))
+
+        // return the text before the tag first
+        pending_tag_ = tag;
+        has_pending_tag_ = true;
+        break;
+    }
+
+    token.type = MarkupToken::TokenType_Text;
+    token.closing = false;
+    token.offset = text_begin;
+    if (has_pending_tag_)
+    {
+        token.span = MarkupSpan(data + text_begin, pos - text_begin);
+    }
+    else
+    {
+        // no more tags, everything left is text
+        token.span = MarkupSpan(data + text_begin, length - text_begin);
+        pos_ = length;
+    }
+    return true;
+}
+
+bool MarkupAttributeIterator::Next(MarkupSpan& name, MarkupSpan& value)
+{
+    while (pos_ < tag_.length)
+    {
+        while (pos_ < tag_.length && tag_.data[pos_] == ' ')
+            ++pos_;
+
+        unsigned begin = pos_;
+        bool in_quotes = false;
+        for (; pos_ < tag_.length; ++pos_)
         {
-            if (!closing_tag)
-            {
-                stack.Push(block.format);
-                auto font_tokens = QuotedSplit(tag.CString(), ' ');
-                for (auto& t : font_tokens)
-                {
-                  auto tokens = t.Split('=');
-                  if (tokens.Size() != 2)
-                    continue;
-
-                  const String& name = tokens[0];
-                  String& value = tokens[1];
-                  UnescapeQuotes(value);
-                  if (name == "face") {
-                    block.format.font.face = value;
-                  } else if (name == "color") {
-                    block.format.color = ParseHTMLColor(value);
-                  } else if (name == "size") {
-                    block.format.font.size = ToInt(value);
-                  }
-                }
-            }
-            else
-            {
-                // pop font style from stack
-                if (!stack.Empty()) {
-                    block.format = stack.Back();
-                    stack.Pop();
-                } else
-                    block.format = default_block_format;
-            }
+            if (tag_.data[pos_] == '\"')
+                in_quotes = !in_quotes;
+            else if (!in_quotes && tag_.data[pos_] == ' ')
+                break;
         }
-        else if (tag.StartsWith("font"))
+
+        // drop attributes with unbalanced quotes
+        if (in_quotes)
+            return false;
+
+        MarkupSpan attribute = tag_.Substring(begin, pos_ - begin);
+        unsigned eq = attribute.Find('=');
+        if (eq == String::NPOS || eq == 0 || eq + 1 >= attribute.length)
+            continue;
+
+        name = attribute.Substring(0, eq);
+        value = attribute.Substring(eq + 1).Unquoted();
+        return true;
+    }
+    return false;
+}
+
+void HTMLParser::Parse(const String& text, Vector<TextBlock>& blocks, const BlockFormat& default_block_format)
+{
+    Vector<TextBlockRef> refs;
+    Parse(text, refs, default_block_format);
+    Materialize(text, refs, blocks);
+}
+
+void MarkupParserState::PopFormat()
+{
+    if (!stack.Empty())
+    {
+        format = stack.Back().Get();
+        stack.Pop();
+    }
+    else
+        format = default_format;
+}
+
+namespace
+{
+
+/// FNV-1a hash of a tag name, usable in constant expressions.
+constexpr unsigned TagHash(const char* str, unsigned hash = 2166136261u)
+{
+    return *str ? TagHash(str + 1, (hash ^ (unsigned char)*str) * 16777619u) : hash;
+}
+
+/// FNV-1a hash of a tag name span, equals TagHash() of the same name.
+inline unsigned TagHash(const MarkupSpan& name)
+{
+    unsigned hash = 2166136261u;
+    for (unsigned i = 0; i < name.length; ++i)
+        hash = (hash ^ (unsigned char)name.data[i]) * 16777619u;
+    return hash;
+}
+
+void HandleBold(const MarkupToken& tag, MarkupParserState& state)
+{
+    state.format.font.bold = !tag.closing;
+}
+
+void HandleItalic(const MarkupToken& tag, MarkupParserState& state)
+{
+    state.format.font.italic = !tag.closing;
+}
+
+void HandleUnderlined(const MarkupToken& tag, MarkupParserState& state)
+{
+    state.format.underlined = !tag.closing;
+}
+
+void HandleSubscript(const MarkupToken& tag, MarkupParserState& state)
+{
+    state.format.subscript = !tag.closing;
+}
+
+void HandleSuperscript(const MarkupToken& tag, MarkupParserState& state)
+{
+    state.format.superscript = !tag.closing;
+}
+
+void HandleAlign(const MarkupToken& tag, MarkupParserState& state)
+{
+    MarkupSpan value;
+    if (tag.closing)
+      state.format.align = state.default_format.align;
+    else if (GetTagValue(tag.span, value))
+    {
+      if (value.Equals("center"))
+        state.format.align = HA_CENTER;
+      else if (value.Equals("right"))
+        state.format.align = HA_RIGHT;
+      else if (value.Equals("left"))
+        state.format.align = HA_LEFT;
+    }
+}
+
+void HandleLineBreak(const MarkupToken& tag, MarkupParserState& state)
+{
+    TextBlockRef br;
+    br.type = TextBlock::BlockType_Text;
+    br.is_line_break = true;
+    br.offset = state.GetOffset(tag.span);
+    state.blocks.Push(br);
+}
+
+void HandleColor(const MarkupToken& tag, MarkupParserState& state)
+{
+    if (tag.closing)
+    {
+        state.PopFormat();
+        return;
+    }
+
+    MarkupSpan value;
+    state.PushFormat();
+    if (GetTagValue(tag.span, value))
+        state.format.color = ParseHTMLColor(value);
+}
+
+void HandleSize(const MarkupToken& tag, MarkupParserState& state)
+{
+    if (tag.closing)
+    {
+        state.PopFormat();
+        return;
+    }
+
+    MarkupSpan value;
+    state.PushFormat();
+    if (GetTagValue(tag.span, value))
+        state.format.font.size = value.ToInt();
+}
+
+/// <font=face> or the HTML 4 style <font face=name color=color size=size>
+void HandleFont(const MarkupToken& tag, MarkupParserState& state)
+{
+    if (tag.closing)
+    {
+        state.PopFormat();
+        return;
+    }
+
+    MarkupSpan name, value;
+    state.PushFormat();
+    if (tag.span.length > 4 && tag.span.data[4] == '=')
+    {
+        if (GetTagValue(tag.span, value))
+            state.format.font.face = value.ToString();
+        return;
+    }
+
+    MarkupAttributeIterator attributes(tag.span);
+    while (attributes.Next(name, value))
+    {
+      if (name.Equals("face")) {
+        state.format.font.face = value.ToString();
+      } else if (name.Equals("color")) {
+        state.format.color = ParseHTMLColor(value);
+      } else if (name.Equals("size")) {
+        state.format.font.size = value.ToInt();
+      }
+    }
+}
+
+/// <img src=...> and <quad material=...>, images refer to a texture by src, quads to a material
+void HandleImage(const MarkupToken& tag, MarkupParserState& state)
+{
+    TextBlockRef img;
+    img.type = TextBlock::BlockType_Image;
+    const char* source_attribute = tag.span.StartsWith("img") ? "src" : "material";
+    MarkupAttributeIterator attributes(tag.span);
+    MarkupSpan name, value;
+    while (attributes.Next(name, value))
+    {
+        if (name.Equals("width"))
+            img.image_width = value.ToFloat();
+        else if (name.Equals("height"))
+            img.image_height = value.ToFloat();
+        else if (name.Equals(source_attribute))
         {
-            stack.Push(block.format);
-            auto tokens = tag.Split('=');
-            if (tokens.Size() == 2)
-            {
-                UnescapeQuotes(tokens[1]);
-                block.format.font.face = tokens[1];
-            }
-            else
-            {
-                // pop font style from stack
-                if (!stack.Empty()) {
-                    block.format = stack.Back();
-                    stack.Pop();
-                } else
-                    block.format = default_block_format;
-            }
+            img.offset = state.GetOffset(value);
+            img.length = value.length;
         }
-        else if (tag.StartsWith("img"))
+    }
+    state.blocks.Push(img);
+}
+
+void HandlePlugin(const MarkupToken& tag, MarkupParserState& state)
+{
+    TextBlockRef plugin;
+    plugin.type = TextBlock::BlockType_Plugin;
+    MarkupSpan data = tag.span.Substring(tag.span.Find(' ')).Trimmed();
+    plugin.offset = state.GetOffset(data);
+    plugin.length = data.length;
+    state.blocks.Push(plugin);
+}
+
+/// Built-in tags. The hashes are computed at compile time and the compiler turns the switch into
+/// a jump or binary search table; duplicate case values would not compile, so the hash is perfect
+/// over the supported tag set. The name is compared once to reject unknown tags with a colliding hash.
+MarkupTagHandler GetBuiltinTagHandler(const MarkupSpan& name)
+{
+    switch (TagHash(name))
+    {
+    case TagHash("b"): return name.Equals("b") ? HandleBold : nullptr;
+    case TagHash("i"): return name.Equals("i") ? HandleItalic : nullptr;
+    case TagHash("u"): return name.Equals("u") ? HandleUnderlined : nullptr;
+    case TagHash("sub"): return name.Equals("sub") ? HandleSubscript : nullptr;
+    case TagHash("sup"): return name.Equals("sup") ? HandleSuperscript : nullptr;
+    case TagHash("align"): return name.Equals("align") ? HandleAlign : nullptr;
+    case TagHash("br"): return name.Equals("br") ? HandleLineBreak : nullptr;
+    case TagHash("color"): return name.Equals("color") ? HandleColor : nullptr;
+    case TagHash("size"): return name.Equals("size") ? HandleSize : nullptr;
+    case TagHash("font"): return name.Equals("font") ? HandleFont : nullptr;
+    case TagHash("img"): return name.Equals("img") ? HandleImage : nullptr;
+    case TagHash("quad"): return name.Equals("quad") ? HandleImage : nullptr;
+    case TagHash("plugin"): return name.Equals("plugin") ? HandlePlugin : nullptr;
+    default: return nullptr;
+    }
+}
+
+struct RegisteredTag
+{
+    String name;
+    MarkupTagHandler handler;
+};
+
+/// Application registered tags, keyed by TagHash.
+HashMap<unsigned, RegisteredTag>& GetRegisteredTags()
+{
+    static HashMap<unsigned, RegisteredTag> tags;
+    return tags;
+}
+
+} // namespace
+
+void HTMLParser::RegisterTag(const String& name, MarkupTagHandler handler)
+{
+    RegisteredTag& tag = GetRegisteredTags()[TagHash(name.CString())];
+    tag.name = name;
+    tag.handler = handler;
+}
+
+void HTMLParser::UnregisterTag(const String& name)
+{
+    GetRegisteredTags().Erase(TagHash(name.CString()));
+}
+
+MarkupTagHandler HTMLParser::GetTagHandler(const MarkupSpan& name)
+{
+    HashMap<unsigned, RegisteredTag>& registered = GetRegisteredTags();
+    if (!registered.Empty())
+    {
+        HashMap<unsigned, RegisteredTag>::Iterator it = registered.Find(TagHash(name));
+        if (it != registered.End() && name.Equals(it->second_.name.CString()))
+            return it->second_.handler;
+    }
+    return GetBuiltinTagHandler(name);
+}
+
+MarkupSpan HTMLParser::GetTagName(const MarkupSpan& tag)
+{
+    unsigned length = 0;
+    while (length < tag.length && tag.data[length] != ' ' && tag.data[length] != '=')
+        ++length;
+    // self-closing tags, e.g. <br/>
+    if (length > 0 && tag.data[length - 1] == '/')
+        --length;
+    return MarkupSpan(tag.data, length);
+}
+
+namespace
+{
+
+void ParseMarkup(const String& text, unsigned offset, Vector<TextBlockRef>& blocks, const BlockFormat& default_block_format,
+  PODVector<MarkupCheckpoint>* checkpoints)
+{
+    MarkupParserState state(text, blocks, default_block_format);
+    const BlockStyle default_style = RichStyleTable::MakeStyle(default_block_format);
+
+    // in case there's no text at all, output an empty block
+    if (text.Empty())
+    {
+        TextBlockRef block;
+        block.style = default_style;
+        blocks.Push(block);
+        return;
+    }
+
+    MarkupTokenizer tokenizer(text, offset);
+    MarkupToken token;
+    // the text run is pushed when the next tag appears, runs not followed by a tag use the default format
+    MarkupSpan text_run;
+    bool has_text_run = false;
+
+    while (tokenizer.Next(token))
+    {
+        if (token.type == MarkupToken::TokenType_Text)
         {
-            TextBlock img;
-            img.type = TextBlock::BlockType_Image;
-            closing_tag = true;
-            auto img_tokens = tag.Split(' ');
-            for (auto& t : img_tokens)
-            {
-                auto tokens = t.Split('=');
-                if (tokens.Size() != 2)
-                    continue;
-
-                const String& name = tokens[0];
-                String& value = tokens[1];
-                UnescapeQuotes(value);
-                if (name == "width")
-                    img.image_width = ToFloat(value);
-                else if (name == "height")
-                    img.image_height = ToFloat(value);
-                else if (name == "src")
-                    img.text = value;
-            }
-            blocks.Push(img);
+            text_run = token.span;
+            has_text_run = true;
+            continue;
         }
-        else if (tag.StartsWith("quad"))
+
+        if (has_text_run)
         {
-            TextBlock quad;
-            quad.type = TextBlock::BlockType_Image;
-            closing_tag = true;
-            auto img_tokens = tag.Split(' ');
-            for (auto& t : img_tokens)
-            {
-                auto tokens = t.Split('=');
-                if (tokens.Size() != 2)
-                    continue;
-                const String& name = tokens[0];
-                String& value = tokens[1];
-                UnescapeQuotes(value);
-                if (name == "width")
-                    quad.image_width = ToFloat(value);
-                else if (name == "height")
-                    quad.image_height = ToFloat(value);
-                else if (name == "material")
-                    quad.text = value;
-            }
-            blocks.Push(quad);
+            TextBlockRef block;
+            block.style = RichStyleTable::MakeStyle(state.format);
+            block.offset = state.GetOffset(text_run);
+            block.length = text_run.length;
+            // push the current block everytime new block appears
+            blocks.Push(block);
+            has_text_run = false;
         }
-        else if (tag.StartsWith("plugin"))
+
+        MarkupTagHandler handler = HTMLParser::GetTagHandler(HTMLParser::GetTagName(token.span));
+        if (handler)
+            handler(token, state);
+
+        // nothing before this point affects the rest of the text
+        if (checkpoints && state.stack.Empty() && state.format == default_block_format)
         {
-          TextBlock plugin;
-          plugin.type = TextBlock::BlockType_Plugin;
-          plugin.text = tag.Substring(tag.Find(" ")).Trimmed();
-          closing_tag = true;
-          blocks.Push(plugin);
+            MarkupCheckpoint checkpoint;
+            checkpoint.offset = tokenizer.GetPosition();
+            checkpoint.num_blocks = blocks.Size();
+            checkpoints->Push(checkpoint);
         }
-
-        pos = tag_end + 1;
-        last_tag_end = tag_end + 1;
     }
 
     // copy anything after the last tag
-    if (last_tag_end < text.Length())
+    if (has_text_run)
     {
-        TextBlock block;
-        block.format = default_block_format;
-        block.text = text.Substring(last_tag_end, text.Length() - last_tag_end);
+        TextBlockRef block;
+        block.style = default_style;
+        block.offset = state.GetOffset(text_run);
+        block.length = text_run.length;
         blocks.Push(block);
     }
+}
+
+} // namespace
 
-    // append blocks that are not closed properly
-    /*if (!closing_tag && current_block && !current_block->text.Empty())
+/// Supported tags:
+///  <br> - line break
+///  <b></b> - bold
+///  <i></i> - italic
+///  <u></u> - underlined
+///  <sup></sup> - superscript
+///  <sub></sub> - subscript
+///  <align=left|right|center></align>
+///  <color=#FF800000></color> - change text color, supports 24/32 bit hex and color names
+///  <size=14></size> - change text size in pixels
+///  <font=Fonts/Annonymous Pro.ttf></font> - change text font
+///  <img src=image.png width=320 height=240 /> - embed an image
+///  <plugin type=typename key=val ... /> - embed a plugin
+///  TODO: <quad material=material.xml width=10 height=10 x=10 y=10 />
+/// More tags can be added with RegisterTag().
+void HTMLParser::Parse(const String& text, Vector<TextBlockRef>& blocks, const BlockFormat& default_block_format)
+{
+    ParseMarkup(text, 0, blocks, default_block_format, nullptr);
+}
+
+void HTMLParser::Parse(const String& text, unsigned offset, Vector<TextBlockRef>& blocks, const BlockFormat& default_block_format,
+  PODVector<MarkupCheckpoint>& checkpoints)
+{
+    ParseMarkup(text, offset, blocks, default_block_format, &checkpoints);
+}
+
+void HTMLParser::Materialize(const String& text, const Vector<TextBlockRef>& refs, Vector<TextBlock>& blocks)
+{
+    blocks.Reserve(blocks.Size() + refs.Size());
+    for (auto& ref : refs)
     {
+        TextBlock block;
+        block.type = ref.type;
+        block.style = ref.style;
+        block.image_width = ref.image_width;
+        block.image_height = ref.image_height;
+        block.is_line_break = ref.is_line_break;
+        // this is the only place the text gets copied
+        if (ref.length)
+            block.text = String(text.CString() + ref.offset, ref.length);
+        if (block.type == TextBlock::BlockType_Text)
+            block.DecodeText();
         blocks.Push(block);
-    }*/
+    }
 }
 
 } // namespace Urho3D
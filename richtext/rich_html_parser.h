@@ -2,17 +2,174 @@
 #define __RICH_HTML_PARSER_H__
 #pragma once
 
-#include "rich_text3d.h"
+#include "rich_widget.h"
 
 namespace Urho3D
 {
 
+/// A non-owning view into a range of characters, usually of a markup String.
+struct MarkupSpan
+{
+    MarkupSpan() {}
+    MarkupSpan(const char* data, unsigned length) : data(data), length(length) {}
+
+    /// Pointer to the first character (not null-terminated).
+    const char* data{};
+    /// Number of characters.
+    unsigned length{};
+
+    /// Is the span empty?
+    bool Empty() const { return length == 0; }
+    /// Compare with a null-terminated string.
+    bool Equals(const char* str) const;
+    /// Compare with a null-terminated string, ignoring ASCII case.
+    bool EqualsNoCase(const char* str) const;
+    /// Check if the span starts with a null-terminated string.
+    bool StartsWith(const char* str) const;
+    /// Find a character, returns String::NPOS if not found.
+    unsigned Find(char c, unsigned start = 0) const;
+    /// Return a sub-span, clamped to this span.
+    MarkupSpan Substring(unsigned pos, unsigned len = M_MAX_UNSIGNED) const;
+    /// Return the span without leading and trailing whitespace.
+    MarkupSpan Trimmed() const;
+    /// Return the span without surrounding double quotes (if both are present).
+    MarkupSpan Unquoted() const;
+    /// Parse as a base-10 integer (same rules as ToInt).
+    int ToInt() const;
+    /// Parse as a float (same rules as ToFloat).
+    float ToFloat() const;
+    /// Copy the characters to a new String.
+    String ToString() const { return String(data, length); }
+};
+
+/// A piece of markup: either a run of text or the inside of a tag.
+struct MarkupToken
+{
+    enum TokenType {
+        TokenType_Text,
+        TokenType_Tag,
+    };
+    /// Type of token
+    TokenType type{TokenType_Text};
+    /// Text run, or the tag content between '<' (or '</') and '>'
+    MarkupSpan span;
+    /// Offset of the span in the source text
+    unsigned offset{};
+    /// Is this a closing tag (</tag>)
+    bool closing{};
+};
+
+/// Splits markup into text runs and tags without copying the source text.
+class MarkupTokenizer
+{
+public:
+    /// Construct. The text must outlive the tokenizer.
+    explicit MarkupTokenizer(const String& text, unsigned offset = 0);
+    /// Get the next token. Returns false when the text ends.
+    bool Next(MarkupToken& token);
+    /// Current read position in the source text.
+    unsigned GetPosition() const { return pos_; }
+private:
+    const String& text_;
+    /// Next character to read.
+    unsigned pos_;
+    /// A tag found while scanning a text run, returned by the next call.
+    MarkupToken pending_tag_;
+    bool has_pending_tag_;
+};
+
+/// Iterates the space separated name=value attributes of a tag, honoring quotes.
+class MarkupAttributeIterator
+{
+public:
+    /// Construct from the tag span (including the tag name).
+    explicit MarkupAttributeIterator(const MarkupSpan& tag) : tag_(tag), pos_(0) {}
+    /// Get the next attribute, the value is unquoted. Returns false when there are no more attributes.
+    bool Next(MarkupSpan& name, MarkupSpan& value);
+private:
+    MarkupSpan tag_;
+    unsigned pos_;
+};
+
+/// A parsed block that references its text in the source markup instead of owning a copy.
+struct TextBlockRef
+{
+    /// Type of block
+    TextBlock::BlockType type{TextBlock::BlockType_Text};
+    /// Offset of the text, image/material source or plugin tag data in the source markup
+    unsigned offset{};
+    /// Length of the referenced text
+    unsigned length{};
+    /// Format of the block, see RichStyleTable
+    BlockStyle style;
+
+    float image_width{};
+    float image_height{};
+    bool is_line_break{};
+
+    /// Return a copy of the format of the block.
+    BlockFormat GetFormat() const { return style.Get(); }
+};
+
+/// A parse position right after a tag where the format stack is empty and the format is the default one.
+/// Parsing can resume from here as long as the text before the offset is unchanged.
+struct MarkupCheckpoint
+{
+    /// Offset in the source text
+    unsigned offset;
+    /// Number of blocks parsed before the offset
+    unsigned num_blocks;
+};
+
+/// The state of the markup parser, handed to tag handlers.
+struct MarkupParserState
+{
+    MarkupParserState(const String& text, Vector<TextBlockRef>& blocks, const BlockFormat& default_format)
+     : text(text), blocks(blocks), format(default_format), default_format(default_format) {}
+
+    /// Source text
+    const String& text;
+    /// Output blocks
+    Vector<TextBlockRef>& blocks;
+    /// Format of the text following the tag
+    BlockFormat format;
+    /// Formats saved by opening tags
+    Vector<BlockStyle> stack;
+    /// Format of unformatted text
+    const BlockFormat& default_format;
+
+    /// Save the current format, used by opening tags.
+    void PushFormat() { stack.Push(RichStyleTable::MakeStyle(format)); }
+    /// Restore the last saved format (or the default one), used by closing tags.
+    void PopFormat();
+    /// Get the offset of a span inside the source text.
+    unsigned GetOffset(const MarkupSpan& span) const { return (unsigned)(span.data - text.CString()); }
+};
+
+/// Handles a tag. Tags can change state.format or push blocks to state.blocks.
+typedef void (*MarkupTagHandler)(const MarkupToken& tag, MarkupParserState& state);
+
 /// An utility class that parses RichText markup.
 class HTMLParser
 {
 public:
+    /// Register a handler for a tag name, replaces built-in tags of the same name. Not thread safe, register tags at startup.
+    static void RegisterTag(const String& name, MarkupTagHandler handler);
+    /// Remove a registered tag handler.
+    static void UnregisterTag(const String& name);
+    /// Get the handler of a tag name, registered or built-in. Returns null for unknown tags.
+    static MarkupTagHandler GetTagHandler(const MarkupSpan& name);
+    /// Get the tag name part of a tag (before the first space or '=').
+    static MarkupSpan GetTagName(const MarkupSpan& tag);
     /// Parse the text and outputs the text as TextBlock array.
     static void Parse(const String& text, Vector<TextBlock>& blocks, const BlockFormat& default_block_format);
+    /// Parse the text and outputs blocks referencing ranges of the source text, nothing is copied.
+    static void Parse(const String& text, Vector<TextBlockRef>& blocks, const BlockFormat& default_block_format);
+    /// Parse the text from an offset (0 or a checkpoint) and record the checkpoints, their block counts are relative to the output.
+    static void Parse(const String& text, unsigned offset, Vector<TextBlockRef>& blocks, const BlockFormat& default_block_format,
+      PODVector<MarkupCheckpoint>& checkpoints);
+    /// Copy the referenced text of the blocks out of the source text.
+    static void Materialize(const String& text, const Vector<TextBlockRef>& refs, Vector<TextBlock>& blocks);
 };
 
 } // namespace Urho3D
@@ -1,6 +1,9 @@
 #include "gtest/gtest.h"
 
 #include "rich_html_parser.h"
+#include "rich_markup_cache.h"
+#include "rich_char_scanner.h"
+#include "rich_layout.h"
 
 #if defined(TARGET_WINDOWS)
 #pragma comment(lib, "Iphlpapi.lib")
@@ -15,9 +18,9 @@ TEST(RichTextHTMLParser, Html4FontStyle) {
   ASSERT_EQ(blocks.Size(), 1);
   EXPECT_EQ(blocks[0].text, "styled text");
   EXPECT_EQ(blocks[0].type, TextBlock::BlockType_Text);
-  EXPECT_EQ(blocks[0].format.font.size, 8);
-  EXPECT_EQ(blocks[0].format.font.face, "fontface");
-  EXPECT_EQ(blocks[0].format.color, Urho3D::Color::RED);
+  EXPECT_EQ(blocks[0].GetFormat().font.size, 8);
+  EXPECT_EQ(blocks[0].GetFormat().font.face, "fontface");
+  EXPECT_EQ(blocks[0].GetFormat().color, Urho3D::Color::RED);
 }
 
 TEST(RichTextHTMLParser, SingleBlock) {
@@ -30,12 +33,12 @@ TEST(RichTextHTMLParser, SingleBlock) {
   EXPECT_EQ(blocks[0].type, TextBlock::BlockType_Text);
   EXPECT_FALSE(blocks[0].is_line_break);
   EXPECT_TRUE(blocks[0].is_visible);
-  EXPECT_FALSE(blocks[0].format.font.bold);
-  EXPECT_FALSE(blocks[0].format.font.italic);
-  EXPECT_FALSE(blocks[0].format.underlined);
-  EXPECT_FALSE(blocks[0].format.striked);
-  EXPECT_FALSE(blocks[0].format.subscript);
-  EXPECT_FALSE(blocks[0].format.superscript);
+  EXPECT_FALSE(blocks[0].GetFormat().font.bold);
+  EXPECT_FALSE(blocks[0].GetFormat().font.italic);
+  EXPECT_FALSE(blocks[0].GetFormat().underlined);
+  EXPECT_FALSE(blocks[0].GetFormat().striked);
+  EXPECT_FALSE(blocks[0].GetFormat().subscript);
+  EXPECT_FALSE(blocks[0].GetFormat().superscript);
 }
 
 TEST(RichTextHTMLParser, MultipleBlocks) {
@@ -61,9 +64,9 @@ TEST(RichTextHTMLParser, Nesting) {
 
   EXPECT_STREQ(blocks[0].text.CString(), "outer block 1");
   EXPECT_STREQ(blocks[1].text.CString(), "inner block 2");
-  EXPECT_TRUE(blocks[1].format.font.bold);
+  EXPECT_TRUE(blocks[1].GetFormat().font.bold);
   EXPECT_STREQ(blocks[2].text.CString(), "nested block 3");
-  EXPECT_TRUE(blocks[2].format.font.bold && blocks[2].format.font.italic);
+  EXPECT_TRUE(blocks[2].GetFormat().font.bold && blocks[2].GetFormat().font.italic);
 }
 
 TEST(RichTextHTMLParser, FormatColor) {
@@ -75,9 +78,9 @@ TEST(RichTextHTMLParser, FormatColor) {
 
   EXPECT_STREQ(blocks[0].text.CString(), "default");
   EXPECT_STREQ(blocks[1].text.CString(), "red");
-  EXPECT_EQ(blocks[1].format.color, Urho3D::Color::RED);
+  EXPECT_EQ(blocks[1].GetFormat().color, Urho3D::Color::RED);
   EXPECT_STREQ(blocks[2].text.CString(), "blue");
-  EXPECT_EQ(blocks[2].format.color, Urho3D::Color::BLUE);
+  EXPECT_EQ(blocks[2].GetFormat().color, Urho3D::Color::BLUE);
   EXPECT_STREQ(blocks[3].text.CString(), "default 2");
 
   // nesting
@@ -87,9 +90,9 @@ TEST(RichTextHTMLParser, FormatColor) {
 
   EXPECT_STREQ(blocks[0].text.CString(), "default");
   EXPECT_STREQ(blocks[1].text.CString(), "red");
-  EXPECT_EQ(blocks[1].format.color, Urho3D::Color::RED);
+  EXPECT_EQ(blocks[1].GetFormat().color, Urho3D::Color::RED);
   EXPECT_STREQ(blocks[2].text.CString(), "blue");
-  EXPECT_EQ(blocks[2].format.color, Urho3D::Color::BLUE);
+  EXPECT_EQ(blocks[2].GetFormat().color, Urho3D::Color::BLUE);
   EXPECT_STREQ(blocks[3].text.CString(), "default 2");
 
   // default color after tag closed
@@ -99,11 +102,11 @@ TEST(RichTextHTMLParser, FormatColor) {
   Urho3D::HTMLParser::Parse("<color=yellow>y</color>2  2312 <color=blue>b</color>", blocks, white_font);
   ASSERT_EQ(blocks.Size(), 3);
   EXPECT_STREQ(blocks[0].text.CString(), "y");
-  EXPECT_EQ(blocks[0].format.color, Urho3D::Color::YELLOW);
+  EXPECT_EQ(blocks[0].GetFormat().color, Urho3D::Color::YELLOW);
   EXPECT_STREQ(blocks[1].text.CString(), "2  2312 ");
-  EXPECT_EQ(blocks[1].format.color, Urho3D::Color::WHITE);
+  EXPECT_EQ(blocks[1].GetFormat().color, Urho3D::Color::WHITE);
   EXPECT_STREQ(blocks[2].text.CString(), "b");
-  EXPECT_EQ(blocks[2].format.color, Urho3D::Color::BLUE);
+  EXPECT_EQ(blocks[2].GetFormat().color, Urho3D::Color::BLUE);
 
 }
 
@@ -117,13 +120,13 @@ TEST(RichTextHTMLParser, FormatSize) {
 
   ASSERT_EQ(blocks.Size(), 4);
   EXPECT_STREQ(blocks[0].text.CString(), "size 10");
-  EXPECT_EQ(blocks[0].format.font.size, 10);
+  EXPECT_EQ(blocks[0].GetFormat().font.size, 10);
   EXPECT_STREQ(blocks[1].text.CString(), "size 12");
-  EXPECT_EQ(blocks[1].format.font.size, 12);
+  EXPECT_EQ(blocks[1].GetFormat().font.size, 12);
   EXPECT_STREQ(blocks[2].text.CString(), "size 14");
-  EXPECT_EQ(blocks[2].format.font.size, 14);
+  EXPECT_EQ(blocks[2].GetFormat().font.size, 14);
   EXPECT_STREQ(blocks[3].text.CString(), "size 10 2");
-  EXPECT_EQ(blocks[3].format.font.size, 10);
+  EXPECT_EQ(blocks[3].GetFormat().font.size, 10);
 }
 
 TEST(RichTextHTMLParser, FormatFace) {
@@ -136,13 +139,13 @@ TEST(RichTextHTMLParser, FormatFace) {
 
   ASSERT_EQ(blocks.Size(), 4);
   EXPECT_STREQ(blocks[0].text.CString(), "face default");
-  EXPECT_STREQ(blocks[0].format.font.face.CString(), "default");
+  EXPECT_STREQ(blocks[0].GetFormat().font.face.CString(), "default");
   EXPECT_STREQ(blocks[1].text.CString(), "face first");
-  EXPECT_STREQ(blocks[1].format.font.face.CString(), "first");
+  EXPECT_STREQ(blocks[1].GetFormat().font.face.CString(), "first");
   EXPECT_STREQ(blocks[2].text.CString(), "face second");
-  EXPECT_STREQ(blocks[2].format.font.face.CString(), "second");
+  EXPECT_STREQ(blocks[2].GetFormat().font.face.CString(), "second");
   EXPECT_STREQ(blocks[3].text.CString(), "face default 2");
-  EXPECT_STREQ(blocks[3].format.font.face.CString(), "default");
+  EXPECT_STREQ(blocks[3].GetFormat().font.face.CString(), "default");
 }
 
 TEST(RichTextHTMLParser, Image) {
@@ -205,9 +208,9 @@ TEST(RichTextHTMLParser, HTMLCompatibilityTags) {
   EXPECT_STREQ(blocks[0].text.CString(), "text ");
   EXPECT_EQ(blocks[1].type, TextBlock::BlockType_Text);
   EXPECT_STREQ(blocks[1].text.CString(), "formatted");
-  EXPECT_EQ(blocks[1].format.color, Urho3D::Color::RED);
-  EXPECT_EQ(blocks[1].format.font.size, 13);
-  EXPECT_STREQ(blocks[1].format.font.face.CString(), "Roboto");
+  EXPECT_EQ(blocks[1].GetFormat().color, Urho3D::Color::RED);
+  EXPECT_EQ(blocks[1].GetFormat().font.size, 13);
+  EXPECT_STREQ(blocks[1].GetFormat().font.face.CString(), "Roboto");
 }
 
 TEST(RichTextHTMLParser, FontNameWithSpace) {
@@ -220,7 +223,7 @@ TEST(RichTextHTMLParser, FontNameWithSpace) {
   EXPECT_STREQ(blocks[0].text.CString(), "text ");
   EXPECT_EQ(blocks[1].type, TextBlock::BlockType_Text);
   EXPECT_STREQ(blocks[1].text.CString(), "formatted");
-  EXPECT_STREQ(blocks[1].format.font.face.CString(), "Anonymous Pro");
+  EXPECT_STREQ(blocks[1].GetFormat().font.face.CString(), "Anonymous Pro");
 
   blocks.Clear();
   Urho3D::HTMLParser::Parse("text <font face=\"Anonymous Pro\">formatted</font>", blocks, Urho3D::BlockFormat());
@@ -230,7 +233,7 @@ TEST(RichTextHTMLParser, FontNameWithSpace) {
   EXPECT_STREQ(blocks[0].text.CString(), "text ");
   EXPECT_EQ(blocks[1].type, TextBlock::BlockType_Text);
   EXPECT_STREQ(blocks[1].text.CString(), "formatted");
-  EXPECT_STREQ(blocks[1].format.font.face.CString(), "Anonymous Pro");
+  EXPECT_STREQ(blocks[1].GetFormat().font.face.CString(), "Anonymous Pro");
 }
 
 TEST(RichTextHTMLParser, BugHTMLFriendsTitle) {
@@ -241,17 +244,586 @@ TEST(RichTextHTMLParser, BugHTMLFriendsTitle) {
   ASSERT_EQ(blocks.Size(), 13);
 
 
-  EXPECT_STREQ(blocks[0].format.font.face.CString(), "GF@Gloria Hallelujah");
-  EXPECT_STREQ(blocks[1].format.font.face.CString(), "GF@Gloria Hallelujah");
-  EXPECT_STREQ(blocks[2].format.font.face.CString(), "GF@Gloria Hallelujah");
-  EXPECT_STREQ(blocks[3].format.font.face.CString(), "GF@Gloria Hallelujah");
-  EXPECT_STREQ(blocks[4].format.font.face.CString(), "GF@Gloria Hallelujah");
-  EXPECT_STREQ(blocks[5].format.font.face.CString(), "GF@Gloria Hallelujah");
-  EXPECT_STREQ(blocks[6].format.font.face.CString(), "GF@Gloria Hallelujah");
-  EXPECT_STREQ(blocks[7].format.font.face.CString(), "GF@Gloria Hallelujah");
-  EXPECT_STREQ(blocks[8].format.font.face.CString(), "GF@Gloria Hallelujah");
-  EXPECT_STREQ(blocks[9].format.font.face.CString(), "GF@Gloria Hallelujah");
-  EXPECT_STREQ(blocks[10].format.font.face.CString(), "GF@Gloria Hallelujah");
-  EXPECT_STREQ(blocks[11].format.font.face.CString(), "GF@Gloria Hallelujah");
-  EXPECT_STREQ(blocks[12].format.font.face.CString(), "GF@Gloria Hallelujah");
+  EXPECT_STREQ(blocks[0].GetFormat().font.face.CString(), "GF@Gloria Hallelujah");
+  EXPECT_STREQ(blocks[1].GetFormat().font.face.CString(), "GF@Gloria Hallelujah");
+  EXPECT_STREQ(blocks[2].GetFormat().font.face.CString(), "GF@Gloria Hallelujah");
+  EXPECT_STREQ(blocks[3].GetFormat().font.face.CString(), "GF@Gloria Hallelujah");
+  EXPECT_STREQ(blocks[4].GetFormat().font.face.CString(), "GF@Gloria Hallelujah");
+  EXPECT_STREQ(blocks[5].GetFormat().font.face.CString(), "GF@Gloria Hallelujah");
+  EXPECT_STREQ(blocks[6].GetFormat().font.face.CString(), "GF@Gloria Hallelujah");
+  EXPECT_STREQ(blocks[7].GetFormat().font.face.CString(), "GF@Gloria Hallelujah");
+  EXPECT_STREQ(blocks[8].GetFormat().font.face.CString(), "GF@Gloria Hallelujah");
+  EXPECT_STREQ(blocks[9].GetFormat().font.face.CString(), "GF@Gloria Hallelujah");
+  EXPECT_STREQ(blocks[10].GetFormat().font.face.CString(), "GF@Gloria Hallelujah");
+  EXPECT_STREQ(blocks[11].GetFormat().font.face.CString(), "GF@Gloria Hallelujah");
+  EXPECT_STREQ(blocks[12].GetFormat().font.face.CString(), "GF@Gloria Hallelujah");
+}
+
+TEST(RichTextHTMLParser, Tokenizer) {
+  Urho3D::String text("a<b>bold</b><>c<color=\"red\">");
+  Urho3D::MarkupTokenizer tokenizer(text);
+  Urho3D::MarkupToken token;
+
+  ASSERT_TRUE(tokenizer.Next(token));
+  EXPECT_EQ(token.type, Urho3D::MarkupToken::TokenType_Text);
+  EXPECT_STREQ(token.span.ToString().CString(), "a");
+  ASSERT_TRUE(tokenizer.Next(token));
+  EXPECT_EQ(token.type, Urho3D::MarkupToken::TokenType_Tag);
+  EXPECT_FALSE(token.closing);
+  EXPECT_TRUE(token.span.Equals("b"));
+  ASSERT_TRUE(tokenizer.Next(token));
+  EXPECT_STREQ(token.span.ToString().CString(), "bold");
+  ASSERT_TRUE(tokenizer.Next(token));
+  EXPECT_TRUE(token.closing);
+  EXPECT_TRUE(token.span.Equals("b"));
+  // <> is not a tag
+  ASSERT_TRUE(tokenizer.Next(token));
+  EXPECT_EQ(token.type, Urho3D::MarkupToken::TokenType_Text);
+  EXPECT_STREQ(token.span.ToString().CString(), "<>c");
+  ASSERT_TRUE(tokenizer.Next(token));
+  EXPECT_EQ(token.type, Urho3D::MarkupToken::TokenType_Tag);
+  EXPECT_TRUE(token.span.Equals("color=\"red\""));
+  EXPECT_EQ(token.span.data, text.CString() + token.offset);
+  EXPECT_FALSE(tokenizer.Next(token));
+}
+
+TEST(RichTextHTMLParser, BlockRefs) {
+  Urho3D::Vector<Urho3D::TextBlockRef> refs;
+  Urho3D::String text("plain <b>bold</b><img src=\"a b.png\" width=8>");
+
+  Urho3D::HTMLParser::Parse(text, refs, Urho3D::BlockFormat());
+  ASSERT_EQ(refs.Size(), 3);
+
+  EXPECT_EQ(refs[0].offset, 0);
+  EXPECT_EQ(refs[0].length, 6);
+  EXPECT_EQ(refs[1].offset, 9);
+  EXPECT_EQ(refs[1].length, 4);
+  EXPECT_TRUE(refs[1].GetFormat().font.bold);
+  EXPECT_EQ(refs[2].type, TextBlock::BlockType_Image);
+  EXPECT_FLOAT_EQ(refs[2].image_width, 8.0f);
+
+  Urho3D::Vector<Urho3D::TextBlock> blocks;
+  Urho3D::HTMLParser::Materialize(text, refs, blocks);
+  ASSERT_EQ(blocks.Size(), 3);
+  EXPECT_STREQ(blocks[0].text.CString(), "plain ");
+  EXPECT_STREQ(blocks[1].text.CString(), "bold");
+  EXPECT_STREQ(blocks[2].text.CString(), "a b.png");
+}
+
+TEST(RichTextHTMLParser, MarkupCache) {
+  Urho3D::RichMarkupCache cache(2);
+  Urho3D::Vector<Urho3D::TextBlock> blocks;
+  Urho3D::BlockFormat big_font;
+  big_font.font.size = 30;
+
+  cache.Parse("name <b>plate</b>", blocks, Urho3D::BlockFormat());
+  ASSERT_EQ(blocks.Size(), 2);
+  EXPECT_EQ(cache.GetMisses(), 1);
+
+  blocks.Clear();
+  cache.Parse("name <b>plate</b>", blocks, Urho3D::BlockFormat());
+  ASSERT_EQ(blocks.Size(), 2);
+  EXPECT_STREQ(blocks[1].text.CString(), "plate");
+  EXPECT_TRUE(blocks[1].GetFormat().font.bold);
+  EXPECT_EQ(cache.GetHits(), 1);
+
+  // a different default format is a different entry
+  blocks.Clear();
+  cache.Parse("name <b>plate</b>", blocks, big_font);
+  EXPECT_EQ(blocks[0].GetFormat().font.size, 30);
+  EXPECT_EQ(cache.GetMisses(), 2);
+
+  // the least recently used entry is dropped
+  blocks.Clear();
+  cache.Parse("other", blocks, Urho3D::BlockFormat());
+  EXPECT_EQ(cache.GetNumEntries(), 2);
+  blocks.Clear();
+  cache.Parse("name <b>plate</b>", blocks, big_font);
+  EXPECT_EQ(cache.GetHits(), 2);
+  blocks.Clear();
+  cache.Parse("name <b>plate</b>", blocks, Urho3D::BlockFormat());
+  EXPECT_EQ(cache.GetMisses(), 4);
+}
+
+namespace {
+
+void HandleStrike(const Urho3D::MarkupToken& tag, Urho3D::MarkupParserState& state) {
+  state.format.striked = !tag.closing;
+}
+
+} // namespace
+
+TEST(RichTextHTMLParser, TagDispatch) {
+  Urho3D::Vector<Urho3D::TextBlock> blocks;
+
+  // unknown tags are dropped, self-closing tags are recognized
+  Urho3D::HTMLParser::Parse("a<s>b</s><br/>c", blocks, Urho3D::BlockFormat());
+  ASSERT_EQ(blocks.Size(), 4);
+  EXPECT_FALSE(blocks[1].GetFormat().striked);
+  EXPECT_TRUE(blocks[2].is_line_break);
+
+  Urho3D::HTMLParser::RegisterTag("s", HandleStrike);
+  blocks.Clear();
+  Urho3D::HTMLParser::Parse("a<s>b</s>c<b>d</b>", blocks, Urho3D::BlockFormat());
+  ASSERT_EQ(blocks.Size(), 4);
+  EXPECT_FALSE(blocks[0].GetFormat().striked);
+  EXPECT_TRUE(blocks[1].GetFormat().striked);
+  EXPECT_FALSE(blocks[2].GetFormat().striked);
+  EXPECT_TRUE(blocks[3].GetFormat().font.bold);
+  Urho3D::HTMLParser::UnregisterTag("s");
+
+  // closing font tags restore the previous face
+  blocks.Clear();
+  Urho3D::HTMLParser::Parse("<font=a>x</font>y<b>z</b>", blocks, Urho3D::BlockFormat());
+  ASSERT_EQ(blocks.Size(), 3);
+  EXPECT_STREQ(blocks[0].GetFormat().font.face.CString(), "a");
+  EXPECT_TRUE(blocks[1].GetFormat().font.face.Empty());
+  EXPECT_TRUE(blocks[2].GetFormat().font.face.Empty());
+}
+
+TEST(RichTextHTMLParser, CharScanner) {
+  Urho3D::RichCharScanner scanner(" ,<");
+  // long enough to cover the vector and scalar paths
+  Urho3D::String text("abcdefghijklmnopqrstuvwxyz0123456789 abcdefghij,klmnopqrstuvwxyz<0123");
+  EXPECT_EQ(scanner.FindFirst(text), 36);
+  EXPECT_EQ(scanner.FindFirst(text, 37), 47);
+  EXPECT_EQ(scanner.FindFirst(text, 48), 64);
+  EXPECT_EQ(scanner.FindFirst(text, 65), Urho3D::String::NPOS);
+
+  Urho3D::PODVector<unsigned> offsets;
+  scanner.FindAll(text.CString(), text.Length(), offsets);
+  ASSERT_EQ(offsets.Size(), 3);
+  EXPECT_EQ(offsets[0], 36);
+  EXPECT_EQ(offsets[1], 47);
+  EXPECT_EQ(offsets[2], 64);
+
+  Urho3D::Vector<Urho3D::String> words;
+  Urho3D::SplitWords("one, two", words, scanner);
+  ASSERT_EQ(words.Size(), 4);
+  EXPECT_STREQ(words[0].CString(), "one");
+  EXPECT_STREQ(words[1].CString(), ",");
+  EXPECT_STREQ(words[2].CString(), " ");
+  EXPECT_STREQ(words[3].CString(), "two");
+
+  // a trailing delimiter still ends with an empty word
+  words.Clear();
+  Urho3D::SplitWords("one ", words, scanner);
+  ASSERT_EQ(words.Size(), 3);
+  EXPECT_TRUE(words[2].Empty());
+
+  // one pass reports the classes of the characters found
+  const char* const classes[] = { " ,", "<>", "\r" };
+  Urho3D::RichCharScanner class_scanner(classes, 3);
+  Urho3D::PODVector<Urho3D::RichCharMatch> matches;
+  EXPECT_EQ(class_scanner.Scan(text.CString(), text.Length(), matches), 3u);
+  ASSERT_EQ(matches.Size(), 3);
+  EXPECT_EQ(matches[1].offset, 47);
+  EXPECT_EQ(matches[1].classes, 1u);
+  EXPECT_EQ(matches[2].offset, 64);
+  EXPECT_EQ(matches[2].classes, 2u);
+
+  // characters of the other classes are dropped from the words
+  const char* const word_classes[] = { " ", "\r" };
+  Urho3D::RichCharScanner word_scanner(word_classes, 2);
+  words.Clear();
+  EXPECT_TRUE(Urho3D::SplitWords("o\rne two\r", words, word_scanner));
+  ASSERT_EQ(words.Size(), 3);
+  EXPECT_STREQ(words[0].CString(), "one");
+  EXPECT_STREQ(words[2].CString(), "two");
+  words.Clear();
+  EXPECT_FALSE(Urho3D::SplitWords("one two", words, word_scanner));
+}
+
+TEST(RichTextHTMLParser, DecodedText) {
+  Urho3D::Vector<Urho3D::TextBlock> blocks;
+  Urho3D::HTMLParser::Parse("a\xc3\xa4<img src=x.png/>", blocks, Urho3D::BlockFormat());
+  ASSERT_EQ(blocks.Size(), 2);
+  ASSERT_EQ(blocks[0].chars.Size(), 2);
+  EXPECT_EQ(blocks[0].chars[0], 'a');
+  EXPECT_EQ(blocks[0].chars[1], 0xe4);
+  // only text blocks are decoded
+  EXPECT_TRUE(blocks[1].chars.Empty());
+}
+
+TEST(RichTextHTMLParser, StyleTable) {
+  Urho3D::BlockFormat format;
+  EXPECT_EQ(Urho3D::RichStyleTable::MakeStyle(format).id, 0);
+
+  format.font.face = "Fonts/StyleTable.ttf";
+  format.font.bold = true;
+  Urho3D::BlockStyle style = Urho3D::RichStyleTable::MakeStyle(format);
+  EXPECT_NE(style.id, 0);
+  EXPECT_EQ(Urho3D::RichStyleTable::MakeStyle(format).id, style.id);
+  EXPECT_TRUE(style.Get() == format);
+
+  // the color is kept by the style, not in the table
+  format.color = Urho3D::Color::RED;
+  Urho3D::BlockStyle red = Urho3D::RichStyleTable::MakeStyle(format);
+  EXPECT_EQ(red.id, style.id);
+  EXPECT_NE(red, style);
+  EXPECT_TRUE(red.Get() == format);
+
+  // blocks with the same format share an ID
+  Urho3D::Vector<Urho3D::TextBlock> blocks;
+  Urho3D::HTMLParser::Parse("<b>a</b>b<b>c</b><b><color=red>d</color></b>", blocks, Urho3D::BlockFormat());
+  ASSERT_EQ(blocks.Size(), 4);
+  EXPECT_EQ(blocks[0].style, blocks[2].style);
+  EXPECT_NE(blocks[0].style, blocks[1].style);
+  EXPECT_EQ(blocks[0].style.id, blocks[3].style.id);
+  EXPECT_EQ(blocks[3].GetFormat().color, Urho3D::Color::RED);
+}
+
+TEST(RichTextHTMLParser, StyleTableRelease) {
+  // IDs no block refers to are reused, recently made styles stay referenced by the lookup cache of the thread
+  const unsigned num_styles = Urho3D::RichStyleTable::GetNumStyles();
+  Urho3D::BlockFormat format;
+  format.font.face = "released";
+  for (unsigned size = 1; size <= 1000; ++size)
+  {
+    format.font.size = size;
+    Urho3D::TextBlock block;
+    block.SetFormat(format);
+  }
+  EXPECT_LE(Urho3D::RichStyleTable::GetNumStyles(), num_styles + 16);
+}
+
+TEST(RichTextHTMLParser, IncrementalParse) {
+  Urho3D::RichMarkupCache::Get().SetMaxTextLength(0);
+
+  Urho3D::String text("<color=red>line 1</color>\n<b>line 2</b>\n");
+  Urho3D::RichMarkupDocument document;
+  document.Update(text, Urho3D::BlockFormat());
+  EXPECT_EQ(document.GetNumReusedBlocks(), 0);
+
+  // appending keeps the blocks before the last top-level tag
+  text += "<i>line 3</i>\n";
+  document.Update(text, Urho3D::BlockFormat());
+  EXPECT_EQ(document.GetNumReusedBlocks(), 3);
+
+  Urho3D::Vector<Urho3D::TextBlock> full;
+  Urho3D::HTMLParser::Parse(text, full, Urho3D::BlockFormat());
+  ASSERT_EQ(document.GetBlocks().Size(), full.Size());
+  for (unsigned i = 0; i < full.Size(); ++i)
+  {
+    EXPECT_STREQ(document.GetBlocks()[i].text.CString(), full[i].text.CString());
+    EXPECT_EQ(document.GetBlocks()[i].style, full[i].style);
+  }
+
+  // edits inside an open tag re-parse from the tag
+  text = "<color=red>line 1</color>\n<b>line 2 edited</b>\n<i>line 3</i>\n";
+  document.Update(text, Urho3D::BlockFormat());
+  EXPECT_EQ(document.GetNumReusedBlocks(), 1);
+  full.Clear();
+  Urho3D::HTMLParser::Parse(text, full, Urho3D::BlockFormat());
+  ASSERT_EQ(document.GetBlocks().Size(), full.Size());
+  EXPECT_STREQ(document.GetBlocks()[2].text.CString(), "line 2 edited");
+
+  // the same text reuses everything, a different default format nothing
+  document.Update(text, Urho3D::BlockFormat());
+  EXPECT_EQ(document.GetNumReusedBlocks(), full.Size());
+  Urho3D::BlockFormat format;
+  format.font.size = 20;
+  document.Update(text, format);
+  EXPECT_EQ(document.GetNumReusedBlocks(), 0);
+
+  // a swapped document keeps the parse state
+  Urho3D::RichMarkupDocument other;
+  other.Swap(document);
+  EXPECT_TRUE(document.GetBlocks().Empty());
+  other.Update(text, format);
+  EXPECT_EQ(other.GetNumReusedBlocks(), full.Size());
+
+  Urho3D::RichMarkupCache::Get().SetMaxTextLength(4096);
+}
+
+namespace {
+
+/// Every character is 10x20 pixels, rows are as high as the font size or 20 pixels.
+class FixedMeasurer : public Urho3D::RichLayoutMeasurer {
+public:
+  void SetFormat(const Urho3D::BlockFormat& format) override { row_height = format.font.size ? (float)format.font.size : 20.0f; }
+  Urho3D::Vector2 MeasureText(const Urho3D::String& text) override {
+    ++num_measured;
+    return Urho3D::Vector2(10.0f * text.Length(), 20.0f);
+  }
+  Urho3D::Vector2 MeasureChars(const Urho3D::PODVector<unsigned>& chars) override { return Urho3D::Vector2(10.0f * chars.Size(), 20.0f); }
+  void MeasurePrefixes(const Urho3D::String& text, Urho3D::PODVector<unsigned>& char_ends, Urho3D::PODVector<float>& widths) override {
+    for (unsigned i = 0; i < text.Length(); ++i) {
+      char_ends.Push(i + 1);
+      widths.Push(10.0f * (i + 1));
+    }
+  }
+  float GetRowHeight() override { return row_height; }
+  float GetImageAspect(const Urho3D::String& source) override { return 2.0f; }
+
+  unsigned num_measured{};
+  float row_height{20.0f};
+};
+
+} // namespace
+
+TEST(RichTextHTMLParser, Layout) {
+  FixedMeasurer measurer;
+  Urho3D::RichLayoutEngine engine(&measurer);
+  engine.SetLayoutRect(Urho3D::IntRect(0, 0, 100, 0));
+
+  Urho3D::Vector<Urho3D::TextBlock> blocks;
+  Urho3D::HTMLParser::Parse("one two three four\n<b>five</b>", blocks, Urho3D::BlockFormat());
+  Urho3D::Vector<Urho3D::TextLine> lines;
+  engine.Arrange(blocks, lines);
+
+  // "one two three " is 140 pixels wide, so "three" wraps
+  ASSERT_EQ(lines.Size(), 3);
+  EXPECT_STREQ(lines[0].blocks[0].text.CString(), "one two ");
+  EXPECT_STREQ(lines[1].blocks[0].text.CString(), "three four");
+  EXPECT_STREQ(lines[2].blocks[0].text.CString(), "five");
+  // wrapped blocks keep the width measured while wrapping
+  EXPECT_EQ(lines[0].blocks[0].width, 80.0f);
+  // and their text is decoded
+  EXPECT_EQ(lines[1].blocks[0].chars.Size(), 10);
+  EXPECT_EQ(lines[1].blocks[0].chars[0], 't');
+  EXPECT_EQ(engine.GetWrappedSize().x_, 100);
+
+  Urho3D::PODVector<Urho3D::RichLayoutRun> runs;
+  engine.SetLineSpacing(2);
+  engine.Place(lines, 1, 100, 5, runs);
+  ASSERT_EQ(runs.Size(), 2);
+  EXPECT_EQ(runs[0].line, 0);
+  EXPECT_EQ(runs[0].position.y_, 5);
+  EXPECT_EQ(runs[1].line, 1);
+  EXPECT_EQ(runs[1].position.y_, 27);
+  EXPECT_EQ(engine.GetLineTops().Size(), 2);
+  EXPECT_EQ(engine.GetContentSize().x_, 100.0f);
+  EXPECT_EQ(engine.GetContentSize().y_, 49.0f);
+
+  // without wrapping every line break starts a line
+  lines.Clear();
+  engine.SetWordWrap(false);
+  engine.Arrange(blocks, lines);
+  ASSERT_EQ(lines.Size(), 2);
+  EXPECT_LT(lines[0].blocks[0].width, 0.0f);
+  runs.Clear();
+  engine.Place(lines, 0, 100, 0, runs);
+  EXPECT_EQ(lines[0].blocks[0].width, 180.0f);
+
+  // words wider than the layout are split
+  lines.Clear();
+  blocks.Clear();
+  engine.SetWordWrap(true);
+  Urho3D::HTMLParser::Parse("0123456789abcdefghijklmnopqrstuvwxy", blocks, Urho3D::BlockFormat());
+  engine.Arrange(blocks, lines);
+  ASSERT_EQ(lines.Size(), 4);
+  EXPECT_STREQ(lines[0].blocks[0].text.CString(), "0123456789");
+  EXPECT_STREQ(lines[1].blocks[0].text.CString(), "abcdefghij");
+  EXPECT_STREQ(lines[2].blocks[0].text.CString(), "klmnopqrst");
+  EXPECT_STREQ(lines[3].blocks[0].text.CString(), "uvwxy");
+  EXPECT_EQ(engine.GetWrappedSize().y_, 80);
+
+  // a line is as high as its highest font, a wrapped line only as high as its own fonts
+  lines.Clear();
+  blocks.Clear();
+  Urho3D::HTMLParser::Parse("<size=40>big</size> small words here\n<size=30>x</size>y", blocks, Urho3D::BlockFormat());
+  engine.Arrange(blocks, lines);
+  ASSERT_EQ(lines.Size(), 3);
+  EXPECT_STREQ(lines[1].blocks[0].text.CString(), "words here");
+  EXPECT_EQ(engine.GetWrappedSize().y_, 40 + 20 + 30);
+}
+
+TEST(RichTextHTMLParser, LayoutWords) {
+  FixedMeasurer measurer;
+  Urho3D::RichLayoutEngine engine(&measurer);
+  engine.SetLayoutRect(Urho3D::IntRect(0, 0, 100, 0));
+
+  Urho3D::Vector<Urho3D::TextBlock> blocks;
+  Urho3D::HTMLParser::Parse("one two three four\r\n<b>five</b>", blocks, Urho3D::BlockFormat());
+  Urho3D::RichLayoutWords words;
+  engine.Segment(blocks, words);
+  ASSERT_EQ(words.lines.Size(), 2);
+  EXPECT_STREQ(words.lines[0].blocks[0].text.CString(), "one two three four");
+  EXPECT_EQ(measurer.num_measured, 0);
+
+  // the first fill measures the words and wraps like Arrange()
+  Urho3D::Vector<Urho3D::TextLine> lines;
+  engine.Fill(words, lines);
+  ASSERT_EQ(lines.Size(), 3);
+  EXPECT_STREQ(lines[1].blocks[0].text.CString(), "three four");
+  const unsigned num_measured = measurer.num_measured;
+  EXPECT_GT(num_measured, 0);
+
+  // another width only fills the lines again
+  lines.Clear();
+  engine.SetLayoutRect(Urho3D::IntRect(0, 0, 60, 0));
+  engine.Fill(words, lines);
+  ASSERT_EQ(lines.Size(), 5);
+  EXPECT_STREQ(lines[0].blocks[0].text.CString(), "one ");
+  EXPECT_STREQ(lines[2].blocks[0].text.CString(), "three ");
+  EXPECT_EQ(lines[0].blocks[0].width, 40.0f);
+  EXPECT_EQ(measurer.num_measured, num_measured);
+}
+
+TEST(RichTextHTMLParser, LayoutMetrics) {
+  FixedMeasurer measurer;
+  Urho3D::Vector<Urho3D::TextBlock> blocks;
+  Urho3D::HTMLParser::Parse("one two three four\n<b>five</b><img src=\"a.png\">", blocks, Urho3D::BlockFormat());
+
+  // the copied metrics wrap the same as the measurer they were copied from
+  Urho3D::RichLayoutMetrics metrics;
+  Urho3D::RichLayoutEngine engine(&metrics);
+  engine.SetLayoutRect(Urho3D::IntRect(0, 0, 100, 0));
+  Urho3D::RichLayoutWords words;
+  engine.Segment(blocks, words);
+  metrics.Capture(measurer, words.lines, Urho3D::BlockFormat());
+  Urho3D::Vector<Urho3D::TextLine> lines;
+  engine.Fill(words, lines);
+  ASSERT_EQ(lines.Size(), 3);
+  EXPECT_STREQ(lines[1].blocks[0].text.CString(), "three four");
+  EXPECT_EQ(metrics.GetImageAspect("a.png"), 2.0f);
+
+  // characters that were not copied measure as nothing
+  Urho3D::BlockFormat format = lines[0].blocks[0].GetFormat();
+  metrics.SetFormat(format);
+  EXPECT_EQ(metrics.GetRowHeight(), 20.0f);
+  EXPECT_EQ(metrics.MeasureText("one").x_, 30.0f);
+  EXPECT_EQ(metrics.MeasureText("xyz").x_, 0.0f);
+
+  // formats of the same font share the metrics
+  format.color = Urho3D::Color::RED;
+  format.underlined = true;
+  metrics.SetFormat(format);
+  EXPECT_EQ(metrics.MeasureText("one").x_, 30.0f);
+  format.font.italic = true;
+  metrics.SetFormat(format);
+  EXPECT_EQ(metrics.MeasureText("one").x_, 0.0f);
+}
+
+TEST(RichTextHTMLParser, LineWindow) {
+  FixedMeasurer measurer;
+  Urho3D::RichLayoutEngine engine(&measurer);
+  engine.SetWordWrap(false);
+
+  Urho3D::String text;
+  for (unsigned i = 0; i < 1000; ++i)
+    text.Append("line\n");
+  Urho3D::Vector<Urho3D::TextBlock> blocks;
+  Urho3D::HTMLParser::Parse(text, blocks, Urho3D::BlockFormat());
+  Urho3D::Vector<Urho3D::TextLine> lines;
+  engine.Arrange(blocks, lines);
+  ASSERT_EQ(lines.Size(), 1000);
+
+  Urho3D::RichLineWindow window;
+  window.SetMargin(40);
+  Urho3D::PODVector<Urho3D::RichLayoutRun> runs;
+  window.Place(engine, lines, 100, 0, 100, runs);
+  // lines starting above 140 pixels are placed, only the first lines are measured
+  EXPECT_EQ(window.GetFirstLine(), 0);
+  EXPECT_EQ(window.GetEndLine(), 7);
+  EXPECT_EQ(runs.Size(), 7);
+  EXPECT_LT(window.GetNumMeasured(), 100);
+  EXPECT_EQ(window.GetEstimatedHeight(lines.Size()), 20000.0f);
+  EXPECT_TRUE(window.Covers(-1000, 120));
+  EXPECT_FALSE(window.Covers(200, 300));
+
+  // scrolling places the lines around the new view, from the top of their first line
+  runs.Clear();
+  window.Place(engine, lines, 100, 200, 300, runs);
+  EXPECT_EQ(window.GetFirstLine(), 8);
+  EXPECT_EQ(window.GetEndLine(), 17);
+  ASSERT_EQ(runs.Size(), 9);
+  EXPECT_EQ(runs[0].line, 0);
+  EXPECT_EQ(runs[0].position.y_, 160);
+  EXPECT_TRUE(window.Covers(200, 300));
+
+  // the last lines are placed up to the end of the text
+  runs.Clear();
+  window.Place(engine, lines, 100, 19950, 20050, runs);
+  EXPECT_EQ(window.GetEndLine(), 1000);
+  EXPECT_EQ(window.GetNumMeasured(), 1000);
+  EXPECT_TRUE(window.Covers(19950, 100000));
+
+  window.RemoveLeadingLines(10);
+  EXPECT_EQ(window.GetNumMeasured(), 990);
+  EXPECT_EQ(window.GetTop(1), 20);
+}
+
+TEST(RichTextHTMLParser, AppendMarkup) {
+  Urho3D::RichMarkupCache::Get().SetMaxTextLength(0);
+
+  Urho3D::String text("<color=red>line 1</color>\n<b>line 2\n");
+  Urho3D::RichMarkupDocument document;
+  document.Update(text, Urho3D::BlockFormat());
+
+  // the tag left open applies to the appended text, the block crossing the start is split. The text left open was
+  // parsed with the default format before, so it has to be arranged again
+  Urho3D::Vector<Urho3D::TextBlock> appended;
+  EXPECT_FALSE(document.Append("line 3</b>\n", appended));
+  text += "line 3</b>\n";
+  ASSERT_EQ(appended.Size(), 2);
+  EXPECT_STREQ(appended[0].text.CString(), "line 3");
+  EXPECT_TRUE(appended[0].GetFormat().font.bold);
+  EXPECT_STREQ(appended[1].text.CString(), "\n");
+  EXPECT_EQ(document.GetBlocks().Size(), 5);
+  document.Update(text, Urho3D::BlockFormat());
+  EXPECT_EQ(document.GetNumReusedBlocks(), 5);
+
+  // removing the first line keeps the blocks after the next top-level tag
+  document.RemoveLeadingText(26);
+  Urho3D::Vector<Urho3D::TextBlock> full;
+  Urho3D::HTMLParser::Parse(text.Substring(26), full, Urho3D::BlockFormat());
+  ASSERT_EQ(document.GetBlocks().Size(), full.Size());
+  for (unsigned i = 0; i < full.Size(); ++i)
+  {
+    EXPECT_STREQ(document.GetBlocks()[i].text.CString(), full[i].text.CString());
+    EXPECT_EQ(document.GetBlocks()[i].style, full[i].style);
+  }
+  EXPECT_EQ(document.GetNumReusedBlocks(), 1);
+  document.Update(text.Substring(26), Urho3D::BlockFormat());
+  EXPECT_EQ(document.GetNumReusedBlocks(), full.Size());
+
+  // text after a closed tag parses to the same blocks with more text
+  appended.Clear();
+  EXPECT_TRUE(document.Append("line 4\n", appended));
+  ASSERT_EQ(appended.Size(), 1);
+  EXPECT_STREQ(appended[0].text.CString(), "line 4\n");
+
+  // a text ending inside a tag parses to other blocks with the appended text
+  document.Update("one <b", Urho3D::BlockFormat());
+  appended.Clear();
+  EXPECT_FALSE(document.Append(">two</b>\n", appended));
+  full.Clear();
+  Urho3D::HTMLParser::Parse("one <b>two</b>\n", full, Urho3D::BlockFormat());
+  ASSERT_EQ(document.GetBlocks().Size(), full.Size());
+  for (unsigned i = 0; i < full.Size(); ++i)
+    EXPECT_STREQ(document.GetBlocks()[i].text.CString(), full[i].text.CString());
+  Urho3D::RichMarkupCache::Get().SetMaxTextLength(4096);
+}
+
+// fills the process-wide style table, keep it the last test
+TEST(RichTextHTMLParser, StyleTableOverflow) {
+  Urho3D::BlockFormat format;
+  Urho3D::Vector<Urho3D::BlockStyle> styles;
+  for (unsigned size = 1; Urho3D::RichStyleTable::GetNumStyles() < Urho3D::RichStyleTable::MAX_STYLES; ++size)
+  {
+    format.font.size = size;
+    styles.Push(Urho3D::RichStyleTable::MakeStyle(format));
+  }
+
+  // new formats are copied along with the blocks instead of becoming the default format
+  format.font.size = Urho3D::RichStyleTable::MAX_STYLES + 1;
+  EXPECT_TRUE(Urho3D::RichStyleTable::MakeStyle(format).overflow != nullptr);
+  Urho3D::TextBlock block;
+  block.SetFormat(format);
+  EXPECT_TRUE(block.GetFormat() == format);
+  Urho3D::TextBlock copy = block;
+  EXPECT_TRUE(copy.GetFormat() == format);
+  EXPECT_EQ(copy.style, block.style);
+
+  Urho3D::Vector<Urho3D::TextBlock> blocks;
+  Urho3D::HTMLParser::Parse("<size=99999>a</size>b", blocks, Urho3D::BlockFormat());
+  ASSERT_EQ(blocks.Size(), 2);
+  EXPECT_EQ(blocks[0].GetFormat().font.size, 99999);
+  EXPECT_EQ(blocks[1].GetFormat().font.size, 0);
+
+  // the IDs are free again once the styles are gone
+  styles.Clear();
+  EXPECT_LT(Urho3D::RichStyleTable::GetNumStyles(), 64u);
 }
@@ -0,0 +1,648 @@
+#include "rich_layout.h"
+#include "rich_widget.h"
+#include "rich_char_scanner.h"
+
+namespace Urho3D
+{
+
+namespace
+{
+
+// Characters that split words, and carriage returns that are dropped from them
+const char* const word_char_classes[] = { " \t,.:;", "\r" };
+const RichCharScanner word_scanner(word_char_classes, 2);
+// Line break characters
+const RichCharScanner new_line_scanner("\n");
+const RichCharScanner line_break_scanner("\n\r");
+// Lines measured at once by RichLineWindow
+const unsigned MEASURE_STEP = 64;
+
+/// Count the characters from first_char on that fit in width. Widths are the prefix widths of a word.
+unsigned CountFittingChars(const PODVector<float>& widths, unsigned first_char, int width)
+{
+  const float width_begin = first_char ? widths[first_char - 1] : 0.0f;
+  // binary search the first character that ends past width
+  unsigned low = first_char;
+  unsigned high = widths.Size();
+  while (low < high) {
+    unsigned middle = (low + high) / 2;
+    if ((int)(widths[middle] - width_begin) <= width)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low - first_char;
+}
+
+/// Push a text block measured by the layout. Without a loaded font the measured width is not kept.
+void PushMeasuredBlock(TextLine& line, TextBlock& block, bool measured)
+{
+  if (!measured)
+    block.width = -1.0f;
+  line.blocks.Push(block);
+}
+
+/// Decode the text blocks of lines from first_line on that are not decoded yet.
+void DecodeLines(Vector<TextLine>& lines, unsigned first_line)
+{
+  for (unsigned i = first_line; i < lines.Size(); ++i) {
+    for (auto it = lines[i].blocks.Begin(); it != lines[i].blocks.End(); ++it) {
+      if (it->type == TextBlock::BlockType_Text && it->chars.Empty())
+        it->DecodeText();
+    }
+  }
+}
+
+} // namespace
+
+RichLayoutEngine::RichLayoutEngine(RichLayoutMeasurer* measurer)
+ : measurer_(measurer)
+ , layout_rect_(IntRect::ZERO)
+ , word_wrap_(true)
+ , single_line_(false)
+ , line_spacing_(0)
+ , wrapped_size_(IntVector2::ZERO)
+ , content_size_(Vector2::ZERO)
+{
+}
+
+void RichLayoutEngine::Arrange(const Vector<TextBlock>& markup_blocks, Vector<TextLine>& lines)
+{
+  wrapped_size_ = IntVector2::ZERO;
+
+  TextLine line;
+  if (single_line_) {
+    // replace /n/r with empty space
+    for (auto i = markup_blocks.Begin(); i != markup_blocks.End(); i++) {
+      // TODO: single line doesn't get images when width or height = 0
+      line.blocks.Push(*i);
+      String& text = line.blocks.Back().text;
+      unsigned crpos = 0;
+      bool replaced = false;
+      while ((crpos = line_break_scanner.FindFirst(text, crpos)) != String::NPOS) {
+        text.Replace(crpos, 1, " ");
+        replaced = true;
+      }
+      if (replaced || line.blocks.Back().chars.Empty())
+        line.blocks.Back().DecodeText();
+    }
+    lines.Push(line);
+    return;
+  }
+
+  RichLayoutWords words;
+  Segment(markup_blocks, words);
+  Fill(words, lines);
+}
+
+void RichLayoutEngine::Segment(const Vector<TextBlock>& markup_blocks, RichLayoutWords& words)
+{
+  words.Clear();
+  Vector<TextLine>& markupLines = words.lines;
+  TextLine line;
+  // for every new line in a block, create a new TextLine
+  for (Vector<TextBlock>::ConstIterator it = markup_blocks.Begin(); it != markup_blocks.End(); ++it) {
+    size_t posNewLine = 0;
+    size_t posLast = 0;
+    if ((posNewLine = new_line_scanner.FindFirst(it->text, posLast)) != String::NPOS) {
+      while ((posNewLine = new_line_scanner.FindFirst(it->text, posLast)) != String::NPOS) {
+        TextBlock block;
+        block.text = it->text.Substring(posLast, posNewLine - posLast);
+        block.style = it->style;
+        line.blocks.Push(block);
+        markupLines.Push(line);
+        posLast = posNewLine + 1;
+        line.blocks.Clear();
+      }
+      if (posLast < it->text.Length() - 1) {
+        TextBlock block;
+        block.text = it->text.Substring(posLast, it->text.Length() - posLast);
+        block.style = it->style;
+        line.blocks.Push(block);
+      }
+    } else {
+      if (it->is_line_break) {
+        line.blocks.Push(*it);
+        markupLines.Push(line);
+        line.blocks.Clear();
+      }
+      line.blocks.Push(*it);
+      // update line alignment from this block if it is not left
+      const HorizontalAlignment align = it->style.GetShared().align;
+      if (align != HA_LEFT)
+        line.align = align;
+    }
+  }
+
+  // make sure there's at least one line with text
+  if (!line.blocks.Empty())
+    markupLines.Push(line);
+
+  // split the text blocks into words, they are measured when they are wrapped the first time
+  for (Vector<TextLine>::Iterator it = markupLines.Begin(); it != markupLines.End(); ++it) {
+    for (Vector<TextBlock>::Iterator bit = it->blocks.Begin(); bit != it->blocks.End(); ++bit) {
+      words.blocks.Resize(words.blocks.Size() + 1);
+      if (bit->type != TextBlock::BlockType_Text)
+        continue;
+
+      // one scan splits the words and finds the carriage returns
+      Vector<String>& block_words = words.blocks.Back().words;
+      if (SplitWords(bit->text, block_words, word_scanner)) {
+        bit->text.Replace("\r", "");
+        bit->chars.Clear();
+      }
+      if (block_words.Empty())
+        block_words.Push(bit->text);
+    }
+  }
+}
+
+void RichLayoutEngine::Fill(RichLayoutWords& words, Vector<TextLine>& lines)
+{
+  wrapped_size_ = IntVector2::ZERO;
+  const unsigned first_line = lines.Size();
+  Vector<TextLine>& markupLines = words.lines;
+
+  if (!word_wrap_ || !layout_rect_.Width()) {
+    // in case there's no word wrapping or the layout has no width
+    lines.Push(markupLines);
+    DecodeLines(lines, first_line);
+    return;
+  }
+
+  // do the word wrapping and layout positioning
+  int layout_width = layout_rect_.Width();
+  int layout_x = layout_rect_.left_;
+  int layout_y = layout_rect_.top_;
+
+  int draw_offset_x = layout_x;
+  int draw_offset_y = layout_y;
+
+  // prefix widths of words wider than the layout
+  PODVector<unsigned> char_ends;
+  PODVector<float> prefix_widths;
+
+  unsigned block_index = 0;
+  for (Vector<TextLine>::Iterator it = markupLines.Begin(); it != markupLines.End(); ++it) {
+    TextLine* line = &*it;
+
+    TextLine new_line;
+    new_line.height = 0;
+    new_line.width = 0;
+    new_line.offset_x = layout_x;
+    new_line.offset_y = 0;
+    new_line.align = line->align;
+
+    int maxRowHeight = 0;
+
+    // reset the x offset of the current line
+    draw_offset_x = layout_x;
+
+    for (Vector<TextBlock>::Iterator bit = line->blocks.Begin(); bit != line->blocks.End(); ++bit) {
+      TextBlock new_block;
+      new_block.style = bit->style;
+      RichLayoutWords::BlockWords& block_words = words.blocks[block_index++];
+
+      if (bit->type == TextBlock::BlockType_Text) {
+        bool new_line_space = false;
+
+        // measure the words once, a font that was not loaded yet is measured again
+        measurer_->SetFormat(bit->style.GetShared());
+        if (block_words.row_height <= 0.0f) {
+          block_words.row_height = measurer_->GetRowHeight();
+          block_words.sizes.Clear();
+          for (Vector<String>::ConstIterator wit = block_words.words.Begin(); wit != block_words.words.End(); ++wit)
+            block_words.sizes.Push(measurer_->MeasureText(*wit));
+        }
+        const bool measured = block_words.row_height > 0.0f;
+        new_block.width = 0.0f;
+
+        // for every word in this block do a check if there's enough space on the current line
+        // Simple word wrap logic: if the space is enough, put the word on the current line, else go to the next line
+        String the_word;
+        for (unsigned word_index = 0; word_index < block_words.words.Size(); ++word_index) {
+          the_word = block_words.words[word_index];
+          Vector2 wordsize = block_words.sizes[word_index];
+
+          new_line.height = Max<int>((int)wordsize.y_, new_line.height);
+          maxRowHeight = Max(maxRowHeight, Max(new_line.height, (int)block_words.row_height));
+
+          bool needs_new_line = (draw_offset_x + wordsize.x_) > layout_width;
+          bool is_wider_than_line = wordsize.x_ > layout_width;
+
+          // Handle cases where this word can't be fit in a line
+          unsigned first_char = 0;
+          if (is_wider_than_line && needs_new_line) {
+            char_ends.Clear();
+            prefix_widths.Clear();
+            measurer_->MeasurePrefixes(the_word, char_ends, prefix_widths);
+          }
+          while (is_wider_than_line && needs_new_line) {
+            // find the longest part of the word left that can be fit in the current line
+            unsigned num_chars = CountFittingChars(prefix_widths, first_char, layout_width);
+
+            // prevent endless loops
+            if (!num_chars)
+              break;
+
+            unsigned fit_begin = first_char ? char_ends[first_char - 1] : 0;
+            float width_begin = first_char ? prefix_widths[first_char - 1] : 0.0f;
+            first_char += num_chars;
+
+            // append the fitting part of the word in the current line
+            // and create a new line
+            new_block.text.Append(the_word.CString() + fit_begin, char_ends[first_char - 1] - fit_begin);
+            new_block.width += prefix_widths[first_char - 1] - width_begin;
+            PushMeasuredBlock(new_line, new_block, measured);
+            draw_offset_x += (int)(prefix_widths[first_char - 1] - width_begin);
+            new_line.width = draw_offset_x;
+            new_line.offset_y = draw_offset_y;
+            lines.Push(new_line);
+            wrapped_size_.y_ += Max(new_line.height, maxRowHeight);
+            // create a new empty line
+            new_line.blocks.Clear();
+            new_block.text.Clear();
+            new_block.width = 0.0f;
+            draw_offset_x = layout_x;
+            draw_offset_y += new_line.height;
+            // the rest of the word starts the height of the new line
+            new_line.height = (int)wordsize.y_;
+            maxRowHeight = Max(new_line.height, (int)block_words.row_height);
+
+            wordsize.x_ = prefix_widths.Back() - prefix_widths[first_char - 1];
+            draw_offset_x += (int)wordsize.x_;
+            is_wider_than_line = wordsize.x_ > layout_width;
+
+            if (!is_wider_than_line) {
+              needs_new_line = false;
+              // the leftovers from the_word will be added to the line below
+              break;
+            }
+          }
+          if (first_char)
+            the_word = the_word.Substring(char_ends[first_char - 1]);
+
+          // carry the whole word on a new line
+          if (needs_new_line) {
+            new_line.width = draw_offset_x;
+            new_line.offset_y = draw_offset_y;
+            PushMeasuredBlock(new_line, new_block, measured);
+            lines.Push(new_line);
+            wrapped_size_.y_ += Max(new_line.height, maxRowHeight);
+            // create next empty line
+            new_line.blocks.Clear();
+            // add current text to a block
+            new_block.text.Clear();
+            new_block.width = 0.0f;
+            draw_offset_x = layout_x;
+            draw_offset_y += new_line.height;
+            // the word carried over starts the height of the new line
+            new_line.height = (int)wordsize.y_;
+            maxRowHeight = Max(new_line.height, (int)block_words.row_height);
+            if (the_word == " " || the_word == "\t") {
+              // mark as space
+              new_line_space = true;
+              continue;
+            }
+          }
+
+          if (new_line_space) {
+            if (the_word != " " && the_word != "\t")
+              new_line_space = false;
+            else
+              continue;
+          }
+          new_block.text.Append(the_word);
+          new_block.width += wordsize.x_;
+          draw_offset_x += (int)wordsize.x_;
+        }
+
+        PushMeasuredBlock(new_line, new_block, measured);
+      } else {
+        // if the block is iconic (image, video, etc)
+        new_block = (*bit); // copy the block
+        if (new_block.is_visible) {
+          if (new_block.image_height == 0) {
+            float aspect = measurer_->GetImageAspect(new_block.text);
+            if (aspect == 0.f)
+              aspect = 1.0f;
+
+            // fit by width
+            new_block.image_width = (float)(new_block.image_width > 0 ? new_block.image_width : layout_width);
+            new_block.image_height = new_block.image_width / aspect;
+          }
+
+          if (new_block.image_width == 0) {
+            new_block.image_width = (float)layout_width;
+          }
+          new_line.blocks.Push(new_block);
+
+          draw_offset_x += (int)new_block.image_width;
+          new_line.height = Max((int)new_block.image_height, new_line.height);
+        }
+      }
+
+      new_line.width = draw_offset_x;
+      new_line.offset_y = draw_offset_y;
+      draw_offset_y += new_line.height;
+    }
+
+    wrapped_size_.x_ = Max(draw_offset_x, wrapped_size_.x_);
+    wrapped_size_.y_ += Max(new_line.height, maxRowHeight);
+
+    lines.Push(new_line);
+    new_line.blocks.Clear();
+  }
+
+  DecodeLines(lines, first_line);
+}
+
+void RichLayoutEngine::Place(Vector<TextLine>& lines, unsigned first_line, int width, int top, PODVector<RichLayoutRun>& runs,
+  unsigned end_line)
+{
+  content_size_ = Vector2::ZERO;
+  line_tops_.Clear();
+
+  int xoffset = 0, yoffset = top;
+
+  end_line = Min(end_line, lines.Size());
+  for (unsigned line_index = first_line; line_index < end_line; ++line_index) {
+    // adjust the size and offset of every block in a line
+    TextLine* l = &lines[line_index];
+    line_tops_.Push(yoffset);
+
+    switch (l->align) {
+    default:
+    case HA_LEFT:
+      xoffset = l->offset_x;
+      break;
+    case HA_CENTER:
+      xoffset = (width - l->width) / 2;
+      break;
+    case HA_RIGHT:
+      xoffset = width - l->width;
+    }
+
+    int line_max_height = 0;
+    for (auto it = l->blocks.Begin(); it != l->blocks.End(); ++it) {
+      RichLayoutRun run;
+      run.block = &*it;
+      run.line = line_index - first_line;
+      run.position = IntVector2(xoffset, yoffset);
+
+      if (it->type == TextBlock::BlockType_Image) {
+        if (it->image_width == 0)
+          it->image_width = (float)width;
+        if (it->image_height == 0) {
+          // height should be the line max height
+          it->image_height = (float)line_max_height;
+          // width should be auto calculated based on the texture size
+          float aspect = measurer_->GetImageAspect(it->text);
+          it->image_width = it->image_height * aspect;
+        }
+
+        run.size = Vector2(it->image_width, it->image_height);
+        runs.Push(run);
+        line_max_height = Max((int)it->image_height, line_max_height);
+        xoffset += (int)it->image_width;
+      } else if (it->type == TextBlock::BlockType_Text) {
+        run.size = Vector2::ZERO;
+        runs.Push(run);
+        measurer_->SetFormat(it->style.GetShared());
+        const float row_height = measurer_->GetRowHeight();
+        line_max_height = Max<int>((int)row_height, line_max_height);
+        // blocks wrapped by Arrange() are measured already, measure the others once the font is loaded
+        if (it->width < 0.0f) {
+          const float text_width = measurer_->MeasureChars(it->chars).x_;
+          if (row_height > 0.0f)
+            it->width = text_width;
+          xoffset += (int)text_width;
+        } else {
+          xoffset += (int)it->width;
+        }
+      }
+    }
+    yoffset += line_max_height + line_spacing_;
+    content_size_.x_ = Max<float>(content_size_.x_, (float)xoffset);
+    content_size_.y_ = (float)yoffset;
+  }
+}
+
+RichLineWindow::RichLineWindow()
+ : margin_(0)
+{
+  Reset();
+}
+
+void RichLineWindow::Reset()
+{
+  tops_.Clear();
+  bottom_ = 0;
+  width_ = 0.0f;
+  first_line_ = end_line_ = 0;
+  placed_top_ = placed_bottom_ = 0;
+}
+
+void RichLineWindow::RemoveLeadingLines(unsigned count)
+{
+  if (count >= tops_.Size()) {
+    Reset();
+    return;
+  }
+
+  const int offset_y = tops_[count];
+  tops_.Erase(0, count);
+  for (auto& top : tops_)
+    top -= offset_y;
+  bottom_ -= offset_y;
+  // the placed lines moved, the next Place() places them again
+  first_line_ = end_line_ = 0;
+  placed_top_ = placed_bottom_ = 0;
+}
+
+bool RichLineWindow::Covers(int view_top, int view_bottom) const
+{
+  return view_top >= placed_top_ && view_bottom <= placed_bottom_;
+}
+
+void RichLineWindow::MeasureTo(RichLayoutEngine& layout, Vector<TextLine>& lines, int width, int bottom)
+{
+  PODVector<RichLayoutRun> runs;
+  while (tops_.Size() < lines.Size() && bottom_ < bottom) {
+    runs.Clear();
+    layout.Place(lines, tops_.Size(), width, bottom_, runs, tops_.Size() + MEASURE_STEP);
+    tops_.Push(layout.GetLineTops());
+    bottom_ = (int)layout.GetContentSize().y_;
+    width_ = Max(width_, layout.GetContentSize().x_);
+  }
+}
+
+void RichLineWindow::Place(RichLayoutEngine& layout, Vector<TextLine>& lines, int width, int view_top, int view_bottom,
+  PODVector<RichLayoutRun>& runs)
+{
+  const int top = view_top - margin_;
+  const int bottom = view_bottom + margin_;
+  MeasureTo(layout, lines, width, bottom);
+
+  // the last line starting at top or above, then the first line starting at bottom or below
+  unsigned low = 0, high = tops_.Size();
+  while (low < high) {
+    unsigned middle = (low + high) / 2;
+    if (tops_[middle] <= top)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  first_line_ = low ? low - 1 : 0;
+  high = tops_.Size();
+  while (low < high) {
+    unsigned middle = (low + high) / 2;
+    if (tops_[middle] < bottom)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  end_line_ = Max(low, first_line_);
+
+  layout.Place(lines, first_line_, width, GetTop(first_line_), runs, end_line_);
+  placed_top_ = first_line_ ? GetTop(first_line_) : M_MIN_INT;
+  placed_bottom_ = end_line_ < lines.Size() ? GetTop(end_line_) : M_MAX_INT;
+}
+
+float RichLineWindow::GetEstimatedHeight(unsigned num_lines) const
+{
+  if (num_lines <= tops_.Size() || tops_.Empty())
+    return (float)GetTop(num_lines);
+  return (float)bottom_ + (float)bottom_ / tops_.Size() * (num_lines - tops_.Size());
+}
+
+RichLayoutMetrics::RichLayoutMetrics()
+ : default_size_(0)
+ , font_(nullptr)
+{
+}
+
+void RichLayoutMetrics::Capture(RichLayoutMeasurer& measurer, const Vector<TextLine>& lines, const BlockFormat& default_format)
+{
+  default_face_ = default_format.font.face;
+  default_size_ = default_format.font.size;
+
+  PODVector<unsigned> glyph(1);
+  for (Vector<TextLine>::ConstIterator it = lines.Begin(); it != lines.End(); ++it) {
+    for (Vector<TextBlock>::ConstIterator bit = it->blocks.Begin(); bit != it->blocks.End(); ++bit) {
+      if (bit->type != TextBlock::BlockType_Text) {
+        if (!image_aspects_.Contains(bit->text))
+          image_aspects_[bit->text] = measurer.GetImageAspect(bit->text);
+        continue;
+      }
+
+      const BlockFormat& format = bit->style.GetShared();
+      measurer.SetFormat(format);
+      const unsigned font_key = GetFontKey(format);
+      HashMap<unsigned, FontMetrics>::Iterator font = fonts_.Find(font_key);
+      if (font == fonts_.End()) {
+        FontMetrics& metrics = fonts_[font_key];
+        metrics.row_height = measurer.GetRowHeight();
+        metrics.latin1.Resize(256);
+        for (unsigned i = 0; i < 256; ++i)
+          metrics.latin1[i] = Vector2(-1.0f, 0.0f);
+        font = fonts_.Find(font_key);
+      }
+
+      FontMetrics& metrics = font->second_;
+      for (unsigned i = 0; i < bit->text.Length();) {
+        unsigned c = bit->text.NextUTF8Char(i);
+        if (c < 256 ? metrics.latin1[c].x_ >= 0.0f : metrics.glyphs.Contains(c))
+          continue;
+        glyph[0] = c;
+        const Vector2 size = measurer.MeasureChars(glyph);
+        if (c < 256)
+          metrics.latin1[c] = size;
+        else
+          metrics.glyphs[c] = size;
+      }
+    }
+  }
+  font_ = nullptr;
+}
+
+void RichLayoutMetrics::Clear()
+{
+  fonts_.Clear();
+  image_aspects_.Clear();
+  font_ = nullptr;
+}
+
+void RichLayoutMetrics::SetFormat(const BlockFormat& format)
+{
+  HashMap<unsigned, FontMetrics>::Iterator font = fonts_.Find(GetFontKey(format));
+  font_ = font != fonts_.End() ? &font->second_ : nullptr;
+}
+
+unsigned RichLayoutMetrics::GetFontKey(const BlockFormat& format) const
+{
+  const FontState& font = format.font;
+  return FontState::MakeKey(font.face.Empty() ? default_face_ : font.face, font.size ? font.size : default_size_,
+    font.bold, font.italic);
+}
+
+Vector2 RichLayoutMetrics::GetGlyph(unsigned c) const
+{
+  if (c < 256)
+    return font_->latin1[c].x_ >= 0.0f ? font_->latin1[c] : Vector2::ZERO;
+  HashMap<unsigned, Vector2>::ConstIterator glyph = font_->glyphs.Find(c);
+  return glyph != font_->glyphs.End() ? glyph->second_ : Vector2::ZERO;
+}
+
+Vector2 RichLayoutMetrics::MeasureText(const String& text)
+{
+  Vector2 size = Vector2::ZERO;
+  if (!font_)
+    return size;
+
+  for (unsigned i = 0; i < text.Length();) {
+    const Vector2 glyph = GetGlyph(text.NextUTF8Char(i));
+    size.x_ += glyph.x_;
+    size.y_ = Max(size.y_, glyph.y_);
+  }
+  return size;
+}
+
+Vector2 RichLayoutMetrics::MeasureChars(const PODVector<unsigned>& chars)
+{
+  Vector2 size = Vector2::ZERO;
+  if (!font_)
+    return size;
+
+  for (unsigned i = 0; i < chars.Size(); ++i) {
+    const Vector2 glyph = GetGlyph(chars[i]);
+    size.x_ += glyph.x_;
+    size.y_ = Max(size.y_, glyph.y_);
+  }
+  return size;
+}
+
+void RichLayoutMetrics::MeasurePrefixes(const String& text, PODVector<unsigned>& char_ends, PODVector<float>& widths)
+{
+  float width = 0.0f;
+  for (unsigned i = 0; i < text.Length();) {
+    unsigned c = text.NextUTF8Char(i);
+    if (font_)
+      width += GetGlyph(c).x_;
+    char_ends.Push(i);
+    widths.Push(width);
+  }
+}
+
+float RichLayoutMetrics::GetRowHeight()
+{
+  return font_ ? font_->row_height : 0.0f;
+}
+
+float RichLayoutMetrics::GetImageAspect(const String& source)
+{
+  HashMap<String, float>::Iterator aspect = image_aspects_.Find(source);
+  return aspect != image_aspects_.End() ? aspect->second_ : 0.0f;
+}
+
+} // namespace Urho3D
@@ -0,0 +1,231 @@
+#ifndef __RICH_LAYOUT_H__
+#define __RICH_LAYOUT_H__
+#pragma once
+
+#include "Urho3D/Container/Str.h"
+#include "Urho3D/Math/Rect.h"
+
+namespace Urho3D
+{
+
+struct BlockFormat;
+struct TextBlock;
+struct TextLine;
+
+/// Measures text and images for RichLayoutEngine.
+class RichLayoutMeasurer
+{
+public:
+    /// Destruct.
+    virtual ~RichLayoutMeasurer() {}
+    /// Select the font of a block format, the next measurements use it.
+    virtual void SetFormat(const BlockFormat& format) = 0;
+    /// Get the size of a text in the selected font.
+    virtual Vector2 MeasureText(const String& text) = 0;
+    /// Get the size of a text decoded to UTF-32 in the selected font.
+    virtual Vector2 MeasureChars(const PODVector<unsigned>& chars) = 0;
+    /// Get the width of every prefix of a text in the selected font. For every character the byte offset after it
+    /// and the width of the text up to there are pushed.
+    virtual void MeasurePrefixes(const String& text, PODVector<unsigned>& char_ends, PODVector<float>& widths) = 0;
+    /// Get the row height of the selected font.
+    virtual float GetRowHeight() = 0;
+    /// Get the width/height ratio of an image, 0 if not known.
+    virtual float GetImageAspect(const String& source) = 0;
+};
+
+/// Markup split into lines at line breaks and its text blocks into words. None of it depends on the layout width, so
+/// RichLayoutEngine::Fill() can wrap the same words at another width without splitting or measuring them again.
+struct RichLayoutWords
+{
+    /// Words of a block with their sizes
+    struct BlockWords
+    {
+        /// Words and the characters between them, empty for images
+        Vector<String> words;
+        /// Size of every word, measured by the first Fill() that wraps the block
+        PODVector<Vector2> sizes;
+        /// Row height of the block font, 0 while not measured
+        float row_height{};
+    };
+
+    /// The lines before wrapping
+    Vector<TextLine> lines;
+    /// Words of every block of the lines, in order
+    Vector<BlockWords> blocks;
+
+    /// Remove the lines and words.
+    void Clear()
+    {
+        lines.Clear();
+        blocks.Clear();
+    }
+};
+
+/// Glyph metrics and image aspects copied from a measurer, so text can be laid out on a worker thread while the fonts
+/// stay on the main thread. Characters that were not copied measure as nothing.
+class RichLayoutMetrics : public RichLayoutMeasurer
+{
+public:
+    /// Construct.
+    RichLayoutMetrics();
+
+    /// Copy the metrics of the characters and images of the line blocks from a measurer. Blocks without a font face or
+    /// size use the ones of default_format.
+    void Capture(RichLayoutMeasurer& measurer, const Vector<TextLine>& lines, const BlockFormat& default_format);
+    /// Remove the copied metrics.
+    void Clear();
+
+    /// Select the font of a block format, the next measurements use it.
+    void SetFormat(const BlockFormat& format) override;
+    /// Get the size of a text in the selected font.
+    Vector2 MeasureText(const String& text) override;
+    /// Get the size of a decoded text in the selected font.
+    Vector2 MeasureChars(const PODVector<unsigned>& chars) override;
+    /// Get the width of every prefix of a text in the selected font.
+    void MeasurePrefixes(const String& text, PODVector<unsigned>& char_ends, PODVector<float>& widths) override;
+    /// Get the row height of the selected font.
+    float GetRowHeight() override;
+    /// Get the width/height ratio of an image, 0 if not known.
+    float GetImageAspect(const String& source) override;
+
+private:
+    /// Copied metrics of a block format.
+    struct FontMetrics
+    {
+        float row_height;
+        /// Advance and height of the Latin-1 characters, negative advances are not copied.
+        PODVector<Vector2> latin1;
+        /// Advance and height of the other characters.
+        HashMap<unsigned, Vector2> glyphs;
+    };
+    /// Return the font key of a format with the default face and size resolved.
+    unsigned GetFontKey(const BlockFormat& format) const;
+    /// Get the copied metrics of a character in the selected font.
+    Vector2 GetGlyph(unsigned c) const;
+
+    /// Metrics by font key, formats differing only in their color or decorations share them.
+    HashMap<unsigned, FontMetrics> fonts_;
+    /// Font face and size of blocks without their own, from the format the metrics were captured with.
+    String default_face_;
+    unsigned default_size_;
+    HashMap<String, float> image_aspects_;
+    /// Metrics of the selected format, null if not copied.
+    const FontMetrics* font_;
+};
+
+/// A block positioned by RichLayoutEngine.
+struct RichLayoutRun
+{
+    /// The block, text runs draw all of its text
+    const TextBlock* block;
+    /// Line of the run, counted from the first placed line
+    unsigned line;
+    /// Top left corner in pixels
+    IntVector2 position;
+    /// Size in pixels, only set for images
+    Vector2 size;
+};
+
+/// Splits text blocks into lines, wraps them and positions them. Shared by RichText3D and RichTextUI.
+class RichLayoutEngine
+{
+public:
+    /// Construct with the measurer of the target.
+    explicit RichLayoutEngine(RichLayoutMeasurer* measurer);
+
+    /// Set the rectangle lines are wrapped in. Its width is also used for images without a size.
+    void SetLayoutRect(const IntRect& rect) { layout_rect_ = rect; }
+    /// Set word wrapping.
+    void SetWordWrap(bool word_wrap) { word_wrap_ = word_wrap; }
+    /// Set single line, line breaks become spaces.
+    void SetSingleLine(bool single_line) { single_line_ = single_line; }
+    /// Set additional line spacing (can be negative).
+    void SetLineSpacing(int line_spacing) { line_spacing_ = line_spacing; }
+
+    /// Split blocks into lines at line breaks and wrap them, the lines are appended. The text of the line blocks is
+    /// decoded.
+    void Arrange(const Vector<TextBlock>& blocks, Vector<TextLine>& lines);
+    /// Split blocks into lines at line breaks and their text into words, without wrapping. Not for single line.
+    void Segment(const Vector<TextBlock>& blocks, RichLayoutWords& words);
+    /// Wrap the lines of Segment(), the lines are appended. The words are measured the first time, so calling it
+    /// again for another layout width only fills the lines.
+    void Fill(RichLayoutWords& words, Vector<TextLine>& lines);
+    /// Position the blocks of the lines from first_line up to end_line, aligned inside width. The first line starts
+    /// at top, runs are appended. Images without a size get their size here.
+    void Place(Vector<TextLine>& lines, unsigned first_line, int width, int top, PODVector<RichLayoutRun>& runs,
+        unsigned end_line = M_MAX_UNSIGNED);
+
+    /// Get the size of the text wrapped by the last Arrange() or Fill(), zero without wrapping.
+    const IntVector2& GetWrappedSize() const { return wrapped_size_; }
+    /// Get the widest line end and the bottom of the lines placed by the last Place().
+    const Vector2& GetContentSize() const { return content_size_; }
+    /// Get the top of every line placed by the last Place().
+    const PODVector<int>& GetLineTops() const { return line_tops_; }
+
+private:
+    RichLayoutMeasurer* measurer_;
+    IntRect layout_rect_;
+    bool word_wrap_;
+    bool single_line_;
+    int line_spacing_;
+    IntVector2 wrapped_size_;
+    Vector2 content_size_;
+    PODVector<int> line_tops_;
+};
+
+/// Places only the lines around a view, so long texts get quads for what can be seen and not for the whole text.
+/// The tops of the lines are measured on demand, the height of the lines below is estimated. The lines themselves are
+/// wrapped for the whole text beforehand.
+class RichLineWindow
+{
+public:
+    /// Construct.
+    RichLineWindow();
+
+    /// Set the pixels above and below the view that are placed too, so small scrolls don't place lines again.
+    void SetMargin(int margin) { margin_ = margin; }
+    /// Get the pixels placed above and below the view.
+    int GetMargin() const { return margin_; }
+    /// Forget the measured and placed lines, e.g. when the lines or the width changed.
+    void Reset();
+    /// Remove the first lines, the tops of the lines left move up.
+    void RemoveLeadingLines(unsigned count);
+
+    /// Are the lines between view_top and view_bottom placed?
+    bool Covers(int view_top, int view_bottom) const;
+    /// Place the lines between view_top and view_bottom with the margin around them, the runs are appended. Their line
+    /// is counted from GetFirstLine().
+    void Place(RichLayoutEngine& layout, Vector<TextLine>& lines, int width, int view_top, int view_bottom,
+        PODVector<RichLayoutRun>& runs);
+    /// Get the first placed line.
+    unsigned GetFirstLine() const { return first_line_; }
+    /// Get the line after the last placed line.
+    unsigned GetEndLine() const { return end_line_; }
+
+    /// Get the number of measured lines.
+    unsigned GetNumMeasured() const { return tops_.Size(); }
+    /// Get the top of a measured line, for GetNumMeasured() the bottom of the measured lines.
+    int GetTop(unsigned line) const { return line < tops_.Size() ? tops_[line] : bottom_; }
+    /// Get the widest measured line end.
+    float GetMeasuredWidth() const { return width_; }
+    /// Get the height of num_lines lines, the lines not measured yet get the average measured height.
+    float GetEstimatedHeight(unsigned num_lines) const;
+
+private:
+    /// Measure lines until one starts at bottom or below, or all lines are measured.
+    void MeasureTo(RichLayoutEngine& layout, Vector<TextLine>& lines, int width, int bottom);
+
+    int margin_;
+    PODVector<int> tops_;
+    int bottom_;
+    float width_;
+    unsigned first_line_;
+    unsigned end_line_;
+    /// Placed pixels, beyond the text on the sides where all lines are placed.
+    int placed_top_;
+    int placed_bottom_;
+};
+
+} // namespace Urho3D
+
+#endif
@@ -0,0 +1,394 @@
+#include "rich_markup_cache.h"
+
+namespace Urho3D
+{
+
+namespace
+{
+
+/// Compare the parsed content of two blocks.
+bool IsSameBlock(const TextBlock& lhs, const TextBlock& rhs)
+{
+    return lhs.type == rhs.type && lhs.style == rhs.style && lhs.is_line_break == rhs.is_line_break &&
+        lhs.image_width == rhs.image_width && lhs.image_height == rhs.image_height && lhs.text == rhs.text;
+}
+
+} // namespace
+
+RichMarkupCache& RichMarkupCache::Get()
+{
+    static RichMarkupCache cache;
+    return cache;
+}
+
+RichMarkupCache::RichMarkupCache(unsigned max_entries)
+ : head_(M_MAX_UNSIGNED)
+ , tail_(M_MAX_UNSIGNED)
+ , max_entries_(Max(max_entries, 1U))
+ , max_text_length_(4096)
+ , hits_(0)
+ , misses_(0)
+{
+}
+
+void RichMarkupCache::Parse(const String& text, Vector<TextBlock>& blocks, const BlockFormat& default_block_format)
+{
+    if (text.Length() > max_text_length_)
+    {
+        {
+            MutexLock lock(mutex_);
+            ++misses_;
+        }
+        HTMLParser::Parse(text, blocks, default_block_format);
+        return;
+    }
+
+    unsigned long long key = ((unsigned long long)text.ToHash() << 32) | default_block_format.ToHash();
+
+    {
+        MutexLock lock(mutex_);
+        HashMap<unsigned long long, unsigned>::Iterator it = index_.Find(key);
+        if (it != index_.End())
+        {
+            Entry& entry = entries_[it->second_];
+            // hashes may collide, the entry is replaced by Insert() in that case
+            if (entry.text == text && entry.format == default_block_format)
+            {
+                ++hits_;
+                Touch(it->second_);
+                blocks.Push(entry.blocks);
+                return;
+            }
+        }
+        ++misses_;
+    }
+
+    // other threads keep using the cache while the text is parsed
+    Vector<TextBlock> parsed;
+    HTMLParser::Parse(text, parsed, default_block_format);
+    blocks.Push(parsed);
+
+    MutexLock lock(mutex_);
+    Insert(key, text, default_block_format, parsed);
+}
+
+void RichMarkupCache::Insert(unsigned long long key, const String& text, const BlockFormat& format,
+    const Vector<TextBlock>& blocks)
+{
+    HashMap<unsigned long long, unsigned>::Iterator it = index_.Find(key);
+    unsigned slot;
+    if (it != index_.End())
+    {
+        slot = it->second_;
+    }
+    else if (entries_.Size() < max_entries_)
+    {
+        slot = entries_.Size();
+        entries_.Resize(slot + 1);
+        entries_[slot].prev = entries_[slot].next = M_MAX_UNSIGNED;
+    }
+    else
+    {
+        // reuse the least recently used entry
+        slot = tail_;
+        index_.Erase(entries_[slot].key);
+    }
+
+    Entry& entry = entries_[slot];
+    entry.key = key;
+    entry.text = text;
+    entry.format = format;
+    entry.blocks = blocks;
+    index_[key] = slot;
+    Touch(slot);
+}
+
+void RichMarkupCache::SetMaxEntries(unsigned max_entries)
+{
+    MutexLock lock(mutex_);
+    max_entries_ = Max(max_entries, 1U);
+    if (entries_.Size() > max_entries_)
+    {
+        entries_.Clear();
+        index_.Clear();
+        head_ = tail_ = M_MAX_UNSIGNED;
+    }
+}
+
+unsigned RichMarkupCache::GetNumEntries() const
+{
+    MutexLock lock(mutex_);
+    return entries_.Size();
+}
+
+unsigned RichMarkupCache::GetHits() const
+{
+    MutexLock lock(mutex_);
+    return hits_;
+}
+
+unsigned RichMarkupCache::GetMisses() const
+{
+    MutexLock lock(mutex_);
+    return misses_;
+}
+
+void RichMarkupCache::ResetCounters()
+{
+    MutexLock lock(mutex_);
+    hits_ = 0;
+    misses_ = 0;
+}
+
+void RichMarkupCache::Clear()
+{
+    MutexLock lock(mutex_);
+    entries_.Clear();
+    index_.Clear();
+    head_ = tail_ = M_MAX_UNSIGNED;
+}
+
+void RichMarkupCache::Unlink(unsigned index)
+{
+    Entry& entry = entries_[index];
+    if (entry.prev != M_MAX_UNSIGNED)
+        entries_[entry.prev].next = entry.next;
+    else if (head_ == index)
+        head_ = entry.next;
+
+    if (entry.next != M_MAX_UNSIGNED)
+        entries_[entry.next].prev = entry.prev;
+    else if (tail_ == index)
+        tail_ = entry.prev;
+
+    entry.prev = entry.next = M_MAX_UNSIGNED;
+}
+
+void RichMarkupCache::Touch(unsigned index)
+{
+    if (head_ == index)
+        return;
+
+    Unlink(index);
+
+    Entry& entry = entries_[index];
+    entry.next = head_;
+    if (head_ != M_MAX_UNSIGNED)
+        entries_[head_].prev = index;
+    head_ = index;
+    if (tail_ == M_MAX_UNSIGNED)
+        tail_ = index;
+}
+
+RichMarkupDocument::RichMarkupDocument()
+ : num_reused_blocks_(0)
+ , parsed_(false)
+{
+}
+
+void RichMarkupDocument::Update(const String& text, const BlockFormat& default_block_format)
+{
+    if (parsed_ && text == text_ && default_block_format == format_)
+    {
+        num_reused_blocks_ = blocks_.Size();
+        return;
+    }
+
+    // the last checkpoint inside the unchanged start of the text
+    unsigned checkpoint = M_MAX_UNSIGNED;
+    if (parsed_ && default_block_format == format_ && !checkpoints_.Empty())
+    {
+        const char* old_data = text_.CString();
+        const char* new_data = text.CString();
+        unsigned length = Min(text_.Length(), text.Length());
+        unsigned common = 0;
+        while (common < length && old_data[common] == new_data[common])
+            ++common;
+
+        for (unsigned i = checkpoints_.Size(); i-- > 0;)
+        {
+            if (checkpoints_[i].offset <= common)
+            {
+                checkpoint = i;
+                break;
+            }
+        }
+    }
+
+    text_ = text;
+    format_ = default_block_format;
+    parsed_ = true;
+
+    if (checkpoint == M_MAX_UNSIGNED && text.Length() <= RichMarkupCache::Get().GetMaxTextLength())
+    {
+        blocks_.Clear();
+        checkpoints_.Clear();
+        num_reused_blocks_ = 0;
+        RichMarkupCache::Get().Parse(text, blocks_, default_block_format);
+        return;
+    }
+
+    unsigned offset = 0;
+    num_reused_blocks_ = 0;
+    if (checkpoint != M_MAX_UNSIGNED)
+    {
+        offset = checkpoints_[checkpoint].offset;
+        num_reused_blocks_ = checkpoints_[checkpoint].num_blocks;
+        checkpoints_.Resize(checkpoint + 1);
+    }
+    else
+        checkpoints_.Clear();
+    blocks_.Resize(num_reused_blocks_);
+
+    Vector<TextBlockRef> refs;
+    PODVector<MarkupCheckpoint> checkpoints;
+    HTMLParser::Parse(text, offset, refs, default_block_format, checkpoints);
+    HTMLParser::Materialize(text, refs, blocks_);
+    for (unsigned i = 0; i < checkpoints.Size(); ++i)
+    {
+        checkpoints[i].num_blocks += num_reused_blocks_;
+        checkpoints_.Push(checkpoints[i]);
+    }
+}
+
+bool RichMarkupDocument::Append(const String& text, Vector<TextBlock>& blocks)
+{
+    unsigned start = text_.Length();
+    text_ += text;
+    parsed_ = true;
+
+    unsigned offset = 0;
+    num_reused_blocks_ = 0;
+    if (!checkpoints_.Empty())
+    {
+        offset = checkpoints_.Back().offset;
+        num_reused_blocks_ = checkpoints_.Back().num_blocks;
+    }
+    // the blocks parsed again, to check they are still the same
+    Vector<TextBlock> previous_blocks;
+    previous_blocks.Reserve(blocks_.Size() - num_reused_blocks_);
+    for (unsigned i = num_reused_blocks_; i < blocks_.Size(); ++i)
+        previous_blocks.Push(blocks_[i]);
+    blocks_.Resize(num_reused_blocks_);
+
+    Vector<TextBlockRef> refs;
+    PODVector<MarkupCheckpoint> checkpoints;
+    HTMLParser::Parse(text_, offset, refs, format_, checkpoints);
+
+    // split the block crossing the start of the appended text
+    unsigned first_appended = refs.Size();
+    for (unsigned i = 0; i < refs.Size(); ++i)
+    {
+        TextBlockRef& ref = refs[i];
+        if (ref.offset >= start)
+        {
+            first_appended = i;
+            break;
+        }
+        if (ref.offset + ref.length > start)
+        {
+            TextBlockRef tail = ref;
+            tail.offset = start;
+            tail.length = ref.offset + ref.length - start;
+            ref.length = start - ref.offset;
+            refs.Insert(i + 1, tail);
+            for (unsigned j = 0; j < checkpoints.Size(); ++j)
+            {
+                if (checkpoints[j].num_blocks > i)
+                    ++checkpoints[j].num_blocks;
+            }
+            first_appended = i + 1;
+            break;
+        }
+    }
+
+    HTMLParser::Materialize(text_, refs, blocks_);
+    for (unsigned i = num_reused_blocks_ + first_appended; i < blocks_.Size(); ++i)
+        blocks.Push(blocks_[i]);
+    for (unsigned i = 0; i < checkpoints.Size(); ++i)
+    {
+        checkpoints[i].num_blocks += num_reused_blocks_;
+        checkpoints_.Push(checkpoints[i]);
+    }
+
+    if (first_appended != previous_blocks.Size())
+        return false;
+    for (unsigned i = 0; i < first_appended; ++i)
+    {
+        if (!IsSameBlock(blocks_[num_reused_blocks_ + i], previous_blocks[i]))
+            return false;
+    }
+    return true;
+}
+
+void RichMarkupDocument::RemoveLeadingText(unsigned length)
+{
+    if (!length || !parsed_)
+        return;
+
+    for (unsigned i = 0; i < checkpoints_.Size(); ++i)
+    {
+        const MarkupCheckpoint checkpoint = checkpoints_[i];
+        if (checkpoint.offset < length)
+            continue;
+
+        // parse the text left before the checkpoint, the blocks after it stay the same if the parser gets there
+        // with the default format too
+        String head = text_.Substring(length, checkpoint.offset - length);
+        Vector<TextBlockRef> refs;
+        PODVector<MarkupCheckpoint> checkpoints;
+        if (!head.Empty())
+        {
+            HTMLParser::Parse(head, 0, refs, format_, checkpoints);
+            if (checkpoints.Empty() || checkpoints.Back().offset != head.Length())
+                continue;
+        }
+
+        Vector<TextBlock> blocks;
+        HTMLParser::Materialize(head, refs, blocks);
+        unsigned num_head_blocks = blocks.Size();
+        blocks.Reserve(num_head_blocks + blocks_.Size() - checkpoint.num_blocks);
+        for (unsigned j = checkpoint.num_blocks; j < blocks_.Size(); ++j)
+            blocks.Push(blocks_[j]);
+        blocks_.Swap(blocks);
+
+        for (unsigned j = i + 1; j < checkpoints_.Size(); ++j)
+        {
+            MarkupCheckpoint moved = checkpoints_[j];
+            moved.offset -= length;
+            moved.num_blocks = moved.num_blocks - checkpoint.num_blocks + num_head_blocks;
+            checkpoints.Push(moved);
+        }
+        checkpoints_.Swap(checkpoints);
+        text_.Erase(0, length);
+        num_reused_blocks_ = blocks_.Size() - num_head_blocks;
+        return;
+    }
+
+    // no blocks can be kept
+    String text = text_.Substring(length);
+    BlockFormat format = format_;
+    Clear();
+    Update(text, format);
+}
+
+void RichMarkupDocument::Clear()
+{
+    text_.Clear();
+    blocks_.Clear();
+    checkpoints_.Clear();
+    num_reused_blocks_ = 0;
+    parsed_ = false;
+}
+
+void RichMarkupDocument::Swap(RichMarkupDocument& other)
+{
+    text_.Swap(other.text_);
+    Urho3D::Swap(format_, other.format_);
+    blocks_.Swap(other.blocks_);
+    checkpoints_.Swap(other.checkpoints_);
+    Urho3D::Swap(num_reused_blocks_, other.num_reused_blocks_);
+    Urho3D::Swap(parsed_, other.parsed_);
+}
+
+} // namespace Urho3D
@@ -0,0 +1,118 @@
+#ifndef __RICH_MARKUP_CACHE_H__
+#define __RICH_MARKUP_CACHE_H__
+#pragma once
+
+#include "rich_html_parser.h"
+#include "Urho3D/Container/Swap.h"
+#include "Urho3D/Core/Mutex.h"
+
+namespace Urho3D
+{
+
+/// A process-wide, size-bounded LRU cache of parsed markup, keyed by the markup and the default format. Parse() can be
+/// called from worker threads.
+class RichMarkupCache
+{
+public:
+    /// Return the process-wide cache.
+    static RichMarkupCache& Get();
+
+    /// Construct.
+    explicit RichMarkupCache(unsigned max_entries = 1024);
+
+    /// Parse the text or copy the blocks of an identical, already parsed text. Blocks are appended.
+    void Parse(const String& text, Vector<TextBlock>& blocks, const BlockFormat& default_block_format);
+    /// Set maximum number of cached texts, the least recently used are dropped first.
+    void SetMaxEntries(unsigned max_entries);
+    /// Get maximum number of cached texts.
+    unsigned GetMaxEntries() const { return max_entries_; }
+    /// Set maximum text length that gets cached, longer texts are always parsed.
+    void SetMaxTextLength(unsigned length) { max_text_length_ = length; }
+    /// Get maximum text length that gets cached.
+    unsigned GetMaxTextLength() const { return max_text_length_; }
+    /// Get number of cached texts.
+    unsigned GetNumEntries() const;
+    /// Get number of parses served from the cache.
+    unsigned GetHits() const;
+    /// Get number of parses that missed the cache.
+    unsigned GetMisses() const;
+    /// Reset hit and miss counters.
+    void ResetCounters();
+    /// Remove all cached texts.
+    void Clear();
+private:
+    struct Entry
+    {
+        unsigned long long key;
+        String text;
+        BlockFormat format;
+        Vector<TextBlock> blocks;
+        /// Neighbours in the recently used list, M_MAX_UNSIGNED if none.
+        unsigned prev;
+        unsigned next;
+    };
+
+    /// Move an entry to the front of the recently used list.
+    void Touch(unsigned index);
+    /// Unlink an entry from the recently used list.
+    void Unlink(unsigned index);
+    /// Store the blocks of a parsed text, replacing the least recently used entry when the cache is full.
+    void Insert(unsigned long long key, const String& text, const BlockFormat& format, const Vector<TextBlock>& blocks);
+
+    /// Entry storage, slots are reused when the cache is full.
+    Vector<Entry> entries_;
+    /// (text hash, format hash) to entry index.
+    HashMap<unsigned long long, unsigned> index_;
+    /// Most recently used entry.
+    unsigned head_;
+    /// Least recently used entry.
+    unsigned tail_;
+    unsigned max_entries_;
+    unsigned max_text_length_;
+    unsigned hits_;
+    unsigned misses_;
+    /// Guards the entries and counters, texts are parsed outside of it.
+    mutable Mutex mutex_;
+};
+
+/// The parsed markup of a widget. When a long text changes only after its start, as when lines are appended
+/// to a log, parsing resumes from the last top-level tag before the first changed character.
+class RichMarkupDocument
+{
+public:
+    /// Construct.
+    RichMarkupDocument();
+
+    /// Update the blocks for a new text. Texts short enough for RichMarkupCache are parsed through it.
+    void Update(const String& text, const BlockFormat& default_block_format);
+    /// Append text to the parsed text. Parsing resumes from the last top-level tag, so tags left open before apply to
+    /// the appended text. The blocks of the appended text are appended to blocks too, a block crossing the start of
+    /// the appended text is split there. Return false if the text before it parses to other blocks than before, e.g.
+    /// when it ended inside a tag, then all blocks have to be arranged again.
+    bool Append(const String& text, Vector<TextBlock>& blocks);
+    /// Remove the start of the parsed text. The blocks after the first top-level tag at or after length are kept.
+    void RemoveLeadingText(unsigned length);
+    /// Remove the parsed blocks.
+    void Clear();
+    /// Exchange the parsed text with another document, e.g. to parse it on a worker thread.
+    void Swap(RichMarkupDocument& other);
+    /// Get the parsed blocks.
+    const Vector<TextBlock>& GetBlocks() const { return blocks_; }
+    /// Get number of blocks kept from the previous text by the last update.
+    unsigned GetNumReusedBlocks() const { return num_reused_blocks_; }
+private:
+    /// The parsed text.
+    String text_;
+    /// The default format the text was parsed with.
+    BlockFormat format_;
+    Vector<TextBlock> blocks_;
+    /// Positions parsing can resume from, empty if the text was parsed through the cache.
+    PODVector<MarkupCheckpoint> checkpoints_;
+    unsigned num_reused_blocks_;
+    /// Is there a parsed text.
+    bool parsed_;
+};
+
+} // namespace Urho3D
+
+#endif
@@ -0,0 +1,120 @@
+#include "rich_material_cache.h"
+#include "Urho3D/Core/Context.h"
+#include "Urho3D/Core/CoreEvents.h"
+#include "Urho3D/Graphics/Graphics.h"
+#include "Urho3D/Graphics/Technique.h"
+#include "Urho3D/Graphics/Texture.h"
+#include "Urho3D/Resource/ResourceCache.h"
+
+namespace Urho3D
+{
+
+namespace
+{
+
+/// Number of created materials before unused ones are looked for the first time.
+const unsigned MIN_RELEASE_INTERVAL = 64;
+
+} // namespace
+
+RichMaterialCache* RichMaterialCache::Get(Context* context)
+{
+    RichMaterialCache* cache = context->GetSubsystem<RichMaterialCache>();
+    if (!cache)
+    {
+        cache = new RichMaterialCache(context);
+        context->RegisterSubsystem(cache);
+    }
+    return cache;
+}
+
+RichMaterialCache::RichMaterialCache(Context* context)
+ : Object(context)
+ , num_created_(0)
+{
+    SubscribeToEvent(E_ENDFRAME, URHO3D_HANDLER(RichMaterialCache, HandleEndFrame));
+}
+
+RichMaterialCache::~RichMaterialCache()
+{
+}
+
+SharedPtr<Material> RichMaterialCache::GetMaterial(Texture* texture, Mode mode, int zbias)
+{
+    Key key{texture, mode, zbias};
+    HashMap<Key, SharedPtr<Material>>::Iterator it = materials_.Find(key);
+    if (it != materials_.End())
+        return it->second_;
+
+    ++num_created_;
+    SharedPtr<Material> material = CreateMaterial(key);
+    materials_[key] = material;
+    return material;
+}
+
+void RichMaterialCache::ReleaseUnused()
+{
+    for (HashMap<Key, SharedPtr<Material>>::Iterator it = materials_.Begin(); it != materials_.End();)
+    {
+        // the cache holds the only reference
+        if (!it->second_ || it->second_->Refs() == 1)
+            it = materials_.Erase(it);
+        else
+            ++it;
+    }
+    num_created_ = 0;
+}
+
+void RichMaterialCache::Clear()
+{
+    materials_.Clear();
+    num_created_ = 0;
+}
+
+void RichMaterialCache::HandleEndFrame(StringHash eventType, VariantMap& eventData)
+{
+    // the batches of the frame were drawn, materials only the cache refers to are not used any more
+    if (num_created_ > Max(materials_.Size() - num_created_, MIN_RELEASE_INTERVAL))
+        ReleaseUnused();
+}
+
+SharedPtr<Material> RichMaterialCache::CreateMaterial(const Key& key)
+{
+    SharedPtr<Material> material;
+    if (key.mode == MODE_IMAGE)
+    {
+        Material* image_material = GetSubsystem<ResourceCache>()->GetResource<Material>("Materials/RichImage.xml");
+        if (!image_material)
+            return material;
+        material = image_material->Clone();
+        material->SetTexture(TU_NORMAL, 0);
+        material->SetTexture(TU_SPECULAR, 0);
+        material->SetName("RichWidgetImage");
+    }
+    else
+    {
+        material = new Material(context_);
+        SharedPtr<Technique> tech(new Technique(context_));
+        Pass* pass = tech->CreatePass("alpha");
+        pass->SetVertexShader("Text");
+        pass->SetPixelShader("Text");
+        pass->SetBlendMode(BLEND_ALPHA);
+        pass->SetDepthWrite(false);
+        if (key.mode == MODE_TEXT_SDF)
+            pass->SetPixelShaderDefines("SIGNED_DISTANCE_FIELD");
+        else if (key.texture && key.texture->GetFormat() == Graphics::GetAlphaFormat())
+            pass->SetPixelShaderDefines("ALPHAMAP");
+        material->SetTechnique(0, tech);
+        material->SetCullMode(CULL_NONE);
+        material->SetName("RichWidgetText");
+    }
+
+    material->SetTexture(TU_DIFFUSE, key.texture);
+    material->SetRenderOrder(key.zbias);
+#if defined(TARGET_LINUX)
+    material->SetDepthBias(Urho3D::BiasParameters(-0.0000023f - key.zbias * 0.0000023f, -0.0000023f - key.zbias * 0.0000023f));
+#endif
+    return material;
+}
+
+} // namespace Urho3D
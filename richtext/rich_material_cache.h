@@ -0,0 +1,73 @@
+#ifndef __RICH_MATERIAL_CACHE_H__
+#define __RICH_MATERIAL_CACHE_H__
+#pragma once
+
+#include "Urho3D/Core/Object.h"
+#include "Urho3D/Graphics/Material.h"
+
+namespace Urho3D
+{
+
+class Texture;
+
+/// Materials shared by the widgets of a context, one per texture, shader mode and z bias. Widgets drawing the same font
+/// with the same bias get the same material, so the renderer can batch and instance them.
+class RichMaterialCache : public Object
+{
+    URHO3D_OBJECT(RichMaterialCache, Object)
+public:
+    /// Shaders of a material.
+    enum Mode
+    {
+        /// Text shader, with ALPHAMAP for alpha textures
+        MODE_TEXT,
+        /// Text shader with SIGNED_DISTANCE_FIELD
+        MODE_TEXT_SDF,
+        /// Copy of Materials/RichImage.xml
+        MODE_IMAGE
+    };
+
+    /// Return the cache of a context, it is registered as a subsystem on first use.
+    static RichMaterialCache* Get(Context* context);
+
+    /// Construct.
+    explicit RichMaterialCache(Context* context);
+    /// Destruct.
+    ~RichMaterialCache() override;
+
+    /// Get the material drawing a texture. It is created the first time with the texture, render order and depth bias
+    /// set, and must not be modified. Lookups never release materials, unused ones are released at the end of a frame.
+    SharedPtr<Material> GetMaterial(Texture* texture, Mode mode, int zbias);
+    /// Get number of cached materials.
+    unsigned GetNumMaterials() const { return materials_.Size(); }
+    /// Remove the materials no batch uses any more.
+    void ReleaseUnused();
+    /// Remove all cached materials.
+    void Clear();
+
+private:
+    struct Key
+    {
+        Texture* texture;
+        Mode mode;
+        int zbias;
+
+        bool operator ==(const Key& rhs) const { return texture == rhs.texture && mode == rhs.mode && zbias == rhs.zbias; }
+        unsigned ToHash() const { return ((unsigned)(size_t)texture / sizeof(void*)) * 31 + (unsigned)zbias * 4 + mode; }
+    };
+
+    /// Create the material of a key.
+    SharedPtr<Material> CreateMaterial(const Key& key);
+    /// Release the unused materials when enough were created since the last time.
+    void HandleEndFrame(StringHash eventType, VariantMap& eventData);
+
+    /// Materials by key. A material keeps its texture alive, so the texture of an unloaded font page stays in memory
+    /// until the next release.
+    HashMap<Key, SharedPtr<Material>> materials_;
+    /// Materials created since the last ReleaseUnused(), it runs again when as many were created as are left.
+    unsigned num_created_;
+};
+
+} // namespace Urho3D
+
+#endif
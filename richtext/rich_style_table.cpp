@@ -0,0 +1,225 @@
+#include "rich_widget.h"
+#include "Urho3D/Core/Mutex.h"
+#include "Urho3D/IO/Log.h"
+
+#include <atomic>
+
+namespace Urho3D
+{
+
+namespace
+{
+
+const unsigned STYLE_PAGE_BITS = 8;
+const unsigned STYLES_PER_PAGE = 1 << STYLE_PAGE_BITS;
+const unsigned NUM_STYLE_PAGES = RichStyleTable::MAX_STYLES / STYLES_PER_PAGE;
+/// Number of styles a thread keeps for looking them up without the table lock.
+const unsigned NUM_CACHED_STYLES = 16;
+
+/// A format of the table and the number of styles referring to it.
+struct StyleSlot
+{
+    BlockFormat format;
+    std::atomic<unsigned> refs{0};
+    /// Is the slot in the index? Only changed under the table lock.
+    bool used{false};
+};
+
+/// Return hash of a format without its color.
+unsigned GetStyleHash(const BlockFormat& format)
+{
+    unsigned hash = format.font.face.ToHash();
+    hash = hash * 31 + format.font.size;
+    hash = hash * 31 + format.align;
+    hash = hash * 31 + ((unsigned)format.font.bold | (unsigned)format.font.italic << 1 | (unsigned)format.underlined << 2 |
+      (unsigned)format.striked << 3 | (unsigned)format.superscript << 4 | (unsigned)format.subscript << 5);
+    return hash;
+}
+
+/// Compare formats without their color.
+bool IsSameStyle(const BlockFormat& lhs, const BlockFormat& rhs)
+{
+    return lhs.font == rhs.font && lhs.align == rhs.align && lhs.underlined == rhs.underlined && lhs.striked == rhs.striked &&
+      lhs.superscript == rhs.superscript && lhs.subscript == rhs.subscript;
+}
+
+/// Slots are stored in fixed-size pages that never move, so references returned by Get() stay valid.
+struct StyleStorage
+{
+    StyleStorage() : num_slots(1), num_styles(1), overflow_logged(false)
+    {
+        for (unsigned i = 0; i < NUM_STYLE_PAGES; ++i)
+            pages[i].store(nullptr, std::memory_order_relaxed);
+        // ID 0 is the default format, it is never released
+        StyleSlot* first_page = new StyleSlot[STYLES_PER_PAGE];
+        first_page[0].refs.store(1, std::memory_order_relaxed);
+        first_page[0].used = true;
+        index[GetStyleHash(first_page[0].format)].Push(0);
+        pages[0].store(first_page, std::memory_order_release);
+    }
+
+    ~StyleStorage()
+    {
+        for (unsigned i = 0; i < NUM_STYLE_PAGES; ++i)
+            delete[] pages[i].load(std::memory_order_relaxed);
+    }
+
+    StyleSlot& GetSlot(StyleId id) const
+    {
+        return pages[id >> STYLE_PAGE_BITS].load(std::memory_order_acquire)[id & (STYLES_PER_PAGE - 1)];
+    }
+
+    /// Pages are published after their first slot is written, so Get() can read them from any thread.
+    std::atomic<StyleSlot*> pages[NUM_STYLE_PAGES];
+    /// Slots handed out so far, released ones are in free_ids.
+    unsigned num_slots;
+    unsigned num_styles;
+    PODVector<StyleId> free_ids;
+    /// Format hash without the color to IDs.
+    HashMap<unsigned, PODVector<StyleId> > index;
+    /// Has the full table been reported?
+    bool overflow_logged;
+    /// Guards interning and releasing, formats are written before their ID is returned and don't change while used.
+    Mutex mutex;
+};
+
+StyleStorage& GetStorage()
+{
+    static StyleStorage storage;
+    return storage;
+}
+
+/// Find or add a format and reference it, returns false if the table is full.
+bool InternFormat(const BlockFormat& format, unsigned hash, StyleId& id)
+{
+    StyleStorage& storage = GetStorage();
+    MutexLock lock(storage.mutex);
+
+    PODVector<StyleId>& bucket = storage.index[hash];
+    for (unsigned i = 0; i < bucket.Size(); ++i)
+    {
+        StyleSlot& slot = storage.GetSlot(bucket[i]);
+        if (IsSameStyle(slot.format, format))
+        {
+            id = bucket[i];
+            if (id)
+                slot.refs.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    if (!storage.free_ids.Empty())
+    {
+        id = storage.free_ids.Back();
+        storage.free_ids.Pop();
+    }
+    else if (storage.num_slots < RichStyleTable::MAX_STYLES)
+    {
+        id = (StyleId)storage.num_slots++;
+        std::atomic<StyleSlot*>& page = storage.pages[id >> STYLE_PAGE_BITS];
+        if (!page.load(std::memory_order_relaxed))
+            page.store(new StyleSlot[STYLES_PER_PAGE], std::memory_order_release);
+    }
+    else
+    {
+        if (!storage.overflow_logged)
+        {
+            URHO3D_LOGERROR("RichStyleTable is full, blocks with new formats copy their format");
+            storage.overflow_logged = true;
+        }
+        id = 0;
+        return false;
+    }
+
+    StyleSlot& slot = storage.GetSlot(id);
+    slot.format = format;
+    slot.format.color = Color::WHITE;
+    slot.refs.store(1, std::memory_order_relaxed);
+    slot.used = true;
+    bucket.Push(id);
+    ++storage.num_styles;
+    return true;
+}
+
+/// Styles recently made by a thread, they keep their IDs referenced.
+struct StyleLookupCache
+{
+    StyleLookupCache()
+    {
+        for (unsigned i = 0; i < NUM_CACHED_STYLES; ++i)
+            hashes[i] = 0;
+    }
+
+    BlockStyle styles[NUM_CACHED_STYLES];
+    unsigned hashes[NUM_CACHED_STYLES];
+};
+
+} // namespace
+
+BlockStyle RichStyleTable::MakeStyle(const BlockFormat& format)
+{
+    static thread_local StyleLookupCache cache;
+
+    const unsigned hash = GetStyleHash(format);
+    const unsigned cache_index = hash % NUM_CACHED_STYLES;
+    BlockStyle& cached = cache.styles[cache_index];
+    if (cache.hashes[cache_index] == hash && !cached.overflow && IsSameStyle(cached.GetShared(), format))
+    {
+        BlockStyle style(cached);
+        style.color = format.color;
+        return style;
+    }
+
+    BlockStyle style;
+    style.color = format.color;
+    if (!InternFormat(format, hash, style.id))
+    {
+        style.overflow = new BlockFormat(format);
+        return style;
+    }
+
+    cached = style;
+    cache.hashes[cache_index] = hash;
+    return style;
+}
+
+const BlockFormat& RichStyleTable::Get(StyleId id)
+{
+    return GetStorage().GetSlot(id).format;
+}
+
+void RichStyleTable::AddRef(StyleId id)
+{
+    GetStorage().GetSlot(id).refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RichStyleTable::ReleaseRef(StyleId id)
+{
+    StyleStorage& storage = GetStorage();
+    StyleSlot& slot = storage.GetSlot(id);
+    if (!id || slot.refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    MutexLock lock(storage.mutex);
+    // the format may have been interned again before the lock, or released by another thread
+    if (!slot.used || slot.refs.load(std::memory_order_relaxed))
+        return;
+
+    const unsigned hash = GetStyleHash(slot.format);
+    PODVector<StyleId>& bucket = storage.index[hash];
+    bucket.Remove(id);
+    if (bucket.Empty())
+        storage.index.Erase(hash);
+    slot.used = false;
+    storage.free_ids.Push(id);
+    --storage.num_styles;
+}
+
+unsigned RichStyleTable::GetNumStyles()
+{
+    StyleStorage& storage = GetStorage();
+    MutexLock lock(storage.mutex);
+    return storage.num_styles;
+}
+
+} // namespace Urho3D
@@ -6,57 +6,12 @@
 #include "Urho3D/Scene/SceneEvents.h"
 #include "Urho3D/Graphics/Renderer.h"
 #include "Urho3D/Core/CoreEvents.h"
-#include "rich_html_parser.h"
+#include "Urho3D/Core/Timer.h"
+#include "rich_markup_cache.h"
 
 namespace Urho3D
 {
 
-namespace
-{
-
-inline unsigned find_first_of(const String& str, const String& delimiters, unsigned offset = 0) {
-  if (offset >= str.Length())
-    return -1;
-
-  for (unsigned i = offset; i < str.Length(); i++) {
-    for (String::ConstIterator it = delimiters.Begin(); it != delimiters.End(); ++it)
-      if ((*it) == str.At(i))
-        return i;
-  }
-  return -1;
-}
-
-
-// Characters that split words
-static const char splitter_chars[] = " \t,.:;";
-
-// Old code kept for 1:1 compatibility
-template <typename T>
-inline void splitwords(const String& str, T& tokens, const String& delimiters = " ", bool trimEmpty = false) {
-  unsigned pos, lastPos = 0;
-  while(true) {
-    pos = find_first_of(str, delimiters, lastPos);
-    if(pos == String::NPOS) {
-      pos = str.Length();
-      if(pos != lastPos || !trimEmpty)
-        tokens.Push(typename T::ValueType(str.CString() + lastPos,
-          pos - lastPos));
-
-      break;
-    } else {
-      if(pos != lastPos) {
-        tokens.Push(typename T::ValueType(str.CString() + lastPos, pos - lastPos));
-      }
-      if (!trimEmpty)
-        tokens.Push(typename T::ValueType(str.CString() + pos, 1 ));
-    }
-
-    lastPos = pos + 1;
-  }
-}
-
-} // namespace
-
 static const char* ticker_types[] =
 {
   "None",
@@ -96,6 +51,11 @@ void RichText3D::RegisterObject(Context* context) {
   URHO3D_ACCESSOR_ATTRIBUTE("Word Wrap", GetWrapping, SetWrapping, bool, true, AM_DEFAULT);
   URHO3D_ACCESSOR_ATTRIBUTE("Single Line", GetSingleLine, SetSingleLine, bool, false, AM_DEFAULT);
   URHO3D_ACCESSOR_ATTRIBUTE("Line Spacing", GetLineSpacing, SetLineSpacing, int, 0, AM_DEFAULT);
+  URHO3D_ACCESSOR_ATTRIBUTE("Max Lines", GetMaxLines, SetMaxLines, unsigned, 0, AM_DEFAULT);
+  URHO3D_ACCESSOR_ATTRIBUTE("Quad Virtualization", GetQuadVirtualization, SetQuadVirtualization, bool, false, AM_DEFAULT);
+  URHO3D_ACCESSOR_ATTRIBUTE("Quad Margin", GetQuadMargin, SetQuadMargin, int, 256, AM_DEFAULT);
+  URHO3D_ACCESSOR_ATTRIBUTE("View Offset", GetViewOffset, SetViewOffset, float, 0.0f, AM_DEFAULT);
+  URHO3D_ACCESSOR_ATTRIBUTE("Async Layout", GetAsyncLayout, SetAsyncLayout, bool, false, AM_DEFAULT);
   URHO3D_ENUM_ACCESSOR_ATTRIBUTE("Text Alignment", GetAlignment, SetAlignment, HorizontalAlignment,
     horizontal_alignments, HA_LEFT, AM_DEFAULT);
   URHO3D_ENUM_ACCESSOR_ATTRIBUTE("Ticker Type", GetTickerType, SetTickerType, TickerType,
@@ -103,6 +63,7 @@ void RichText3D::RegisterObject(Context* context) {
   URHO3D_ENUM_ACCESSOR_ATTRIBUTE("Ticker Direction", GetTickerDirection, SetTickerDirection, TickerDirection,
     ticker_directions, TickerDirection_Negative, AM_DEFAULT);
   URHO3D_ACCESSOR_ATTRIBUTE("Ticker Speed", GetTickerSpeed, SetTickerSpeed, float, 120, AM_DEFAULT);
+  URHO3D_ACCESSOR_ATTRIBUTE("Ticker Transform", GetTickerTransform, SetTickerTransform, bool, false, AM_DEFAULT);
   URHO3D_ACCESSOR_ATTRIBUTE("Can Be Occluded", IsOccludee, SetOccludee, bool, true, AM_DEFAULT);
   URHO3D_COPY_BASE_ATTRIBUTES(RichWidget);
   URHO3D_COPY_BASE_ATTRIBUTES(Drawable);
@@ -117,8 +78,14 @@ RichText3D::RichText3D(Context* context)
  , wrapping_(WRAP_WORD)
  , ticker_position_(0.0f)
  , line_spacing_(0)
+ , max_lines_(0)
+ , quad_virtualization_(false)
+ , view_offset_(0.0f)
+ , async_layout_(false)
+ , layout_generation_(0)
  , RichWidget(context)
 {
+    line_window_.SetMargin(256);
     default_format_.color = Color::WHITE;
     SetDefaultFont("Fonts/Anonymous Pro.ttf", 32);
 
@@ -128,7 +95,8 @@ RichText3D::RichText3D(Context* context)
 
 RichText3D::~RichText3D()
 {
-
+    // a worker may still use the layout job
+    CancelLayoutJob();
 }
 
 void RichText3D::SetText(const String& text)
@@ -144,6 +112,97 @@ const String& RichText3D::GetText() const
     return text_;
 }
 
+void RichText3D::AppendText(const String& text)
+{
+    // a pending relayout will include the appended text, single lines and asynchronous layouts always relayout
+    if (text_.Empty() || single_line_ || async_layout_ || IsFlagged(WidgetFlags_ContentChanged))
+    {
+        SetText(text_.Empty() || text_.EndsWith("\n") ? text_ + text : text_ + "\n" + text);
+        return;
+    }
+
+    // markup_ holds text_ while there is no pending relayout, it is parsed on from its last top-level tag
+    bool drawn_blocks_parsed = true;
+    if (!text_.EndsWith("\n"))
+    {
+        text_ += '\n';
+        if (!text_chunks_.Empty())
+            text_chunks_.Back().length++;
+        Vector<TextBlock> line_end;
+        drawn_blocks_parsed = markup_.Append("\n", line_end);
+    }
+    text_ += text;
+
+    Vector<TextBlock> markup_blocks;
+    if (!markup_.Append(text, markup_blocks) || !drawn_blocks_parsed)
+    {
+        // the drawn text parses differently with the appended text, lay out all of it
+        SetText(text_);
+        return;
+    }
+
+    unsigned first_line = lines_.Size();
+    ArrangeTextBlocks(markup_blocks);
+    TextChunk chunk;
+    chunk.length = text.Length();
+    chunk.num_lines = lines_.Size() - first_line;
+    text_chunks_.Push(chunk);
+
+    DrawTextLines(first_line);
+    if (max_lines_ && lines_.Size() > max_lines_)
+        DropLeadingLines(lines_.Size() - max_lines_);
+    SetFlags(WidgetFlags_GeometryDirty);
+}
+
+void RichText3D::SetMaxLines(unsigned max_lines)
+{
+    max_lines_ = max_lines;
+    if (max_lines_ && lines_.Size() > max_lines_)
+        DropLeadingLines(lines_.Size() - max_lines_);
+}
+
+void RichText3D::DropLeadingLines(unsigned count)
+{
+    count = Min(count, lines_.Size());
+    if (!count)
+        return;
+
+    if (quad_virtualization_)
+    {
+        // the quads are only kept for the lines around the view, draw them again
+        lines_.Erase(0, count);
+        line_window_.RemoveLeadingLines(count);
+        DrawVisibleLines(true);
+    }
+    else
+    {
+        int offset_y = count < line_tops_.Size() ? line_tops_[count] : (int)content_size_.y_;
+        lines_.Erase(0, count);
+        line_tops_.Erase(0, Min(count, line_tops_.Size()));
+        for (auto& top : line_tops_)
+            top -= offset_y;
+        content_size_.y_ -= (float)offset_y;
+        RemoveLeadingLines(count, (float)offset_y);
+    }
+
+    // drop the text of chunks without lines, a partially shown chunk stays
+    unsigned erase_length = 0;
+    unsigned num_chunks = 0;
+    for (; num_chunks < text_chunks_.Size() && text_chunks_[num_chunks].num_lines <= count; ++num_chunks)
+    {
+        count -= text_chunks_[num_chunks].num_lines;
+        erase_length += text_chunks_[num_chunks].length;
+    }
+    text_chunks_.Erase(0, num_chunks);
+    if (!text_chunks_.Empty())
+        text_chunks_.Front().num_lines -= count;
+    if (erase_length)
+    {
+        text_.Erase(0, erase_length);
+        markup_.RemoveLeadingText(erase_length);
+    }
+}
+
 void RichText3D::SetTextColor(const Color& color)
 {
     default_format_.color = color;
@@ -198,12 +257,69 @@ float RichText3D::GetTickerSpeed() const
     return ticker_speed_;
 }
 
+void RichText3D::SetTickerTransform(bool enable)
+{
+    SetScrollByTransform(enable);
+    // the scrolling starts over with the other method
+    SetDrawOrigin(Vector3::ZERO);
+    SetScrollOffset(Vector2::ZERO);
+    ResetTicker();
+}
+
+void RichText3D::SetQuadVirtualization(bool enable)
+{
+    quad_virtualization_ = enable;
+    SetFlags(WidgetFlags_ContentChanged);
+}
+
+void RichText3D::SetQuadMargin(int margin)
+{
+    line_window_.SetMargin(Max(margin, 0));
+    if (quad_virtualization_)
+        DrawVisibleLines(true);
+}
+
+void RichText3D::SetViewOffset(float offset)
+{
+    view_offset_ = Max(offset, 0.0f);
+    // a horizontal or vertical ticker moves the content itself
+    if (ticker_type_ != TickerType_Horizontal && ticker_type_ != TickerType_Vertical)
+        ApplyViewOffset();
+    if (quad_virtualization_)
+        DrawVisibleLines(false);
+}
+
+void RichText3D::ApplyViewOffset()
+{
+    scroll_origin_ = Vector3(0.0f, -view_offset_, 0.0f);
+    if (GetScrollByTransform())
+    {
+        SetDrawOrigin(Vector3::ZERO);
+        SetScrollOffset(Vector2(scroll_origin_.x_, scroll_origin_.y_));
+    }
+    else
+    {
+        SetDrawOrigin(scroll_origin_);
+        SetScrollOffset(Vector2::ZERO);
+    }
+}
+
 void RichText3D::SetSingleLine(bool single_line)
 {
     single_line_ = single_line;
     SetFlags(WidgetFlags_ContentChanged);
 }
 
+void RichText3D::SetAsyncLayout(bool enable)
+{
+    if (async_layout_ == enable)
+        return;
+    async_layout_ = enable;
+    // the running layout job used the other mode, the text is laid out again
+    CancelLayoutJob();
+    SetFlags(WidgetFlags_ContentChanged);
+}
+
 void RichText3D::ResetTicker()
 {
     scroll_origin_ = Vector3::ZERO;
@@ -226,8 +342,7 @@ void RichText3D::ResetTicker()
     }
     else
     {
-        scroll_origin_ = Vector3::ZERO;
-        SetDrawOrigin(scroll_origin_);
+        ApplyViewOffset();
     }
 
     ticker_position_ = 0.0f;
@@ -274,345 +389,254 @@ void RichText3D::SetFontSizeAttr(int size)
     SetFlags(WidgetFlags_ContentChanged);
 }
 
-void RichText3D::ArrangeTextBlocks(Vector<TextBlock>& markup_blocks)
-{
-  TextLine line;
-  if (!single_line_) {
-    Vector<TextLine> markupLines;
-    // for every new line in a block, create a new TextLine
-    for (Vector<TextBlock>::ConstIterator it = markup_blocks.Begin(); it != markup_blocks.End(); ++it) {
-      size_t posNewLine = 0;
-      size_t posLast = 0;
-      if ((posNewLine = it->text.Find("\n", posLast)) != String::NPOS) {
-        while ((posNewLine = it->text.Find("\n", posLast)) != String::NPOS) {
-          TextBlock block;
-          block.text = it->text.Substring(posLast, posNewLine - posLast);
-          block.format = it->format;
-          line.blocks.Push(block);
-          markupLines.Push(line);
-          posLast = posNewLine + 1;
-          line.blocks.Clear();
-        }
-        if (posLast < it->text.Length() - 1) {
-          TextBlock block;
-          block.text = it->text.Substring(posLast, it->text.Length() - posLast);
-          block.format = it->format;
-          line.blocks.Push(block);
-        }
-      } else {
-        if (it->is_line_break) {
-          line.blocks.Push(*it);
-          markupLines.Push(line);
-          line.blocks.Clear();
-        }
-        line.blocks.Push(*it);
-        // update line alignment from this block if it is not left
-        if (it->format.align != HA_LEFT)
-          line.align = it->format.align;
-      }
-    }
-
-    // make sure there's at least one line with text
-    if (!line.blocks.Empty())
-      markupLines.Push(line);
+void RichText3D::ArrangeTextBlocks(const Vector<TextBlock>& markup_blocks)
+{
+  RichWidgetLayout target(this, default_format_);
+  RichLayoutEngine layout(&target);
+  layout.SetLayoutRect(GetClipRegion());
+  layout.SetWordWrap(wrapping_ == WRAP_WORD);
+  layout.SetSingleLine(single_line_);
+  layout.Arrange(markup_blocks, lines_);
+}
 
-    IntRect actual_clip_region = GetClipRegion();
-    // do the word wrapping and layout positioning
-    if (wrapping_ == WRAP_WORD && actual_clip_region.Width()) {
-      int layout_width = actual_clip_region.Width();
-      int layout_height = actual_clip_region.Height();
-      int layout_x = actual_clip_region.left_;
-      int layout_y = actual_clip_region.top_;
-
-      int draw_offset_x = layout_x;
-      int draw_offset_y = layout_y;
-
-      FontState fontstate;
-
-      for (Vector<TextLine>::Iterator it = markupLines.Begin(); it != markupLines.End(); ++it) {
-        TextLine* line = &*it;
-
-        TextLine new_line;
-        new_line.height = 0;
-        new_line.width = 0;
-        new_line.offset_x = layout_x;
-        new_line.offset_y = 0;
-        new_line.align = line->align;
-
-        // reset the x offset of the current line
-        draw_offset_x = layout_x;
-
-        for (Vector<TextBlock>::Iterator bit = line->blocks.Begin(); bit != line->blocks.End(); ++bit) {
-          TextBlock new_block;
-          new_block.format = (*bit).format;
-
-          if (bit->type == TextBlock::BlockType_Text) {
-            size_t crpos;
-            while ((crpos = bit->text.Find("\r")) != String::NPOS)
-              bit->text.Erase(crpos, 1);
-
-            Vector<String> words;
-            splitwords(bit->text, words, splitter_chars, false);
-            if (words.Empty())
-              words.Push(bit->text);
-
-            bool new_line_space = false;
-
-            // bold-italic flags are passed as third asset name parameter
-            String bi = String(bit->format.font.bold ? "b" : "") + String(bit->format.font.italic ? "i" : "");
-            if (!bi.Empty())
-              bi = String(".") + bi;
-
-            // this block's text renderer
-            String id;
-            fontstate.face = bit->format.font.face;
-            fontstate.size = bit->format.font.size;
-            if (fontstate.face.Empty())
-              fontstate.face = default_format_.font.face;
-            if (fontstate.size <= 0)
-              fontstate.size = default_format_.font.size;
-            id.AppendWithFormat("%s.%d%s", fontstate.face.CString(), fontstate.size, bi.CString());
-            RichWidgetText* text_renderer = CacheWidgetBatch<RichWidgetText>(id);
-            text_renderer->SetFont(fontstate.face, fontstate.size);
-
-            // for every word in this block do a check if there's enough space on the current line
-            // Simple word wrap logic: if the space is enough, put the word on the current line, else go to the next line
-            String the_word;
-            for (Vector<String>::ConstIterator wit = words.Begin(); wit != words.End(); ++wit) {
-              the_word = *wit;
-              Vector2 wordsize = text_renderer->CalculateTextExtents(the_word);
-
-              new_line.height = Max<int>((int)wordsize.y_, new_line.height);
-
-              bool needs_new_line = (draw_offset_x + wordsize.x_) > layout_width;
-              bool is_wider_than_line = wordsize.x_ > layout_width;
-
-              // Handle cases where this word can't be fit in a line
-              while (is_wider_than_line && needs_new_line) {
-                String fit_word = the_word;
-                int width_remain = (int)wordsize.x_ - layout_width;
-                assert(width_remain >= 0);
-                // remove a char from this word until it can be fit in the current line
-                Vector2 newwordsize;
-                while (width_remain > 0 && !fit_word.Empty()) {
-                  fit_word.Erase(fit_word.Length() - 1);
-                  newwordsize = text_renderer->CalculateTextExtents(fit_word);
-                  width_remain = (int)newwordsize.x_ - layout_width;
-                }
-
-                // prevent endless loops
-                if (fit_word.Empty())
-                  break;
-
-                // append the fitting part of the word in the current line
-                // and create a new line
-                new_block.text.Append(fit_word);
-                new_line.blocks.Push(new_block);
-                draw_offset_x += (int)newwordsize.x_;
-                new_line.width = draw_offset_x;
-                new_line.offset_y = draw_offset_y;
-                lines_.Push(new_line);
-                // create a new empty line
-                new_line.blocks.Clear();
-                new_block.text.Clear();
-                draw_offset_x = layout_x;
-                draw_offset_y += new_line.height;
-
-                the_word = the_word.Substring(fit_word.Length());
-
-                wordsize = text_renderer->CalculateTextExtents(the_word);
-                draw_offset_x += (int)wordsize.x_;
-                is_wider_than_line = wordsize.x_ > layout_width;
-
-                if (!is_wider_than_line) {
-                  needs_new_line = false;
-                  // the leftovers from the_word will be added to the line below
-                  break;
-                }
-              }
-
-              // carry the whole word on a new line
-              if (needs_new_line) {
-                new_line.width = draw_offset_x;
-                new_line.offset_y = draw_offset_y;
-                new_line.blocks.Push(new_block);
-                lines_.Push(new_line);
-                // create next empty line
-                new_line.blocks.Clear();
-                // add current text to a block
-                new_block.text.Clear();
-                draw_offset_x = layout_x;
-                draw_offset_y += new_line.height;
-                if (the_word == " " || the_word == "\t") {
-                  // mark as space
-                  new_line_space = true;
-                  continue;
-                }
-              }
-
-              if (new_line_space) {
-                if (the_word != " " && the_word != "\t")
-                  new_line_space = false;
-                else
-                  continue;
-              }
-              new_block.text.Append(the_word);
-              draw_offset_x += (int)wordsize.x_;
-            }
-
-            new_line.blocks.Push(new_block);
-          } else {
-            // if the block is iconic (image, video, etc)
-            new_block = (*bit); // copy the block
-            if (new_block.is_visible) {
-              RichWidgetImage* image_renderer = CacheWidgetBatch<RichWidgetImage>(new_block.text);
-              image_renderer->SetImageSource(new_block.text);
-              if (new_block.image_height == 0) {
-                float aspect = image_renderer->GetImageAspect();
-                if (aspect == 0.f)
-                  aspect = 1.0f;
-
-                // fit by height
-                //new_block.image_height = clip_region_.height();
-                //new_block.image_width = new_block.image_height * aspect;
-
-                // fit by width
-                new_block.image_width = (float)(new_block.image_width > 0 ? new_block.image_width : clip_region_.Width());
-                new_block.image_height = new_block.image_width / aspect;
-              }
-
-              if (new_block.image_width == 0) {
-                new_block.image_width = (float)clip_region_.Width();
-              }
-              new_line.blocks.Push(new_block);
-
-              draw_offset_x += (int)new_block.image_width;
-              new_line.height = Max((int)new_block.image_height, new_line.height);
-            }
-          }
-
-          new_line.width = draw_offset_x;
-          new_line.offset_y = draw_offset_y;
-          draw_offset_y += new_line.height;
-        }
-
-        lines_.Push(new_line);
-        new_line.blocks.Clear();
-      }
+void RichText3D::DrawTextLines(unsigned first_line) {
+  if (quad_virtualization_) {
+    if (!first_line)
+      line_window_.Reset();
+    // appended lines are drawn when the drawn lines reach the end of the text, otherwise once they are scrolled to
+    if (!first_line || line_window_.GetEndLine() >= first_line) {
+      DrawVisibleLines(true);
     } else {
-      // in case there's no word wrapping or the layout has no width
-      lines_ = markupLines;
+      content_size_.x_ = line_window_.GetMeasuredWidth();
+      content_size_.y_ = line_window_.GetEstimatedHeight(lines_.Size());
     }
+    if (!first_line)
+      ResetTicker();
+    return;
+  }
 
+  // clear all quads
+  if (!first_line) {
+    Clear();
+    line_tops_.Clear();
+  }
 
-  } else {
-    // Single line...
-    // replace /n/r with empty space
-    for (auto i = markup_blocks.Begin(); i != markup_blocks.End(); i++) {
-      size_t crpos;
-      while ((crpos = find_first_of(i->text, "\n\r")) != String::NPOS) {
-        i->text.Replace(crpos, 1, " ");
-      }
-      // TODO: single line doesn't get images when width or height = 0
-      line.blocks.Push(*i);
-    }
-    lines_.Push(line);
+  RichWidgetLayout target(this, default_format_);
+  RichLayoutEngine layout(&target);
+  layout.SetLineSpacing(line_spacing_);
+
+  PODVector<RichLayoutRun> runs;
+  layout.Place(lines_, first_line, clip_region_.Width(), first_line ? (int)content_size_.y_ : 0, runs);
+  target.Draw(runs, lines_.Size() - first_line, Vector3::ZERO);
+
+  line_tops_.Push(layout.GetLineTops());
+  if (first_line < lines_.Size()) {
+    content_size_.x_ = Max<float>(content_size_.x_, layout.GetContentSize().x_);
+    content_size_.y_ = layout.GetContentSize().y_;
   }
+  if (!first_line)
+    ResetTicker();
 }
 
-void RichText3D::DrawTextLines() {
-  // clear all quads
+void RichText3D::DrawVisibleLines(bool force) {
+  const int view_top = (int)view_offset_;
+  const int view_bottom = view_top + clip_region_.Height();
+  if (!force && line_window_.Covers(view_top, view_bottom))
+    return;
+
   Clear();
 
-  RichWidgetText* text_renderer;
-  RichWidgetImage* image_renderer;
-
-  int xoffset = 0, yoffset = 0;
-
-  for (auto lit = lines_.Begin(); lit != lines_.End(); ++lit) {
-    // adjust the size and offset of every block in a line
-    TextLine* l = &(*lit);
-
-    switch (l->align) {
-    default:
-    case HA_LEFT:
-      xoffset = l->offset_x;
-      break;
-    case HA_CENTER:
-      xoffset = (clip_region_.Width() - l->width) / 2;
-      break;
-    case HA_RIGHT:
-      xoffset = clip_region_.Width() - l->width;
-    }
+  RichWidgetLayout target(this, default_format_);
+  RichLayoutEngine layout(&target);
+  layout.SetLineSpacing(line_spacing_);
 
-    FontState fontstate;
-
-    int line_max_height = 0;
-    for (auto it = l->blocks.Begin(); it != l->blocks.End(); ++it) {
-      if (it->type == TextBlock::BlockType_Image) {
-        image_renderer = CacheWidgetBatch<RichWidgetImage>(it->text);
-        //image_renderer->clearQuads();
-        if (image_renderer->GetImageSource() != it->text)
-          image_renderer->SetImageSource(it->text);
-
-        if (it->image_width == 0)
-          it->image_width = (float)clip_region_.Width();
-        if (it->image_height == 0) {
-          // height should be the line max height
-          it->image_height = (float)line_max_height;
-          // width should be auto calculated based on the texture size
-          float aspect = image_renderer->GetImageAspect();
-          it->image_width = it->image_height * aspect;
-        }
-
-        image_renderer->AddImage(Vector3((float)xoffset, (float)yoffset, 0.0f), it->image_width, it->image_height);
-        line_max_height = Max((int)it->image_height, line_max_height);
-        xoffset += (int)it->image_width;
-      } else if (it->type == TextBlock::BlockType_Text) {
-        fontstate = it->format.font;
-        if (fontstate.face.Empty())
-          fontstate.face = default_format_.font.face;
-        if (fontstate.size <= 0)
-          fontstate.size = default_format_.font.size;
-
-        String bi = String(it->format.font.bold ? "b" : "") + String(it->format.font.italic ? "i" : "");
-        if (!bi.Empty())
-          bi = String(".") + bi;
-        String id = fontstate.face + "." + ToString("%d", it->format.font.size) + bi;
-        id.AppendWithFormat("%s.%d%s", fontstate.face.CString(), fontstate.size, bi.CString());
-        text_renderer = CacheWidgetBatch<RichWidgetText>(id);
-        // TODO: turn this back on when we have more fonts
-        text_renderer->SetFont(fontstate.face, fontstate.size, fontstate.bold, fontstate.italic);
-        //text_renderer->SetFont(default_font_state_.face, default_font_state_.size);
-
-        text_renderer->AddText(it->text, Vector3((float)xoffset, (float)yoffset, 0.0f), it->format.color);
-        if (text_renderer->GetFontFace()) {
-          line_max_height = Max<int>((int)text_renderer->GetRowHeight(), line_max_height);
-          xoffset += (int)text_renderer->CalculateTextExtents(it->text).x_;
-        }
-      }
-    }
-    yoffset += line_max_height + line_spacing_;
-    content_size_.x_ = Max<float>(content_size_.x_, xoffset);
-    content_size_.y_ = (float)yoffset;
-  }
-  ResetTicker();
+  PODVector<RichLayoutRun> runs;
+  line_window_.Place(layout, lines_, clip_region_.Width(), view_top, view_bottom, runs);
+  target.Draw(runs, line_window_.GetEndLine() - line_window_.GetFirstLine(), Vector3::ZERO);
+
+  // the height of the lines not measured yet is estimated
+  content_size_.x_ = line_window_.GetMeasuredWidth();
+  content_size_.y_ = line_window_.GetEstimatedHeight(lines_.Size());
+  SetFlags(WidgetFlags_GeometryDirty);
 }
 
 void RichText3D::CompileTextLayout() {
+  // a layout job started before is out of date now
+  ++layout_generation_;
+
+  // the markup belongs to the running layout job, the newest text is compiled once it is done
+  if (layout_item_) {
+    SetFlags(WidgetFlags_ContentChanged);
+    return;
+  }
+
+  if (async_layout_) {
+    StartLayoutJob();
+    return;
+  }
+
   lines_.Clear();
   content_size_ = Vector2::ZERO;
 
-  Vector<TextBlock> markup_blocks;
-  markup_blocks.Reserve(10);
+  markup_.Update(text_, default_format_);
+  ArrangeTextBlocks(markup_.GetBlocks());
+  if (max_lines_ && lines_.Size() > max_lines_)
+    lines_.Erase(0, lines_.Size() - max_lines_);
+
+  // the lines of all chunks are laid out again, treat the text as one chunk
+  text_chunks_.Clear();
+  TextChunk chunk;
+  chunk.length = text_.Length();
+  chunk.num_lines = lines_.Size();
+  text_chunks_.Push(chunk);
 
-  HTMLParser::Parse(text_, markup_blocks, default_format_);
-  ArrangeTextBlocks(markup_blocks);
   DrawTextLines();
   ClearFlags(WidgetFlags_ContentChanged);
   SetFlags(WidgetFlags_GeometryDirty);
 }
 
+void RichText3D::StartLayoutJob() {
+  if (!GetSubsystem<WorkQueue>())
+    return;
+
+  layout_job_ = new LayoutJob();
+  LayoutJob& job = *layout_job_;
+  job.text = text_;
+  job.default_format = default_format_;
+  job.layout_rect = GetClipRegion();
+  job.width = clip_region_.Width();
+  job.word_wrap = wrapping_ == WRAP_WORD;
+  job.single_line = single_line_;
+  job.quad_virtualization = quad_virtualization_;
+  job.line_spacing = line_spacing_;
+  job.max_lines = max_lines_;
+  job.markup.Swap(markup_);
+  job.stage = 0;
+  job.generation = layout_generation_;
+
+  QueueLayoutJob();
+  ClearFlags(WidgetFlags_ContentChanged);
+}
+
+void RichText3D::QueueLayoutJob() {
+  WorkQueue* queue = GetSubsystem<WorkQueue>();
+  layout_item_ = queue->GetFreeItem();
+  layout_item_->workFunction_ = RunLayoutJob;
+  layout_item_->aux_ = layout_job_.Get();
+  // low priority, the end of the frame does not wait for it
+  layout_item_->priority_ = 0;
+  layout_item_->sendEvent_ = true;
+  SubscribeToEvent(queue, E_WORKITEMCOMPLETED, URHO3D_HANDLER(RichText3D, HandleWorkItemCompleted));
+  queue->AddWorkItem(layout_item_);
+}
+
+void RichText3D::RunLayoutJob(const WorkItem* item, unsigned threadIndex) {
+  LayoutJob& job = *static_cast<LayoutJob*>(item->aux_);
+  RichLayoutEngine layout(&job.metrics);
+  layout.SetLayoutRect(job.layout_rect);
+  layout.SetWordWrap(job.word_wrap);
+  layout.SetSingleLine(job.single_line);
+  layout.SetLineSpacing(job.line_spacing);
+
+  if (!job.stage) {
+    // parsing and splitting don't measure, the fonts are not needed yet
+    job.markup.Update(job.text, job.default_format);
+    if (job.single_line)
+      layout.Arrange(job.markup.GetBlocks(), job.lines);
+    else
+      layout.Segment(job.markup.GetBlocks(), job.words);
+    return;
+  }
+
+  if (!job.single_line)
+    layout.Fill(job.words, job.lines);
+  if (job.max_lines && job.lines.Size() > job.max_lines)
+    job.lines.Erase(0, job.lines.Size() - job.max_lines);
+  // with quad virtualization the lines around the view are placed on the main thread
+  if (!job.quad_virtualization) {
+    layout.Place(job.lines, 0, job.width, 0, job.runs);
+    job.line_tops = layout.GetLineTops();
+    job.content_size = layout.GetContentSize();
+  }
+}
+
+void RichText3D::HandleWorkItemCompleted(StringHash eventType, VariantMap& eventData) {
+  using namespace WorkItemCompleted;
+  if (!layout_item_ || eventData[P_ITEM].GetVoidPtr() != layout_item_.Get())
+    return;
+  layout_item_.Reset();
+
+  // a newer layout was asked for meanwhile, the result is dropped and the newest text compiled
+  if (layout_job_->generation != layout_generation_) {
+    UnsubscribeFromEvent(GetSubsystem<WorkQueue>(), E_WORKITEMCOMPLETED);
+    markup_.Swap(layout_job_->markup);
+    layout_job_.Reset();
+    CompileTextLayout();
+    return;
+  }
+
+  if (!layout_job_->stage) {
+    // copy the metrics of the fonts the text uses, fonts are only touched on the main thread
+    RichWidgetLayout target(this, layout_job_->default_format);
+    layout_job_->metrics.Capture(target, layout_job_->single_line ? layout_job_->lines : layout_job_->words.lines,
+      layout_job_->default_format);
+    layout_job_->stage = 1;
+    QueueLayoutJob();
+    return;
+  }
+
+  UnsubscribeFromEvent(GetSubsystem<WorkQueue>(), E_WORKITEMCOMPLETED);
+  FinishLayoutJob();
+}
+
+void RichText3D::CancelLayoutJob() {
+  if (!layout_item_)
+    return;
+
+  // a worker may run the job already, it is waited for then
+  WorkQueue* queue = GetSubsystem<WorkQueue>();
+  if (!queue->RemoveWorkItem(layout_item_)) {
+    while (!layout_item_->completed_)
+      Time::Sleep(0);
+  }
+  layout_item_.Reset();
+  UnsubscribeFromEvent(queue, E_WORKITEMCOMPLETED);
+
+  // the job markup holds the incremental parse state
+  markup_.Swap(layout_job_->markup);
+  layout_job_.Reset();
+}
+
+void RichText3D::FinishLayoutJob() {
+  SharedPtr<LayoutJob> job = layout_job_;
+  layout_job_.Reset();
+
+  markup_.Swap(job->markup);
+  // the runs point to the blocks of the lines, swapping keeps them in place
+  lines_.Swap(job->lines);
+  content_size_ = Vector2::ZERO;
+
+  text_chunks_.Clear();
+  TextChunk chunk;
+  chunk.length = text_.Length();
+  chunk.num_lines = lines_.Size();
+  text_chunks_.Push(chunk);
+
+  if (job->quad_virtualization) {
+    DrawTextLines();
+  } else {
+    // glyph quads need the font textures, they are added here
+    Clear();
+    RichWidgetLayout target(this, job->default_format);
+    target.Draw(job->runs, lines_.Size(), Vector3::ZERO);
+    line_tops_ = job->line_tops;
+    if (!lines_.Empty())
+      content_size_ = job->content_size;
+    ResetTicker();
+  }
+  SetFlags(WidgetFlags_GeometryDirty);
+}
+
 void RichText3D::UpdateTickerAnimation(Urho3D::StringHash eventType, Urho3D::VariantMap& eventData)
 {
   using namespace RenderUpdate;
@@ -621,11 +645,9 @@ void RichText3D::UpdateTickerAnimation(Urho3D::StringHash eventType, Urho3D::Var
   if (!IsEnabled())
     return;
 
+  // an asynchronous layout keeps the flag until it can start
   if (IsFlagged(WidgetFlags_ContentChanged))
-  {
     CompileTextLayout();
-    ClearFlags(WidgetFlags_ContentChanged);
-  }
 
   // Update ticker state
   if (ticker_type_ != TickerType_None)
@@ -653,8 +675,17 @@ void RichText3D::UpdateTickerAnimation(Urho3D::StringHash eventType, Urho3D::Var
     scroll_origin_.x_ += horizontal_dir * move_factor;
     scroll_origin_.y_ += vertical_dir * move_factor;
 
-    // move the content
-    SetDrawOrigin(scroll_origin_);
+    // move the content, by transform the geometry stays as it is
+    if (GetScrollByTransform())
+      SetScrollOffset(Vector2(scroll_origin_.x_, scroll_origin_.y_));
+    else
+      SetDrawOrigin(scroll_origin_);
+
+    // a vertical ticker scrolls the view of the virtualized quads
+    if (quad_virtualization_ && vertical_dir) {
+      view_offset_ = -scroll_origin_.y_;
+      DrawVisibleLines(false);
+    }
 
     // check if the text has scrolled out
     bool scrolled_out = false;
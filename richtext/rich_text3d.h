@@ -3,6 +3,8 @@
 #pragma once
 
 #include "rich_widget.h"
+#include "rich_markup_cache.h"
+#include "Urho3D/Core/WorkQueue.h"
 
 namespace Urho3D {
 
@@ -29,6 +31,14 @@ public:
     void SetText(const String& text);
     /// Get currently displayed text (as markup).
     const String& GetText() const;
+    /// Append markup on a new line. Parsing resumes from the last top-level tag, so tags left open by the previous
+    /// text apply to it, and only the new lines are laid out and drawn. Single line and asynchronous layouts lay out
+    /// the whole text again on every append.
+    void AppendText(const String& text);
+    /// Set maximum number of lines, the oldest lines are dropped first. 0 = unlimited.
+    void SetMaxLines(unsigned max_lines);
+    /// Get maximum number of lines.
+    unsigned GetMaxLines() const { return max_lines_; }
     /// Set default font for blocks without formatting.
     void SetDefaultFont(const String& face, unsigned size);
     /// Get default font name
@@ -63,6 +73,29 @@ public:
     void SetTickerSpeed(float pixelspersecond);
     /// Get ticker scroll speed.
     float GetTickerSpeed() const;
+    /// Set ticker scrolling by transform. The geometry is then rebuilt only every window of scrolling, content within one
+    /// window of the clip region is not clipped meanwhile.
+    void SetTickerTransform(bool enable);
+    /// Get ticker scrolling by transform.
+    bool GetTickerTransform() const { return GetScrollByTransform(); }
+    /// Set quad virtualization, only the lines around the view get quads. For long texts that are scrolled. The text is
+    /// still parsed and wrapped as a whole when it changes, the lines are measured on demand.
+    void SetQuadVirtualization(bool enable);
+    /// Get quad virtualization.
+    bool GetQuadVirtualization() const { return quad_virtualization_; }
+    /// Set the pixels above and below the view that get quads too with quad virtualization.
+    void SetQuadMargin(int margin);
+    /// Get the pixels above and below the view that get quads with quad virtualization.
+    int GetQuadMargin() const { return line_window_.GetMargin(); }
+    /// Set the vertical scroll position of the view in pixels, 0 shows the first line at the top.
+    void SetViewOffset(float offset);
+    /// Get the vertical scroll position of the view in pixels.
+    float GetViewOffset() const { return view_offset_; }
+    /// Set asynchronous layout, the text is parsed and wrapped on WorkQueue threads. The previous layout stays
+    /// visible until the new one is done. A running layout is cancelled and the text laid out again.
+    void SetAsyncLayout(bool enable);
+    /// Get asynchronous layout.
+    bool GetAsyncLayout() const { return async_layout_; }
     /// Set single line.
     void SetSingleLine(bool single_line);
     /// Get single line.
@@ -94,6 +127,8 @@ protected:
     float ticker_speed_;
     /// Default font state for unformatted text.
     BlockFormat default_format_;
+    /// The parsed text.
+    RichMarkupDocument markup_;
     /// The lines of text.
     Vector<TextLine> lines_; // TODO: could be removed in the future.
     /// The scroll origin of the text (in ticker mode).
@@ -104,13 +139,89 @@ protected:
     float ticker_position_;
     /// Wrapping
     TextWrapping wrapping_;
+    /// Maximum number of lines, 0 = unlimited.
+    unsigned max_lines_;
+
+    /// A piece of text_ added by SetText() or AppendText().
+    struct TextChunk
+    {
+        /// Length of the markup
+        unsigned length;
+        /// Number of lines still in lines_
+        unsigned num_lines;
+    };
+    /// The pieces of text_, dropped with their last line.
+    PODVector<TextChunk> text_chunks_;
+    /// Top of every line in lines_, in pixels.
+    PODVector<int> line_tops_;
+    /// Quad virtualization flag.
+    bool quad_virtualization_;
+    /// Vertical scroll position of the view.
+    float view_offset_;
+    /// The lines with quads with quad virtualization.
+    RichLineWindow line_window_;
+    /// Is the layout compiled on worker threads.
+    bool async_layout_;
+
+    /// A layout compiled on worker threads, the workers only touch the job.
+    struct LayoutJob : public RefCounted
+    {
+        /// Copy of the widget state the layout is compiled for
+        String text;
+        BlockFormat default_format;
+        IntRect layout_rect;
+        int width;
+        bool word_wrap;
+        bool single_line;
+        bool quad_virtualization;
+        int line_spacing;
+        unsigned max_lines;
+        /// The parsed markup, swapped with the widget's to keep its incremental parse state
+        RichMarkupDocument markup;
+        /// Metrics of the fonts used by the text, copied on the main thread after parsing
+        RichLayoutMetrics metrics;
+        RichLayoutWords words;
+        /// The result
+        Vector<TextLine> lines;
+        PODVector<RichLayoutRun> runs;
+        PODVector<int> line_tops;
+        Vector2 content_size;
+        /// 0 while parsing, 1 while wrapping and placing
+        unsigned stage;
+        /// Layout generation the job was started for, the result is dropped if a newer layout was asked for
+        unsigned generation;
+    };
+    /// The layout being compiled.
+    SharedPtr<LayoutJob> layout_job_;
+    /// The queued stage of the layout job.
+    SharedPtr<WorkItem> layout_item_;
+    /// Incremented whenever a layout is asked for.
+    unsigned layout_generation_;
 
     /// Compile the text to render items.
     void CompileTextLayout();
     /// Arrange text blocks into the textview layout as lines.
-    void ArrangeTextBlocks(Vector<TextBlock>& markup_blocks);
-    /// Draw text lines to the widget.
-    void DrawTextLines();
+    void ArrangeTextBlocks(const Vector<TextBlock>& markup_blocks);
+    /// Draw text lines to the widget, starting from first_line. Lines before it are kept.
+    void DrawTextLines(unsigned first_line = 0);
+    /// Draw the lines around the view with quad virtualization, if the drawn lines don't cover it or force is set.
+    void DrawVisibleLines(bool force);
+    /// Move the content to the view offset.
+    void ApplyViewOffset();
+    /// Remove the first lines, their quads and the text chunks that have no lines left.
+    void DropLeadingLines(unsigned count);
+    /// Start compiling the text on worker threads.
+    void StartLayoutJob();
+    /// Queue the next stage of the layout job.
+    void QueueLayoutJob();
+    /// Run a stage of a layout job on a worker thread.
+    static void RunLayoutJob(const WorkItem* item, unsigned threadIndex);
+    /// Continue or finish the layout job when its stage is done.
+    void HandleWorkItemCompleted(StringHash eventType, VariantMap& eventData);
+    /// Remove the layout job from the queue, or wait for the worker running it, and drop it.
+    void CancelLayoutJob();
+    /// Replace the lines and quads with the finished layout job.
+    void FinishLayoutJob();
 
     /// Per-frame text animation.
     void UpdateTickerAnimation(Urho3D::StringHash eventType, Urho3D::VariantMap& eventData);
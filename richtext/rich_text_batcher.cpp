@@ -0,0 +1,477 @@
+#include "rich_text_batcher.h"
+#include "rich_widget.h"
+#include "Urho3D/Container/Sort.h"
+#include "Urho3D/Core/Context.h"
+#include "Urho3D/Core/CoreEvents.h"
+#include "Urho3D/Graphics/Camera.h"
+#include "Urho3D/Graphics/IndexBuffer.h"
+#include "Urho3D/Scene/Node.h"
+#include "Urho3D/Scene/Scene.h"
+
+namespace Urho3D
+{
+
+namespace
+{
+
+/// Maximum number of vertices in a buffer, more go to another buffer of the material.
+const unsigned MAX_BUFFER_VERTICES = 262144;
+/// Released vertices of a buffer before it is compacted, at least half of the buffer must be released too.
+const unsigned MIN_COMPACT_VERTICES = 4096;
+
+/// Round a vertex count up to whole quads.
+inline unsigned RoundToQuads(unsigned count)
+{
+    return (count + 3) & ~3U;
+}
+
+} // namespace
+
+/// Register object factory. Drawable must be registered first.
+void RichTextBatcher::RegisterObject(Context* context)
+{
+    context->RegisterFactory<RichTextBatcher>(GEOMETRY_CATEGORY);
+    URHO3D_COPY_BASE_ATTRIBUTES(Drawable);
+}
+
+RichTextBatcher::RichTextBatcher(Context* context)
+ : Drawable(context, DRAWABLE_GEOMETRY)
+ , changed_(false)
+{
+}
+
+RichTextBatcher::~RichTextBatcher()
+{
+    RemoveAllWidgets();
+}
+
+void RichTextBatcher::AddWidget(RichWidget* widget)
+{
+    if (!widget)
+        return;
+    for (const Member& member : members_)
+    {
+        if (member.widget.Get() == widget)
+            return;
+    }
+
+    Member member;
+    member.widget = widget;
+    member.shown = false;
+    member.batched = false;
+    members_.Push(member);
+}
+
+void RichTextBatcher::RemoveWidget(RichWidget* widget)
+{
+    for (unsigned i = 0; i < members_.Size(); ++i)
+    {
+        if (members_[i].widget.Get() == widget)
+        {
+            Release(members_[i]);
+            members_.Erase(i);
+            return;
+        }
+    }
+}
+
+void RichTextBatcher::Flush()
+{
+    for (unsigned i = 0; i < members_.Size();)
+    {
+        Member& member = members_[i];
+        RichWidget* widget = member.widget.Get();
+        if (!widget)
+        {
+            Release(member);
+            members_.Erase(i);
+            continue;
+        }
+        ++i;
+
+        bool batched = widget->IsBatched();
+        if (batched != member.batched)
+        {
+            // the widget fills or clears its own batches on the next draw
+            member.batched = batched;
+            widget->SetFlags(WidgetFlags_GeometryDirty);
+        }
+
+        if (!batched || !widget->GetVisible() || !widget->IsEnabledEffective())
+        {
+            if (member.shown)
+                Release(member);
+            continue;
+        }
+
+        if (widget->IsFlagged(WidgetFlags_GeometryDirty))
+        {
+            widget->Draw();
+            widget->ClearFlags(WidgetFlags_GeometryDirty);
+        }
+
+        if (widget->batcher_dirty_ || !member.shown)
+            Submit(member);
+    }
+
+    for (unsigned i = 0; i < buffers_.Size(); ++i)
+    {
+        const Buffer& buffer = buffers_[i];
+        if (buffer.num_free && (buffer.num_free == buffer.num_vertices ||
+            (buffer.num_free >= MIN_COMPACT_VERTICES && buffer.num_free * 2 >= buffer.num_vertices)))
+            Compact(i);
+    }
+
+    UploadBuffers();
+
+    if (changed_)
+    {
+        bounds_.Clear();
+        for (const Member& member : members_)
+        {
+            if (member.shown && member.widget)
+                bounds_.Merge(member.widget->GetWorldBoundingBox());
+        }
+        OnMarkedDirty(node_);
+        changed_ = false;
+    }
+}
+
+void RichTextBatcher::UpdateBatches(const FrameInfo& frame)
+{
+    distance_ = frame.camera_->GetDistance(GetWorldBoundingBox().Center());
+
+    // the vertices are in world space
+    for (unsigned i = 0; i < batches_.Size(); ++i)
+    {
+        batches_[i].distance_ = distance_;
+        batches_[i].worldTransform_ = &Matrix3x4::IDENTITY;
+    }
+}
+
+void RichTextBatcher::OnSceneSet(Scene* scene)
+{
+    Drawable::OnSceneSet(scene);
+
+    if (scene)
+    {
+        // after the render update the widgets have their vertices and camera transforms of this frame, and the
+        // buffers are uploaded before it is rendered
+        SubscribeToEvent(E_POSTRENDERUPDATE, URHO3D_HANDLER(RichTextBatcher, HandlePostRenderUpdate));
+
+        // widgets added to the scene before the batcher
+        PODVector<RichWidget*> widgets;
+        scene->GetDerivedComponents<RichWidget>(widgets, true);
+        for (RichWidget* widget : widgets)
+            widget->UpdateBatcher(scene);
+    }
+    else
+    {
+        UnsubscribeFromEvent(E_POSTRENDERUPDATE);
+        RemoveAllWidgets();
+    }
+}
+
+void RichTextBatcher::OnWorldBoundingBoxUpdate()
+{
+    if (bounds_.Defined())
+        worldBoundingBox_ = bounds_;
+    else
+        worldBoundingBox_.Define(node_->GetWorldPosition());
+}
+
+void RichTextBatcher::HandlePostRenderUpdate(StringHash eventType, VariantMap& eventData)
+{
+    Flush();
+}
+
+void RichTextBatcher::Submit(Member& member)
+{
+    RichWidget* widget = member.widget.Get();
+    const PODVector<UIBatch>& ui_batches = widget->ui_batches_;
+
+    // vertices of the widget by material, the parts keep their materials alive until the slots are allocated
+    struct Part
+    {
+        SharedPtr<Material> material;
+        unsigned count;
+    };
+    Vector<Part> parts;
+    PODVector<unsigned> batch_parts(ui_batches.Size());
+    for (unsigned i = 0; i < ui_batches.Size(); ++i)
+    {
+        const UIBatch& ui_batch = ui_batches[i];
+        unsigned count = (ui_batch.vertexEnd_ - ui_batch.vertexStart_) / UI_VERTEX_SIZE;
+        SharedPtr<Material> material = count ? widget->items_[widget->batch_index_to_item_index_[i]]->GetMaterial(
+          ui_batch.texture_, widget->zbias_) : SharedPtr<Material>();
+        batch_parts[i] = M_MAX_UNSIGNED;
+        if (!material)
+            continue;
+
+        unsigned part = 0;
+        while (part < parts.Size() && parts[part].material != material)
+            ++part;
+        if (part == parts.Size())
+            parts.Push(Part{material, 0});
+        parts[part].count += count;
+        batch_parts[i] = part;
+    }
+
+    // keep the ranges the vertices still fit in, release the others before reserving new ones
+    PODVector<Slot> slots(parts.Size());
+    PODVector<bool> kept(parts.Size(), false);
+    for (const Slot& old_slot : member.slots)
+    {
+        unsigned part = 0;
+        while (part < parts.Size() && (kept[part] || parts[part].material != buffers_[old_slot.buffer].material ||
+            parts[part].count > old_slot.range.count))
+            ++part;
+        if (part < parts.Size())
+        {
+            slots[part] = old_slot;
+            kept[part] = true;
+        }
+        else
+            Free(old_slot);
+    }
+    for (unsigned part = 0; part < parts.Size(); ++part)
+    {
+        if (!kept[part])
+            slots[part] = Allocate(parts[part].material, parts[part].count);
+        slots[part].used = 0;
+    }
+
+    Matrix3x4 transform = widget->node_->GetWorldTransform();
+    if (widget->scroll_by_transform_ && widget->scroll_offset_ != widget->scroll_built_offset_)
+        transform = transform * Matrix3x4(widget->GetScrollTranslation(), Quaternion::IDENTITY, 1.0f);
+
+    for (unsigned i = 0; i < ui_batches.Size(); ++i)
+    {
+        if (batch_parts[i] == M_MAX_UNSIGNED)
+            continue;
+
+        const UIBatch& ui_batch = ui_batches[i];
+        unsigned count = (ui_batch.vertexEnd_ - ui_batch.vertexStart_) / UI_VERTEX_SIZE;
+        Slot& slot = slots[batch_parts[i]];
+        const float* src = &widget->ui_vertex_data_[ui_batch.vertexStart_];
+        float* dest = &buffers_[slot.buffer].vertex_data[(slot.range.start + slot.used) * UI_VERTEX_SIZE];
+        for (unsigned v = 0; v < count; ++v, src += UI_VERTEX_SIZE, dest += UI_VERTEX_SIZE)
+        {
+            Vector3 position = transform * Vector3(src[0], src[1], src[2]);
+            dest[0] = position.x_;
+            dest[1] = position.y_;
+            dest[2] = position.z_;
+            dest[3] = src[3];
+            dest[4] = src[4];
+            dest[5] = src[5];
+        }
+        slot.used += count;
+    }
+
+    for (const Slot& slot : slots)
+    {
+        // empty quads after the used vertices
+        Buffer& buffer = buffers_[slot.buffer];
+        if (slot.used < slot.range.count)
+        {
+            memset(&buffer.vertex_data[(slot.range.start + slot.used) * UI_VERTEX_SIZE], 0,
+              (slot.range.count - slot.used) * UI_VERTEX_SIZE * sizeof(float));
+        }
+        buffer.dirty_ranges.Push(slot.range);
+    }
+
+    member.slots = slots;
+    member.shown = true;
+    widget->batcher_dirty_ = false;
+    changed_ = true;
+}
+
+void RichTextBatcher::Release(Member& member)
+{
+    for (const Slot& slot : member.slots)
+        Free(slot);
+    member.slots.Clear();
+    member.shown = false;
+    changed_ = true;
+}
+
+RichTextBatcher::Slot RichTextBatcher::Allocate(Material* material, unsigned count)
+{
+    // room to grow, so small changes of the text stay in place
+    unsigned capacity = RoundToQuads(count + count / 4);
+
+    Slot slot;
+    slot.used = 0;
+    for (unsigned i = 0; i < buffers_.Size(); ++i)
+    {
+        Buffer& buffer = buffers_[i];
+        if (!buffer.num_vertices)
+            buffer.material = material;
+        else if (buffer.material != material)
+            continue;
+        slot.buffer = i;
+
+        for (unsigned j = 0; j < buffer.free_ranges.Size(); ++j)
+        {
+            Range& free_range = buffer.free_ranges[j];
+            if (free_range.count < count)
+                continue;
+            slot.range.start = free_range.start;
+            slot.range.count = Min(free_range.count, capacity);
+            free_range.start += slot.range.count;
+            free_range.count -= slot.range.count;
+            if (!free_range.count)
+                buffer.free_ranges.Erase(j);
+            buffer.num_free -= slot.range.count;
+            return slot;
+        }
+
+        if (!buffer.num_vertices || buffer.num_vertices + capacity <= MAX_BUFFER_VERTICES)
+        {
+            slot.range.start = buffer.num_vertices;
+            slot.range.count = capacity;
+            buffer.num_vertices += capacity;
+            buffer.vertex_data.Resize(buffer.num_vertices * UI_VERTEX_SIZE);
+            return slot;
+        }
+    }
+
+    Buffer buffer;
+    buffer.material = material;
+    buffer.vertex_buffer = new VertexBuffer(context_);
+    buffer.geometry = new Geometry(context_);
+    buffer.num_vertices = capacity;
+    buffer.vertex_data.Resize(capacity * UI_VERTEX_SIZE);
+    buffer.num_free = 0;
+    buffers_.Push(buffer);
+
+    slot.buffer = buffers_.Size() - 1;
+    slot.range.start = 0;
+    slot.range.count = capacity;
+    return slot;
+}
+
+void RichTextBatcher::Free(const Slot& slot)
+{
+    Buffer& buffer = buffers_[slot.buffer];
+    memset(&buffer.vertex_data[slot.range.start * UI_VERTEX_SIZE], 0, slot.range.count * UI_VERTEX_SIZE * sizeof(float));
+    buffer.free_ranges.Push(slot.range);
+    buffer.num_free += slot.range.count;
+    buffer.dirty_ranges.Push(slot.range);
+}
+
+void RichTextBatcher::Compact(unsigned buffer_index)
+{
+    PODVector<Slot*> slots;
+    for (Member& member : members_)
+    {
+        for (Slot& slot : member.slots)
+        {
+            if (slot.buffer == buffer_index)
+                slots.Push(&slot);
+        }
+    }
+    Sort(slots.Begin(), slots.End(), [](const Slot* lhs, const Slot* rhs) { return lhs->range.start < rhs->range.start; });
+
+    // the ranges only move down
+    Buffer& buffer = buffers_[buffer_index];
+    unsigned end = 0;
+    for (Slot* slot : slots)
+    {
+        if (slot->range.start != end)
+        {
+            memmove(&buffer.vertex_data[end * UI_VERTEX_SIZE], &buffer.vertex_data[slot->range.start * UI_VERTEX_SIZE],
+              slot->range.count * UI_VERTEX_SIZE * sizeof(float));
+            slot->range.start = end;
+        }
+        end += slot->range.count;
+    }
+
+    buffer.num_vertices = end;
+    buffer.vertex_data.Resize(end * UI_VERTEX_SIZE);
+    buffer.free_ranges.Clear();
+    buffer.num_free = 0;
+    buffer.dirty_ranges.Clear();
+    if (end)
+        buffer.dirty_ranges.Push(Range{0, end});
+    changed_ = true;
+}
+
+void RichTextBatcher::UploadBuffers()
+{
+    for (Buffer& buffer : buffers_)
+    {
+        VertexBuffer* vertex_buffer = buffer.vertex_buffer;
+        bool upload_all = vertex_buffer->IsDataLost();
+        if (vertex_buffer->GetVertexCount() < buffer.num_vertices)
+        {
+            vertex_buffer->SetSize(NextPowerOfTwo(buffer.num_vertices), MASK_POSITION | MASK_COLOR | MASK_TEXCOORD1, true);
+            upload_all = true;
+        }
+
+        if (upload_all)
+        {
+            if (buffer.num_vertices)
+                vertex_buffer->SetDataRange(&buffer.vertex_data[0], 0, buffer.num_vertices);
+            vertex_buffer->ClearDataLost();
+        }
+        else
+        {
+            for (const Range& range : buffer.dirty_ranges)
+            {
+                // ranges released at the end of a compacted buffer are gone
+                if (range.start < buffer.num_vertices)
+                {
+                    vertex_buffer->SetDataRange(&buffer.vertex_data[range.start * UI_VERTEX_SIZE], range.start,
+                      Min(range.count, buffer.num_vertices - range.start));
+                }
+            }
+        }
+        buffer.dirty_ranges.Clear();
+    }
+
+    if (!changed_)
+        return;
+
+    // one draw per buffer, released ranges draw empty quads
+    unsigned max_vertices = 0;
+    for (const Buffer& buffer : buffers_)
+        max_vertices = Max(max_vertices, buffer.num_vertices);
+    SharedPtr<IndexBuffer> index_buffer = GetQuadIndexBuffer(context_, max_vertices / 4);
+
+    batches_.Clear();
+    for (Buffer& buffer : buffers_)
+    {
+        if (buffer.num_vertices == buffer.num_free)
+            continue;
+
+        buffer.geometry->SetVertexBuffer(0, buffer.vertex_buffer);
+        buffer.geometry->SetIndexBuffer(index_buffer);
+        buffer.geometry->SetDrawRange(TRIANGLE_LIST, 0, buffer.num_vertices / 4 * 6, 0, buffer.num_vertices);
+
+        SourceBatch batch;
+        batch.distance_ = distance_;
+        batch.geometry_ = buffer.geometry;
+        batch.material_ = buffer.material;
+        batch.worldTransform_ = &Matrix3x4::IDENTITY;
+        batches_.Push(batch);
+    }
+}
+
+void RichTextBatcher::RemoveAllWidgets()
+{
+    for (Member& member : members_)
+    {
+        if (RichWidget* widget = member.widget.Get())
+        {
+            widget->batcher_.Reset();
+            widget->SetFlags(WidgetFlags_GeometryDirty);
+        }
+    }
+    members_.Clear();
+    buffers_.Clear();
+    batches_.Clear();
+    bounds_.Clear();
+}
+
+} // namespace Urho3D
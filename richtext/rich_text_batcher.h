@@ -0,0 +1,126 @@
+#ifndef __RICH_TEXT_BATCHER_H__
+#define __RICH_TEXT_BATCHER_H__
+#pragma once
+
+#include "Urho3D/Graphics/Drawable.h"
+#include "Urho3D/Graphics/Geometry.h"
+#include "Urho3D/Graphics/Material.h"
+#include "Urho3D/Graphics/VertexBuffer.h"
+
+namespace Urho3D
+{
+
+class RichWidget;
+
+/// Draws the widgets of a scene that use it with a few draw calls. Their quads are copied to world space into large
+/// dynamic vertex buffers, one set per material, so widgets sharing a font texture are drawn together. A widget that
+/// changes only rewrites its own vertices. Add it to the scene node and call RichWidget::SetUseBatcher() on the
+/// widgets. Quads in a buffer are drawn in buffer order, not sorted by distance. The batcher is one drawable with one
+/// bounding box and one distance: the widgets are not frustum culled one by one, and their text is not depth sorted
+/// against other transparent geometry of the scene.
+class RichTextBatcher : public Drawable
+{
+    URHO3D_OBJECT(RichTextBatcher, Drawable)
+public:
+    /// Register object factory. Drawable must be registered first.
+    static void RegisterObject(Context* context);
+
+    /// Construct.
+    explicit RichTextBatcher(Context* context);
+    /// Destruct.
+    ~RichTextBatcher() override;
+
+    /// Add a widget, it is drawn from the next Flush().
+    void AddWidget(RichWidget* widget);
+    /// Remove a widget and its vertices.
+    void RemoveWidget(RichWidget* widget);
+    /// Copy the vertices of the changed widgets to the buffers. Called after the render update, so the vertices are
+    /// drawn in the same frame. New buffers and the new bounding box are culled from the next frame on.
+    void Flush();
+    /// Get number of widgets.
+    unsigned GetNumWidgets() const { return members_.Size(); }
+    /// Get number of vertex buffers, each is a draw call.
+    unsigned GetNumBuffers() const { return buffers_.Size(); }
+
+    /// Calculate distance and prepare batches for rendering.
+    void UpdateBatches(const FrameInfo& frame) override;
+
+protected:
+    /// Handle scene being assigned, the widgets of the scene using a batcher join.
+    void OnSceneSet(Scene* scene) override;
+    /// Recalculate the world-space bounding box.
+    void OnWorldBoundingBoxUpdate() override;
+
+private:
+    /// Vertices in a buffer, starting and ending on a quad.
+    struct Range
+    {
+        unsigned start;
+        unsigned count;
+    };
+
+    /// Vertices of a widget in a buffer.
+    struct Slot
+    {
+        unsigned buffer;
+        /// Reserved vertices, the ones after the used ones are empty quads.
+        Range range;
+        unsigned used;
+    };
+
+    /// A widget and where its vertices are.
+    struct Member
+    {
+        WeakPtr<RichWidget> widget;
+        PODVector<Slot> slots;
+        /// Were the widget vertices copied, i.e. is it batched and visible?
+        bool shown;
+        /// Was the widget batched at the last Flush()?
+        bool batched;
+    };
+
+    /// World-space vertices of a material.
+    struct Buffer
+    {
+        SharedPtr<Material> material;
+        SharedPtr<VertexBuffer> vertex_buffer;
+        SharedPtr<Geometry> geometry;
+        /// Vertices in the UI vertex format.
+        PODVector<float> vertex_data;
+        /// Vertices up to the last reserved one.
+        unsigned num_vertices;
+        /// Released ranges, filled with empty quads.
+        PODVector<Range> free_ranges;
+        unsigned num_free;
+        /// Ranges changed since the last upload.
+        PODVector<Range> dirty_ranges;
+    };
+
+    /// Handle post-render update event.
+    void HandlePostRenderUpdate(StringHash eventType, VariantMap& eventData);
+    /// Copy the vertices of a widget, reusing its ranges where they fit.
+    void Submit(Member& member);
+    /// Release all ranges of a member.
+    void Release(Member& member);
+    /// Reserve vertices in a buffer of a material, returns the slot.
+    Slot Allocate(Material* material, unsigned count);
+    /// Fill a range with empty quads and make it reusable.
+    void Free(const Slot& slot);
+    /// Move the reserved ranges of a buffer to its start, dropping the released ones.
+    void Compact(unsigned buffer_index);
+    /// Upload the changed vertices and update the draw batches.
+    void UploadBuffers();
+    /// Remove all widgets, they draw themselves again.
+    void RemoveAllWidgets();
+
+    Vector<Member> members_;
+    Vector<Buffer> buffers_;
+    /// World bounding box of the widgets.
+    BoundingBox bounds_;
+    /// Do the batches or the bounds need an update?
+    bool changed_;
+};
+
+} // namespace Urho3D
+
+#endif
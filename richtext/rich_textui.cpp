@@ -17,7 +17,7 @@
 #include "rich_batch_text.h"
 #include "rich_batch_image.h"
 #include "Urho3D/Core/StringUtils.h"
-#include "rich_html_parser.h"
+#include "rich_markup_cache.h"
 #include "rich_textui.h"
 #include <limits.h>
 
@@ -25,53 +25,6 @@
 namespace Urho3D
 {
 
-namespace
-{
-
-inline unsigned find_first_of(const String& str, const String& delimiters, unsigned offset = 0) {
-  if (offset >= str.Length())
-    return -1;
-
-  for (unsigned i = offset; i < str.Length(); i++) {
-    for (String::ConstIterator it = delimiters.Begin(); it != delimiters.End(); ++it)
-      if ((*it) == str.At(i))
-        return i;
-  }
-  return -1;
-}
-
-
-// Characters that split words
-static const char splitter_chars[] = " \t,.:;";
-
-// Old code kept for 1:1 compatibility
-template <typename T>
-inline void splitwords(const String& str, T& tokens, const String& delimiters = " ", bool trimEmpty = false) {
-  unsigned pos, lastPos = 0;
-  while(true) {
-    pos = find_first_of(str, delimiters, lastPos);
-    if(pos == String::NPOS) {
-      pos = str.Length();
-      if(pos != lastPos || !trimEmpty)
-        tokens.Push(typename T::ValueType(str.CString() + lastPos,
-          pos - lastPos));
-
-      break;
-    } else {
-      if(pos != lastPos) {
-        tokens.Push(typename T::ValueType(str.CString() + lastPos, pos - lastPos));
-      }
-      if (!trimEmpty)
-        tokens.Push(typename T::ValueType(str.CString() + pos, 1 ));
-    }
-
-    lastPos = pos + 1;
-  }
-}
-
-} // namespace
-
-
 extern const char* textEffects[];
 
 extern const char* ticker_types[];
@@ -104,7 +57,10 @@ RichTextUI::RichTextUI(Context* context) :
 	single_line_(false),
 	wrapping_(WRAP_WORD),
 	//ticker_position_(0.0f),
-	line_spacing_(0)
+	line_spacing_(0),
+	layout_content_size_(Vector2::ZERO),
+	quad_virtualization_(false),
+	view_offset_(0.0f)
 {
     // By default Text does not derive opacity from parent elements
     if(widget_.Get() == nullptr){
@@ -115,6 +71,7 @@ RichTextUI::RichTextUI(Context* context) :
     default_format_.color = Color::WHITE;
 	default_format_.align = HA_LEFT;
     SetFont("Fonts/Anonymous Pro.ttf", 32);
+    line_window_.SetMargin(256);
 
     //SubscribeToEvent(Urho3D::E_SCENEUPDATE, URHO3D_HANDLER(RichTextUI, UpdateTickerAnimation));
 }
@@ -148,6 +105,9 @@ void RichTextUI::RegisterObject(Context* context)
 	URHO3D_ACCESSOR_ATTRIBUTE("Single Line", GetSingleLine, SetSingleLine, bool, false, AM_DEFAULT);
 	URHO3D_ACCESSOR_ATTRIBUTE("Line Spacing", GetLineSpacing, SetLineSpacing, int, 0, AM_DEFAULT);
 	URHO3D_MIXED_ACCESSOR_ATTRIBUTE("Color", GetTextColor, SetTextColor, Color, Color::WHITE, AM_DEFAULT);
+	URHO3D_ACCESSOR_ATTRIBUTE("Quad Virtualization", GetQuadVirtualization, SetQuadVirtualization, bool, false, AM_DEFAULT);
+	URHO3D_ACCESSOR_ATTRIBUTE("Quad Margin", GetQuadMargin, SetQuadMargin, int, 256, AM_DEFAULT);
+	URHO3D_ACCESSOR_ATTRIBUTE("View Offset", GetViewOffset, SetViewOffset, float, 0.0f, AM_DEFAULT);
 
 /*
 	URHO3D_ENUM_ACCESSOR_ATTRIBUTE("Ticker Type", GetTickerType, SetTickerType, TickerType,
@@ -205,6 +165,13 @@ void RichTextUI::SetSingleLine(bool single_line)
     charLocationsDirty_ = true;
 }
 
+void RichTextUI::SetQuadVirtualization(bool enable)
+{
+    quad_virtualization_ = enable;
+    widget_->SetFlags(WidgetFlags_ContentChanged);
+    charLocationsDirty_ = true;
+}
+
 void RichTextUI::OnResize(const IntVector2& newSize, const IntVector2& delta)
 {
     if (wrapping_)
@@ -336,365 +303,86 @@ bool RichTextUI::FilterImplicitAttributes(XMLElement& dest) const
 
 void RichTextUI::GetBatches(PODVector<UIBatch>& batches, PODVector<float>& vertexData, const IntRect& currentScissor)
 {
-    if(charLocationsDirty_ || widget_->IsFlagged(WidgetFlags_GeometryDirty)){
+    if(charLocationsDirty_ || widget_->IsFlagged(WidgetFlags_ContentChanged)){
         UpdateText();
     }
 
     UIElement::GetBatches(batches, vertexData, currentScissor);
 
-  // clear all quads
-  widget_->Clear();
-
-  RichWidgetText* text_renderer;
-  RichWidgetImage* image_renderer;
-
-  const IntVector2& screenPos = GetScreenPosition();
-  int xoffset = 0, yoffset = 0;
-
-  for (auto lit = lines_.Begin(); lit != lines_.End(); ++lit) {
-    // adjust the size and offset of every block in a line
-    TextLine* l = &(*lit);
-
-    switch (l->align) {
-    default:
-    case HA_LEFT:
-      xoffset = l->offset_x;
-      break;
-    case HA_CENTER:
-      xoffset = (widget_->GetClipRegion().Width() - l->width) / 2;
-      break;
-    case HA_RIGHT:
-      xoffset = widget_->GetClipRegion().Width() - l->width;
-    }
-
-    FontState fontstate;
-
-    int line_max_height = 0;
-    for (auto it = l->blocks.Begin(); it != l->blocks.End(); ++it) {
-      if (it->type == TextBlock::BlockType_Image) {
-        image_renderer = widget_->CacheWidgetBatch<RichWidgetImage>(it->text);
-        //image_renderer->clearQuads();
-        if (image_renderer->GetImageSource() != it->text)
-          image_renderer->SetImageSource(it->text);
-
-        if (it->image_width == 0)
-          it->image_width = (float)widget_->GetClipRegion().Width();
-        if (it->image_height == 0) {
-          // height should be the line max height
-          it->image_height = (float)line_max_height;
-          // width should be auto calculated based on the texture size
-          float aspect = image_renderer->GetImageAspect();
-          it->image_width = it->image_height * aspect;
-        }
-
-        image_renderer->AddImage(Vector3((float)xoffset+screenPos.x_, (float)yoffset+screenPos.y_, 0.0f), it->image_width, it->image_height);
-        line_max_height = Max((int)it->image_height, line_max_height);
-        xoffset += (int)it->image_width;
-
-
-      } else if (it->type == TextBlock::BlockType_Text) {
-        fontstate = it->format.font;
-        if (fontstate.face.Empty())
-          fontstate.face = default_format_.font.face;
-        if (fontstate.size <= 0)
-          fontstate.size = default_format_.font.size;
-
-        String bi = String(it->format.font.bold ? "b" : "") + String(it->format.font.italic ? "i" : "");
-        if (!bi.Empty())
-          bi = String(".") + bi;
-        String id = fontstate.face + "." + ToString("%d", it->format.font.size) + bi;
-        id.AppendWithFormat("%s.%d%s", fontstate.face.CString(), fontstate.size, bi.CString());
-        text_renderer = widget_->CacheWidgetBatch<RichWidgetText>(id);
-        // TODO: turn this back on when we have more fonts
-        text_renderer->SetFont(fontstate.face, fontstate.size, fontstate.bold, fontstate.italic);
-        //text_renderer->SetFont(default_font_state_.face, default_font_state_.size);
-
-        text_renderer->AddText(it->text, Vector3((float)xoffset+screenPos.x_, (float)yoffset+screenPos.y_, 0.0f), it->format.color);
-        if (text_renderer->GetFontFace()) {
-          line_max_height = Max<int>((int)text_renderer->GetRowHeight(), line_max_height);
-          xoffset += (int)text_renderer->CalculateTextExtents(it->text).x_;
-        }
-      }
+  // the quads are kept until the text, a font or the size changes, or the view scrolls past the virtualized quads
+  const int view_top = (int)view_offset_;
+  const int view_bottom = view_top + GetSize().y_;
+  if (widget_->IsFlagged(WidgetFlags_GeometryDirty) || (quad_virtualization_ && !line_window_.Covers(view_top, view_bottom))) {
+    widget_->Clear();
+
+    RichWidgetLayout target(widget_, default_format_);
+    RichLayoutEngine layout(&target);
+    layout.SetLineSpacing(line_spacing_);
+
+    PODVector<RichLayoutRun> runs;
+    if (quad_virtualization_) {
+      line_window_.Place(layout, lines_, widget_->GetClipRegion().Width(), view_top, view_bottom, runs);
+      target.Draw(runs, line_window_.GetEndLine() - line_window_.GetFirstLine(), Vector3::ZERO);
+      // the height of the lines not measured yet is estimated
+      layout_content_size_ = Vector2(line_window_.GetMeasuredWidth(), line_window_.GetEstimatedHeight(lines_.Size()));
+    } else {
+      layout.Place(lines_, 0, widget_->GetClipRegion().Width(), 0, runs);
+      target.Draw(runs, lines_.Size(), Vector3::ZERO);
+      layout_content_size_ = lines_.Empty() ? Vector2::ZERO : layout.GetContentSize();
     }
-    yoffset += line_max_height + line_spacing_;
-    Vector2 newContentSize(Max<float>(widget_->GetContentSize().x_, xoffset+screenPos.x_), (float)yoffset+screenPos.y_);
-    widget_->SetContentSize(newContentSize);
   }
   //ResetTicker();
 
+  // a new screen position or view offset only moves the quads
+  const IntVector2& screenPos = GetScreenPosition();
+  const Vector2 origin((float)screenPos.x_, (float)screenPos.y_ - view_offset_);
+  widget_->SetDrawOrigin(Vector3(origin.x_, origin.y_, 0.0f));
+  if (!lines_.Empty())
+    widget_->SetContentSize(layout_content_size_ + origin);
+  widget_->ClearFlags(WidgetFlags_GeometryDirty);
+
     widget_->Draw(this, batches, vertexData, currentScissor);
 }
 
 void RichTextUI::UpdateText(bool onResize)
 {
   lines_.Clear();
+  line_window_.Reset();
   widget_->SetContentSize(Vector2::ZERO);
 
-  Vector<TextBlock> markup_blocks;
-  markup_blocks.Reserve(10);
-
-  HTMLParser::Parse(text_, markup_blocks, default_format_);
+  // a resize keeps the markup and its measured words, only the lines are filled again. Setters that change the
+  // default format, e.g. SetTextAlignment(), only flag the char locations dirty, the markup is parsed again then.
+  const bool refill = onResize && !single_line_ && !layout_words_.lines.Empty() &&
+    !widget_->IsFlagged(WidgetFlags_ContentChanged) && !charLocationsDirty_;
+  if (!refill) {
+    markup_.Update(text_, default_format_);
+    layout_words_.Clear();
+  }
 
-  IntVector2 maxSize(0, 0);
   bool determineSize = ((GetSize().x_ == 0 && GetSize().y_ == 0) || autoSize_) ? true : false;
 
-  TextLine line;
+  IntRect actual_clip_region(0, 0, GetSize().x_, GetSize().y_);//widget_->GetClipRegion();
   if (!single_line_) {
-    Vector<TextLine> markupLines;
-    // for every new line in a block, create a new TextLine
-    for (Vector<TextBlock>::ConstIterator it = markup_blocks.Begin(); it != markup_blocks.End(); ++it) {
-      size_t posNewLine = 0;
-      size_t posLast = 0;
-      if ((posNewLine = it->text.Find("\n", posLast)) != String::NPOS) {
-        while ((posNewLine = it->text.Find("\n", posLast)) != String::NPOS) {
-          TextBlock block;
-          block.text = it->text.Substring(posLast, posNewLine - posLast);
-          block.format = it->format;
-          line.blocks.Push(block);
-          markupLines.Push(line);
-          posLast = posNewLine + 1;
-          line.blocks.Clear();
-        }
-        if (posLast < it->text.Length() - 1) {
-          TextBlock block;
-          block.text = it->text.Substring(posLast, it->text.Length() - posLast);
-          block.format = it->format;
-          line.blocks.Push(block);
-        }
-      } else {
-        if (it->is_line_break) {
-          line.blocks.Push(*it);
-          markupLines.Push(line);
-          line.blocks.Clear();
-        }
-        line.blocks.Push(*it);
-        // update line alignment from this block if it is not left
-        if (it->format.align != HA_LEFT)
-          line.align = it->format.align;
-      }
-    }
-
-    // make sure there's at least one line with text
-    if (!line.blocks.Empty())
-      markupLines.Push(line);
-
-    IntRect actual_clip_region(0, 0, GetSize().x_, GetSize().y_);//widget_->GetClipRegion();
     if(determineSize == true){
         actual_clip_region = IntRect(0, 0, INT_MAX, INT_MAX);
     }else{
         widget_->SetClipRegion(actual_clip_region);
     }
-    //GetScreenPosition() GetPosition
-    // do the word wrapping and layout positioning
-    if (wrapping_ == WRAP_WORD && actual_clip_region.Width()) {
-      int layout_width = actual_clip_region.Width();
-      int layout_height = actual_clip_region.Height();
-      int layout_x = actual_clip_region.left_;
-      int layout_y = actual_clip_region.top_;
-
-      int draw_offset_x = layout_x;
-      int draw_offset_y = layout_y;
-
-      FontState fontstate;
-
-      for (Vector<TextLine>::Iterator it = markupLines.Begin(); it != markupLines.End(); ++it) {
-        TextLine* line = &*it;
-
-        TextLine new_line;
-        new_line.height = 0;
-        new_line.width = 0;
-        new_line.offset_x = layout_x;
-        new_line.offset_y = 0;
-        new_line.align = line->align;
-
-        int maxRowHeight = 0;
-
-        // reset the x offset of the current line
-        draw_offset_x = layout_x;
-
-        for (Vector<TextBlock>::Iterator bit = line->blocks.Begin(); bit != line->blocks.End(); ++bit) {
-          TextBlock new_block;
-          new_block.format = (*bit).format;
-
-          if (bit->type == TextBlock::BlockType_Text) {
-            size_t crpos;
-            while ((crpos = bit->text.Find("\r")) != String::NPOS)
-              bit->text.Erase(crpos, 1);
-
-            Vector<String> words;
-            splitwords(bit->text, words, splitter_chars, false);
-            if (words.Empty())
-              words.Push(bit->text);
-
-            bool new_line_space = false;
-
-            // bold-italic flags are passed as third asset name parameter
-            String bi = String(bit->format.font.bold ? "b" : "") + String(bit->format.font.italic ? "i" : "");
-            if (!bi.Empty())
-              bi = String(".") + bi;
-
-            // this block's text renderer
-            String id;
-            fontstate.face = bit->format.font.face;
-            fontstate.size = bit->format.font.size;
-            if (fontstate.face.Empty())
-              fontstate.face = default_format_.font.face;
-            if (fontstate.size <= 0)
-              fontstate.size = default_format_.font.size;
-            id.AppendWithFormat("%s.%d%s", fontstate.face.CString(), fontstate.size, bi.CString());
-            RichWidgetText* text_renderer = widget_->CacheWidgetBatch<RichWidgetText>(id);
-            text_renderer->SetFont(fontstate.face, fontstate.size);
-
-            // for every word in this block do a check if there's enough space on the current line
-            // Simple word wrap logic: if the space is enough, put the word on the current line, else go to the next line
-            String the_word;
-            for (Vector<String>::ConstIterator wit = words.Begin(); wit != words.End(); ++wit) {
-              the_word = *wit;
-              Vector2 wordsize = text_renderer->CalculateTextExtents(the_word);
-
-              new_line.height = Max<int>((int)wordsize.y_, new_line.height);
-              maxRowHeight = Max<int>(new_line.height, (int)text_renderer->GetRowHeight());
-
-              bool needs_new_line = (draw_offset_x + wordsize.x_) > layout_width;
-              bool is_wider_than_line = wordsize.x_ > layout_width;
-
-              // Handle cases where this word can't be fit in a line
-              while (is_wider_than_line && needs_new_line) {
-                String fit_word = the_word;
-                int width_remain = (int)wordsize.x_ - layout_width;
-                assert(width_remain >= 0);
-                // remove a char from this word until it can be fit in the current line
-                Vector2 newwordsize;
-                while (width_remain > 0 && !fit_word.Empty()) {
-                  fit_word.Erase(fit_word.Length() - 1);
-                  newwordsize = text_renderer->CalculateTextExtents(fit_word);
-                  width_remain = (int)newwordsize.x_ - layout_width;
-                }
-
-                // prevent endless loops
-                if (fit_word.Empty())
-                  break;
-
-                // append the fitting part of the word in the current line
-                // and create a new line
-                new_block.text.Append(fit_word);
-                new_line.blocks.Push(new_block);
-                draw_offset_x += (int)newwordsize.x_;
-                new_line.width = draw_offset_x;
-                new_line.offset_y = draw_offset_y;
-                lines_.Push(new_line);
-                // create a new empty line
-                new_line.blocks.Clear();
-                new_block.text.Clear();
-                draw_offset_x = layout_x;
-                draw_offset_y += new_line.height;
-
-                the_word = the_word.Substring(fit_word.Length());
-
-                wordsize = text_renderer->CalculateTextExtents(the_word);
-                draw_offset_x += (int)wordsize.x_;
-                is_wider_than_line = wordsize.x_ > layout_width;
-
-                if (!is_wider_than_line) {
-                  needs_new_line = false;
-                  // the leftovers from the_word will be added to the line below
-                  break;
-                }
-              }
-
-              // carry the whole word on a new line
-              if (needs_new_line) {
-                new_line.width = draw_offset_x;
-                new_line.offset_y = draw_offset_y;
-                new_line.blocks.Push(new_block);
-                lines_.Push(new_line);
-                // create next empty line
-                new_line.blocks.Clear();
-                // add current text to a block
-                new_block.text.Clear();
-                draw_offset_x = layout_x;
-                draw_offset_y += new_line.height;
-                if (the_word == " " || the_word == "\t") {
-                  // mark as space
-                  new_line_space = true;
-                  continue;
-                }
-              }
-
-              if (new_line_space) {
-                if (the_word != " " && the_word != "\t")
-                  new_line_space = false;
-                else
-                  continue;
-              }
-              new_block.text.Append(the_word);
-              draw_offset_x += (int)wordsize.x_;
-            }
-
-            new_line.blocks.Push(new_block);
-          } else {
-            // if the block is iconic (image, video, etc)
-            new_block = (*bit); // copy the block
-            if (new_block.is_visible) {
-              RichWidgetImage* image_renderer = widget_->CacheWidgetBatch<RichWidgetImage>(new_block.text);
-              image_renderer->SetImageSource(new_block.text);
-              if (new_block.image_height == 0) {
-                float aspect = image_renderer->GetImageAspect();
-                if (aspect == 0.f)
-                  aspect = 1.0f;
-
-                // fit by height
-                //new_block.image_height = clip_region_.height();
-                //new_block.image_width = new_block.image_height * aspect;
-
-                // fit by width
-                //new_block.image_width = (float)(new_block.image_width > 0 ? new_block.image_width : widget_->GetClipRegion().Width());
-                new_block.image_width = (float)(new_block.image_width > 0 ? new_block.image_width : actual_clip_region.Width());
-                new_block.image_height = new_block.image_width / aspect;
-              }
-
-              if (new_block.image_width == 0) {
-                //new_block.image_width = (float)widget_->GetClipRegion().Width();
-                new_block.image_width = (float)actual_clip_region.Width();
-              }
-              new_line.blocks.Push(new_block);
-
-              draw_offset_x += (int)new_block.image_width;
-              new_line.height = Max((int)new_block.image_height, new_line.height);
-            }
-          }
-
-          new_line.width = draw_offset_x;
-          new_line.offset_y = draw_offset_y;
-          draw_offset_y += new_line.height;
-        }
-
-        maxSize.x_ = Max(draw_offset_x, maxSize.x_);
-        maxSize.y_ = maxSize.y_ + Max(new_line.height, maxRowHeight);//Max(draw_offset_y, maxSize.y_);
-
-        lines_.Push(new_line);
-        new_line.blocks.Clear();
-      }
-    } else {
-      // in case there's no word wrapping or the layout has no width
-      lines_ = markupLines;
-    }
-
+  }
 
+  RichWidgetLayout target(widget_, default_format_);
+  RichLayoutEngine layout(&target);
+  layout.SetLayoutRect(actual_clip_region);
+  layout.SetWordWrap(wrapping_ == WRAP_WORD);
+  layout.SetSingleLine(single_line_);
+  if (single_line_) {
+    layout.Arrange(markup_.GetBlocks(), lines_);
   } else {
-    // Single line...
-    // replace /n/r with empty space
-    for (auto i = markup_blocks.Begin(); i != markup_blocks.End(); i++) {
-      size_t crpos;
-      while ((crpos = find_first_of(i->text, "\n\r")) != String::NPOS) {
-        i->text.Replace(crpos, 1, " ");
-      }
-      // TODO: single line doesn't get images when width or height = 0
-      line.blocks.Push(*i);
-    }
-    lines_.Push(line);
+    if (!refill)
+      layout.Segment(markup_.GetBlocks(), layout_words_);
+    layout.Fill(layout_words_, lines_);
   }
-
+  IntVector2 maxSize = layout.GetWrappedSize();
 
     if(determineSize){// && !IsFixedSize()){
         if(!maxSize.y_){
@@ -3,6 +3,7 @@
 #pragma once
 
 #include "rich_widget.h"
+#include "rich_markup_cache.h"
 
 #include "../UI/UIElement.h"
 
@@ -183,6 +184,19 @@ public:
     void SetSingleLine(bool single_line);
     /// Get single line.
     bool GetSingleLine() const { return single_line_; }
+    /// Set quad virtualization, only the lines around the view get quads. For long texts that are scrolled. The text is
+    /// still parsed and wrapped as a whole when it changes, the lines are measured on demand.
+    void SetQuadVirtualization(bool enable);
+    /// Get quad virtualization.
+    bool GetQuadVirtualization() const { return quad_virtualization_; }
+    /// Set the pixels above and below the view that get quads too with quad virtualization.
+    void SetQuadMargin(int margin) { line_window_.SetMargin(Max(margin, 0)); }
+    /// Get the pixels above and below the view that get quads with quad virtualization.
+    int GetQuadMargin() const { return line_window_.GetMargin(); }
+    /// Set the vertical scroll position of the view in pixels, 0 shows the first line at the top.
+    void SetViewOffset(float offset) { view_offset_ = Max(offset, 0.0f); }
+    /// Get the vertical scroll position of the view in pixels.
+    float GetViewOffset() const { return view_offset_; }
     /// Reset the ticker to the beginning.
     //void ResetTicker();
     /// Set ticker position (0-1 range).
@@ -198,7 +212,7 @@ public:
 protected:
     /// Filter implicit attributes in serialization process.
     bool FilterImplicitAttributes(XMLElement& dest) const override;
-    /// Update text when text, font or spacing changed.
+    /// Update text when text, font or spacing changed. On resize only the lines are wrapped again.
     void UpdateText(bool onResize = false);
     /// Update cached character locations after text update, or when text alignment or indent has changed.
     void UpdateCharLocations();
@@ -284,8 +298,14 @@ protected:
     //float ticker_speed_;
     /// Default font state for unformatted text.
     BlockFormat default_format_;
+    /// The parsed text.
+    RichMarkupDocument markup_;
     /// The lines of text.
     Vector<TextLine> lines_; // TODO: could be removed in the future.
+    /// The markup split into lines and words, kept to wrap again when only the size changes.
+    RichLayoutWords layout_words_;
+    /// Size of the placed lines, without the screen position.
+    Vector2 layout_content_size_;
     /// The scroll origin of the text (in ticker mode).
     Vector3 scroll_origin_;
     /// Is the text single line.
@@ -294,6 +314,12 @@ protected:
     //float ticker_position_;
     /// Wrapping
     TextWrapping wrapping_;
+    /// Quad virtualization flag.
+    bool quad_virtualization_;
+    /// Vertical scroll position of the view.
+    float view_offset_;
+    /// The lines with quads with quad virtualization.
+    RichLineWindow line_window_;
 
     /// Per-frame text animation.
     //void UpdateTickerAnimation(Urho3D::StringHash eventType, Urho3D::VariantMap& eventData);
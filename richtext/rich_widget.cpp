@@ -1,9 +1,13 @@
 #include "rich_widget.h"
 #include "rich_batch_text.h"
 #include "rich_batch_image.h"
+#include "rich_text_batcher.h"
 #include "Urho3D/Core/Context.h"
 #include "Urho3D/Scene/Node.h"
+#include "Urho3D/Scene/Scene.h"
 #include "Urho3D/Graphics/Camera.h"
+#include "Urho3D/Container/Sort.h"
+#include "Urho3D/Graphics/IndexBuffer.h"
 
 namespace Urho3D {
 
@@ -27,18 +31,82 @@ static const char* vertical_alignments[] =
 
 const float RichWidget::unitsPerPixel = 1.0f / 128;
 
+/// Index buffer of quads made of 4 vertices, shared by the widgets using it.
+static WeakPtr<IndexBuffer> quad_index_buffer;
+
+/// Return the shared quad index buffer, grown to hold at least num_quads quads.
+SharedPtr<IndexBuffer> GetQuadIndexBuffer(Context* context, unsigned num_quads)
+{
+    SharedPtr<IndexBuffer> buffer(quad_index_buffer);
+    if (!buffer)
+    {
+        buffer = new IndexBuffer(context);
+        buffer->SetShadowed(true);
+        quad_index_buffer = buffer;
+    }
+
+    if (buffer->GetIndexCount() >= num_quads * 6)
+        return buffer;
+
+    // grow in powers of two, the indices of the smaller sizes stay the same
+    unsigned capacity = NextPowerOfTwo(num_quads);
+    bool large_indices = capacity * 4 > 65536;
+    buffer->SetSize(capacity * 6, large_indices);
+    if (large_indices)
+    {
+        PODVector<unsigned> indices(capacity * 6);
+        for (unsigned i = 0; i < capacity; ++i)
+        {
+            unsigned* quad = &indices[i * 6];
+            quad[0] = i * 4; quad[1] = i * 4 + 1; quad[2] = i * 4 + 2;
+            quad[3] = i * 4 + 1; quad[4] = i * 4 + 3; quad[5] = i * 4 + 2;
+        }
+        buffer->SetData(&indices[0]);
+    }
+    else
+    {
+        PODVector<unsigned short> indices(capacity * 6);
+        for (unsigned i = 0; i < capacity; ++i)
+        {
+            unsigned short* quad = &indices[i * 6];
+            quad[0] = (unsigned short)(i * 4); quad[1] = (unsigned short)(i * 4 + 1); quad[2] = (unsigned short)(i * 4 + 2);
+            quad[3] = (unsigned short)(i * 4 + 1); quad[4] = (unsigned short)(i * 4 + 3); quad[5] = (unsigned short)(i * 4 + 2);
+        }
+        buffer->SetData(&indices[0]);
+    }
+    return buffer;
+}
+
+/// Floats per vertex in the compact format: position x, y, packed color, UV.
+static const unsigned COMPACT_VERTEX_SIZE = 5;
+
+/// Return the vertex elements of the compact format.
+static const PODVector<VertexElement>& GetCompactVertexElements()
+{
+    static PODVector<VertexElement> elements;
+    if (elements.Empty())
+    {
+        elements.Push(VertexElement(TYPE_VECTOR2, SEM_POSITION));
+        elements.Push(VertexElement(TYPE_UBYTE4_NORM, SEM_COLOR));
+        elements.Push(VertexElement(TYPE_VECTOR2, SEM_TEXCOORD));
+    }
+    return elements;
+}
+
 /// Register object factory. Drawable must be registered first.
 void RichWidget::RegisterObject(Context* context)
 {
     context->RegisterFactory<RichWidget>();
     RichWidgetImage::RegisterObject(context);
     RichWidgetText::RegisterObject(context);
+    RichTextBatcher::RegisterObject(context);
 
     URHO3D_ACCESSOR_ATTRIBUTE("Auto Clip", GetClipToContent, SetClipToContent, bool, true, AM_DEFAULT);
     URHO3D_MIXED_ACCESSOR_ATTRIBUTE("Clip Region", GetClipRegion, SetClipRegion, IntRect, IntRect::ZERO, AM_DEFAULT);
     URHO3D_MIXED_ACCESSOR_ATTRIBUTE("Padding", GetPadding, SetPadding, IntRect, IntRect::ZERO, AM_DEFAULT);
     URHO3D_MIXED_ACCESSOR_ATTRIBUTE("Internal Scale", GetInternalScale, SetInternalScale, Vector2, Vector2::ONE, AM_DEFAULT);
     URHO3D_MIXED_ACCESSOR_ATTRIBUTE("Draw Origin", GetDrawOrigin, SetDrawOrigin, Vector3, Vector2::ZERO, AM_DEFAULT);
+    URHO3D_ACCESSOR_ATTRIBUTE("Compact Vertices", GetCompactVertices, SetCompactVertices, bool, false, AM_DEFAULT);
     URHO3D_ENUM_ACCESSOR_ATTRIBUTE("Node Align H", GetHorizontalAlignment, SetHorizontalAlignment, HorizontalAlignment,
       horizontal_alignments, HA_LEFT, AM_DEFAULT);
     URHO3D_ENUM_ACCESSOR_ATTRIBUTE("Node Align V", GetVerticalAlignment, SetVerticalAlignment, VerticalAlignment,
@@ -48,6 +116,7 @@ void RichWidget::RegisterObject(Context* context)
     URHO3D_ATTRIBUTE("Min Angle", float, minAngle_, 0.0f, AM_DEFAULT);
     URHO3D_ACCESSOR_ATTRIBUTE("Draw Distance", GetDrawDistance, SetDrawDistance, float, 0.0f, AM_DEFAULT);
     URHO3D_MIXED_ACCESSOR_ATTRIBUTE("Opacity", GetAlpha, SetAlpha, float, 1.0f, AM_DEFAULT);
+    URHO3D_ACCESSOR_ATTRIBUTE("Use Batcher", GetUseBatcher, SetUseBatcher, bool, false, AM_DEFAULT);
 }
 
 RichWidget::RichWidget(Context* context)
@@ -70,12 +139,22 @@ RichWidget::RichWidget(Context* context)
  , faceCameraMode_(FC_NONE)
  , minAngle_(0.0f)
  , fixedScreenSize_(false)
+ , num_marked_lines_(0)
+ , scroll_by_transform_(false)
+ , scroll_offset_(Vector2::ZERO)
+ , scroll_built_offset_(Vector2::ZERO)
+ , scrollWorldTransform_(Matrix3x4::IDENTITY)
+ , compact_vertices_(false)
+ , use_batcher_(false)
+ , batcher_dirty_(false)
 {
 
 }
 
 RichWidget::~RichWidget()
 {
+    if (RichTextBatcher* batcher = batcher_.Get())
+        batcher->RemoveWidget(this);
     RemoveWidgetBatches();
 }
 
@@ -119,6 +198,48 @@ void RichWidget::SetDrawOrigin(const Vector3& point)
         SetFlags(WidgetFlags_GeometryDirty);
 }
 
+void RichWidget::SetScrollByTransform(bool enable)
+{
+    if (scroll_by_transform_ == enable)
+        return;
+    scroll_by_transform_ = enable;
+    // the geometry is clipped with a margin when scrolling by transform
+    SetFlags(WidgetFlags_GeometryDirty);
+    if (node_)
+        OnMarkedDirty(node_);
+}
+
+void RichWidget::SetScrollOffset(const Vector2& offset)
+{
+    if (scroll_offset_ == offset)
+        return;
+    scroll_offset_ = offset;
+    if (!scroll_by_transform_)
+        return;
+
+    // the geometry is clipped with one window of margin around the clip region, it is rebuilt once the content
+    // scrolls past it. Until then only the bounding box moves.
+    Rect cliprect = GetActualDrawArea(true);
+    Vector2 moved = (scroll_offset_ - scroll_built_offset_) * internal_scale_;
+    if (!cliprect.Equals(Rect::ZERO) && (Abs(moved.x_) > cliprect.Size().x_ || Abs(moved.y_) > cliprect.Size().y_))
+        SetFlags(WidgetFlags_GeometryDirty);
+    else if (node_)
+        OnMarkedDirty(node_);
+}
+
+Vector2 RichWidget::GetScrollBuiltOffset() const
+{
+    return scroll_by_transform_ ? scroll_built_offset_ : Vector2::ZERO;
+}
+
+Vector3 RichWidget::GetScrollTranslation() const
+{
+    if (!scroll_by_transform_)
+        return Vector3::ZERO;
+    Vector2 moved = scroll_offset_ - scroll_built_offset_;
+    return Vector3(moved.x_ * internal_scale_.x_ * unitsPerPixel, -moved.y_ * internal_scale_.y_ * unitsPerPixel, 0.0f);
+}
+
 void RichWidget::Clear()
 {
     for (auto& item : items_)
@@ -126,17 +247,18 @@ void RichWidget::Clear()
         item->ClearQuads();
         item->use_count_ = 0;
     }
+    num_marked_lines_ = 0;
     boundingBox_.Define(0.0f, 0.0f);
 }
 
 RichWidgetBatch* RichWidget::CacheWidgetBatchT(StringHash type, StringHash id) {
     // if a WidgetBatch with such name and type exists, return it
-    for (auto& item : items_)
+    const unsigned long long key = ((unsigned long long)type.Value() << 32) | id.Value();
+    HashMap<unsigned long long, RichWidgetBatch*>::Iterator it = item_index_.Find(key);
+    if (it != item_index_.End())
     {
-        if (item->id_ == id && type == item->GetType()) {
-            item->use_count_ ++;
-            return item;
-        }
+        it->second_->use_count_++;
+        return it->second_;
     }
 
     // Create a new batch of the specified type
@@ -147,15 +269,36 @@ RichWidgetBatch* RichWidget::CacheWidgetBatchT(StringHash type, StringHash id) {
     {
         new_batch->SetParentWidget(this);
         new_batch->use_count_++;
+        // the new batch has no quads in the lines marked so far
+        if (num_marked_lines_)
+            new_batch->MarkLineStart(num_marked_lines_ - 1);
         items_.Push(new_batch);
         new_batch->id_ = id;
+        item_index_[key] = new_batch;
     }
     return new_batch;
 }
 
+void RichWidget::MarkLineStart()
+{
+    for (auto& item : items_)
+        item->MarkLineStart(num_marked_lines_);
+    ++num_marked_lines_;
+}
+
+void RichWidget::RemoveLeadingLines(unsigned count, float offset_y)
+{
+    count = Min(count, num_marked_lines_);
+    for (auto& item : items_)
+        item->RemoveLeadingLines(count, offset_y);
+    num_marked_lines_ -= count;
+    SetFlags(WidgetFlags_GeometryDirty);
+}
+
 void RichWidget::RemoveWidgetBatches()
 {
     items_.Clear();
+    item_index_.Clear();
 }
 
 void RichWidget::RemoveUnusedWidgetBatches()
@@ -164,6 +307,7 @@ void RichWidget::RemoveUnusedWidgetBatches()
     {
         if ((*it)->use_count_ == 0 && (*it)->IsEmpty())
         {
+            item_index_.Erase(((unsigned long long)(*it)->GetType().Value() << 32) | (*it)->id_.Value());
             it->Reset();
             it = items_.Erase(it);
         }
@@ -250,6 +394,14 @@ void RichWidget::SetShadowColor(const Color& color)
         SetFlags(WidgetFlags_GeometryDirty);
 }
 
+void RichWidget::SetCompactVertices(bool enable)
+{
+    bool modified = compact_vertices_ != enable;
+    compact_vertices_ = enable;
+    if (modified)
+        SetFlags(WidgetFlags_GeometryDirty);
+}
+
 void RichWidget::SetShadowEnabled(bool shadow_enabled)
 {
     bool modified = shadow_enabled_ != shadow_enabled;
@@ -294,6 +446,46 @@ void RichWidget::SetFaceCameraMode(FaceCameraMode mode)
     }
 }
 
+void RichWidget::SetUseBatcher(bool enable)
+{
+    if (use_batcher_ == enable)
+        return;
+    use_batcher_ = enable;
+    UpdateBatcher(GetScene());
+}
+
+bool RichWidget::IsBatched() const
+{
+    return batcher_.Get() && faceCameraMode_ == FC_NONE && !fixedScreenSize_;
+}
+
+void RichWidget::UpdateBatcher(Scene* scene)
+{
+    RichTextBatcher* batcher = use_batcher_ && scene ? scene->GetComponent<RichTextBatcher>() : nullptr;
+    if (batcher == batcher_.Get())
+        return;
+
+    if (batcher_)
+        batcher_->RemoveWidget(this);
+    batcher_ = batcher;
+    if (batcher)
+        batcher->AddWidget(this);
+    SetFlags(WidgetFlags_GeometryDirty);
+}
+
+void RichWidget::OnSceneSet(Scene* scene)
+{
+    Drawable::OnSceneSet(scene);
+    UpdateBatcher(scene);
+}
+
+void RichWidget::OnMarkedDirty(Node* node)
+{
+    Drawable::OnMarkedDirty(node);
+    // the batcher copies the vertices in world space
+    batcher_dirty_ = true;
+}
+
 void RichWidget::SetFlags(unsigned flags)
 {
     flags_ |= flags;
@@ -346,10 +538,17 @@ void RichWidget::UpdateBatches(const FrameInfo& frame)
     if (faceCameraMode_ != FC_NONE || fixedScreenSize_)
         CalculateFixedScreenSize(frame);
 
+    const Matrix3x4* worldTransform = (faceCameraMode_ != FC_NONE || fixedScreenSize_) ? &customWorldTransform_ : &node_->GetWorldTransform();
+    if (scroll_by_transform_ && scroll_offset_ != scroll_built_offset_)
+    {
+        scrollWorldTransform_ = *worldTransform * Matrix3x4(GetScrollTranslation(), Quaternion::IDENTITY, 1.0f);
+        worldTransform = &scrollWorldTransform_;
+    }
+
     for (unsigned i = 0; i < batches_.Size(); ++i)
     {
         batches_[i].distance_ = distance_;
-        batches_[i].worldTransform_ = (faceCameraMode_ != FC_NONE || fixedScreenSize_) ? &customWorldTransform_ : &node_->GetWorldTransform();
+        batches_[i].worldTransform_ = worldTransform;
     }
 }
 
@@ -364,23 +563,15 @@ void RichWidget::UpdateTextBatches(UIElement* uiElement, PODVector<UIBatch>* bat
         useVertexData.Clear();
     }
     batch_index_to_item_index_.Clear();
+    // the geometry is built at the current scroll offset, the transform moves it from there
+    scroll_built_offset_ = scroll_offset_;
 
-    int batch_index = 0;
-    for (unsigned i = 0; i < items_.Size(); ++i)
-    {
-        // Update the UIBatch list with every RichBatch data
-        items_[i]->GetBatches(useBatches, useVertexData, useScissor);
-
-        // Map item index to UI batch index
-        for (int c = 0; c < items_[i]->num_batches_; ++c)
-          batch_index_to_item_index_.Push(i);
-    }
+    Vector3 offset(Vector3::ZERO);
+    Vector2 align_size = content_size_;
 
     if(uiElement == NULL){
-        Vector3 offset(Vector3::ZERO);
         offset.z_ = GetDrawOrigin().z_;
 
-        Vector2 align_size = content_size_;
         if (!clip_to_content_ && clip_region_ != IntRect::ZERO)
           align_size = Vector2((float)clip_region_.Width(), (float)clip_region_.Height());
 
@@ -417,32 +608,30 @@ void RichWidget::UpdateTextBatches(UIElement* uiElement, PODVector<UIBatch>* bat
         default:
             break;
         }
+    }
+
+    int batch_index = 0;
+    for (unsigned i = 0; i < items_.Size(); ++i)
+    {
+        // Update the UIBatch list with every RichBatch data, the 3D geometry is indexed and
+        // the alignment, scale and alpha are applied while the quads are emitted
+        items_[i]->indexed_quads_ = uiElement == NULL;
+        items_[i]->transform_quads_ = uiElement == NULL;
+        items_[i]->quad_offset_ = offset;
+        items_[i]->quad_alpha_ = alpha_;
+        items_[i]->GetBatches(useBatches, useVertexData, useScissor);
 
+        // Map item index to UI batch index
+        for (int c = 0; c < items_[i]->num_batches_; ++c)
+          batch_index_to_item_index_.Push(i);
+    }
+
+    if(uiElement == NULL){
     //boundingBox_.Clear();
         boundingBox_.Define(Vector3(offset.x_, offset.y_) * unitsPerPixel, Vector3(align_size + Vector2(offset.x_, offset.y_)) * unitsPerPixel);
         boundingBox_.min_.y_ = -boundingBox_.min_.y_;
         boundingBox_.max_.y_ = -boundingBox_.max_.y_;
 
-        if (useVertexData.Size())
-        {
-            Color color;
-            for (unsigned i = 0; i < useVertexData.Size(); i += UI_VERTEX_SIZE)
-            {
-                Vector3& position = *(reinterpret_cast<Vector3*>(&useVertexData[i]));
-                position += offset;
-                position *= unitsPerPixel;
-                position.y_ = -position.y_;
-                // FIXME: may be slow converting back and forth between color <> uint
-                unsigned& color_uint = *(reinterpret_cast<unsigned*>(&useVertexData[i + 3]));
-                color.FromUInt(color_uint);
-                color.a_ = color.a_ * alpha_;
-                color_uint = color.ToUInt();
-            }
-
-        } else {
-          //boundingBox_.Define(Vector3::ZERO, Vector3::ZERO);
-        }
-
         if (!clip_to_content_ && clip_region_ != IntRect::ZERO)
         {
           boundingBox_.Define(
@@ -455,6 +644,14 @@ void RichWidget::UpdateTextBatches(UIElement* uiElement, PODVector<UIBatch>* bat
 
 void RichWidget::UpdateTextMaterials()
 {
+    if (IsBatched())
+    {
+        // the batcher draws the vertices
+        batches_.Clear();
+        batcher_dirty_ = true;
+        return;
+    }
+
     batches_.Resize(ui_batches_.Size());
     geometries_.Resize(ui_batches_.Size());
 
@@ -469,16 +666,8 @@ void RichWidget::UpdateTextMaterials()
           batch.geometry_ = geometries_[i] = geometry;
         }
 
-        batch.material_ = items_[batch_index_to_item_index_[i]]->material_;
-
-        Texture* texture = ui_batches_[i].texture_;
-        if (batch.material_ && texture) {
-            batch.material_->SetTexture(TU_DIFFUSE, texture);
-            batch.material_->SetRenderOrder(zbias_);
-#if defined(TARGET_LINUX)
-            batch.material_->SetDepthBias(Urho3D::BiasParameters(-0.0000023f - zbias_ * 0.0000023f, -0.0000023f - zbias_ * 0.0000023f));
-#endif
-        }
+        // shared materials come with the texture and bias set, widgets drawing the same font batch together
+        batch.material_ = items_[batch_index_to_item_index_[i]]->GetMaterial(ui_batches_[i].texture_, zbias_);
     }
 }
 
@@ -554,29 +743,80 @@ void RichWidget::UpdateGeometry(const FrameInfo& frame)
 
     if (IsFlagged(WidgetFlags_GeometryDirty))
     {
+        if (ui_vertex_data_.Size())
+        {
+            unsigned vertexCount = ui_vertex_data_.Size() / UI_VERTEX_SIZE;
+            if (compact_vertices_)
+            {
+                compact_vertex_data_.Resize(vertexCount * COMPACT_VERTEX_SIZE);
+                for (unsigned i = 0; i < ui_batches_.Size(); ++i)
+                    CompactBatchVertices(ui_batches_[i].vertexStart_ / UI_VERTEX_SIZE, ui_batches_[i].vertexEnd_ / UI_VERTEX_SIZE);
+                if (vertex_buffer_->GetVertexCount() != vertexCount || vertex_buffer_->GetVertexSize() != COMPACT_VERTEX_SIZE * sizeof(float))
+                    vertex_buffer_->SetSize(vertexCount, GetCompactVertexElements());
+                vertex_buffer_->SetData(&compact_vertex_data_[0]);
+            }
+            else
+            {
+                compact_vertex_data_.Clear();
+                if (vertex_buffer_->GetVertexCount() != vertexCount || vertex_buffer_->GetVertexSize() != UI_VERTEX_SIZE * sizeof(float))
+                    vertex_buffer_->SetSize(vertexCount, MASK_POSITION | MASK_COLOR | MASK_TEXCOORD1);
+                vertex_buffer_->SetData(&ui_vertex_data_[0]);
+            }
+            index_buffer_ = GetQuadIndexBuffer(context_, vertexCount / 4);
+        }
+
+        // every quad is 4 vertices and 6 indices
         for (unsigned i = 0; i < batches_.Size() && i < ui_batches_.Size(); ++i)
         {
             Geometry* geometry = geometries_[i];
             batches_[i].geometry_ = geometry;
-            geometry->SetDrawRange(TRIANGLE_LIST, 0, 0, ui_batches_[i].vertexStart_ / UI_VERTEX_SIZE,
-              (ui_batches_[i].vertexEnd_ - ui_batches_[i].vertexStart_) / UI_VERTEX_SIZE);
+            geometry->SetIndexBuffer(index_buffer_);
+            unsigned vertexStart = ui_batches_[i].vertexStart_ / UI_VERTEX_SIZE;
+            unsigned vertexCount = (ui_batches_[i].vertexEnd_ - ui_batches_[i].vertexStart_) / UI_VERTEX_SIZE;
+            geometry->SetDrawRange(TRIANGLE_LIST, vertexStart / 4 * 6, vertexCount / 4 * 6, vertexStart, vertexCount);
         }
 
-        if (ui_vertex_data_.Size())
+        ClearFlags(WidgetFlags_GeometryDirty);
+    }
+}
+
+void RichWidget::CompactBatchVertices(unsigned vertexStart, unsigned vertexEnd)
+{
+    // without the depth only the draw order keeps the shadow quads, which are 0.01 further back, behind the glyphs.
+    // The quads are drawn back to front by their dropped depth, quads of the same depth keep their order.
+    const float* src = &ui_vertex_data_[0];
+    unsigned numQuads = (vertexEnd - vertexStart) / 4;
+    compact_quad_order_.Resize(numQuads);
+    for (unsigned i = 0; i < numQuads; ++i)
+        compact_quad_order_[i] = vertexStart + i * 4;
+    Sort(compact_quad_order_.Begin(), compact_quad_order_.End(), [src](unsigned lhs, unsigned rhs)
+    {
+        float lhsDepth = src[lhs * UI_VERTEX_SIZE + 2];
+        float rhsDepth = src[rhs * UI_VERTEX_SIZE + 2];
+        return lhsDepth > rhsDepth || (lhsDepth == rhsDepth && lhs < rhs);
+    });
+
+    float* dest = &compact_vertex_data_[vertexStart * COMPACT_VERTEX_SIZE];
+    for (unsigned i = 0; i < numQuads; ++i)
+    {
+        const float* quad = src + compact_quad_order_[i] * UI_VERTEX_SIZE;
+        for (unsigned j = 0; j < 4; ++j, quad += UI_VERTEX_SIZE, dest += COMPACT_VERTEX_SIZE)
         {
-            unsigned vertexCount = ui_vertex_data_.Size() / UI_VERTEX_SIZE;
-            if (vertex_buffer_->GetVertexCount() != vertexCount)
-                vertex_buffer_->SetSize(vertexCount, MASK_POSITION | MASK_COLOR | MASK_TEXCOORD1);
-            vertex_buffer_->SetData(&ui_vertex_data_[0]);
+            dest[0] = quad[0];
+            dest[1] = quad[1];
+            dest[2] = quad[3];
+            dest[3] = quad[4];
+            dest[4] = quad[5];
         }
-
-        ClearFlags(WidgetFlags_GeometryDirty);
     }
 }
 
 /// Return whether a geometry update is necessary, and if it can happen in a worker thread.
 UpdateGeometryType RichWidget::GetUpdateGeometryType()
 {
+    // the batcher copies the vertices, the widget buffer is not used
+    if (IsBatched())
+      return UPDATE_NONE;
     if (faceCameraMode_ != FC_NONE || fixedScreenSize_)
       return UPDATE_MAIN_THREAD;
     return IsFlagged(WidgetFlags_GeometryDirty) ? UPDATE_MAIN_THREAD : UPDATE_NONE;
@@ -587,15 +827,20 @@ void RichWidget::OnWorldBoundingBoxUpdate()
 {
     if (IsFlagged(WidgetFlags_GeometryDirty))
         Draw();
+    // Content scrolled by transform moves with the scroll offset
+    BoundingBox box = boundingBox_;
+    Vector3 scroll_translation = GetScrollTranslation();
+    box.min_ += scroll_translation;
+    box.max_ += scroll_translation;
     // In face camera mode, use the last camera rotation to build the world bounding box
     if (faceCameraMode_ != FC_NONE || fixedScreenSize_)
     {
-        worldBoundingBox_ = boundingBox_.Transformed(Matrix3x4(node_->GetWorldPosition(),
+        worldBoundingBox_ = box.Transformed(Matrix3x4(node_->GetWorldPosition(),
             customWorldTransform_.Rotation(), customWorldTransform_.Scale()));
     }
     else {
 #if !defined(__arm__)
-      worldBoundingBox_ = boundingBox_.Transformed(node_->GetWorldTransform());
+      worldBoundingBox_ = box.Transformed(node_->GetWorldTransform());
 #else
       worldBoundingBox_.Define(-M_LARGE_VALUE, M_LARGE_VALUE);
 #endif
@@ -627,4 +872,84 @@ void RichWidget::CalculateFixedScreenSize(const FrameInfo& frame)
     worldBoundingBoxDirty_ = true;
 }
 
+RichWidgetLayout::RichWidgetLayout(RichWidget* widget, const BlockFormat& default_format)
+ : widget_(widget)
+ , default_format_(default_format)
+ , font_key_(0)
+ , text_batch_(nullptr)
+{
+}
+
+void RichWidgetLayout::SetFormat(const BlockFormat& format)
+{
+    const FontState& font = format.font;
+    const String& face = font.face.Empty() ? default_format_.font.face : font.face;
+    const unsigned size = font.size ? font.size : default_format_.font.size;
+
+    // formats differing only in their color or decorations use the same font
+    const unsigned font_key = RichWidgetText::MakeFontKey(face, size, font.bold, font.italic);
+    if (text_batch_ && font_key == font_key_)
+        return;
+    font_key_ = font_key;
+
+    text_batch_ = widget_->CacheWidgetBatch<RichWidgetText>(StringHash(font_key));
+    text_batch_->SetFont(face, size, font.bold, font.italic);
+}
+
+Vector2 RichWidgetLayout::MeasureText(const String& text)
+{
+    return text_batch_ ? text_batch_->CalculateTextExtents(text) : Vector2::ZERO;
+}
+
+Vector2 RichWidgetLayout::MeasureChars(const PODVector<unsigned>& chars)
+{
+    return text_batch_ ? text_batch_->CalculateTextExtents(chars) : Vector2::ZERO;
+}
+
+void RichWidgetLayout::MeasurePrefixes(const String& text, PODVector<unsigned>& char_ends, PODVector<float>& widths)
+{
+    if (text_batch_)
+        text_batch_->CalculatePrefixWidths(text, char_ends, widths);
+}
+
+float RichWidgetLayout::GetRowHeight()
+{
+    return text_batch_ ? text_batch_->GetRowHeight() : 0.0f;
+}
+
+float RichWidgetLayout::GetImageAspect(const String& source)
+{
+    RichWidgetImage* image_batch = widget_->CacheWidgetBatch<RichWidgetImage>(source);
+    if (image_batch->GetImageSource() != source)
+        image_batch->SetImageSource(source);
+    return image_batch->GetImageAspect();
+}
+
+void RichWidgetLayout::Draw(const PODVector<RichLayoutRun>& runs, unsigned num_lines, const Vector3& origin)
+{
+    unsigned run_index = 0;
+    for (unsigned line = 0; line < num_lines; ++line)
+    {
+        widget_->MarkLineStart();
+        for (; run_index < runs.Size() && runs[run_index].line == line; ++run_index)
+        {
+            const RichLayoutRun& run = runs[run_index];
+            const TextBlock& block = *run.block;
+            Vector3 position(origin.x_ + (float)run.position.x_, origin.y_ + (float)run.position.y_, origin.z_);
+            if (block.type == TextBlock::BlockType_Image)
+            {
+                RichWidgetImage* image_batch = widget_->CacheWidgetBatch<RichWidgetImage>(block.text);
+                if (image_batch->GetImageSource() != block.text)
+                    image_batch->SetImageSource(block.text);
+                image_batch->AddImage(position, run.size.x_, run.size.y_);
+            }
+            else
+            {
+                SetFormat(block.style.GetShared());
+                text_batch_->AddText(block.chars, position, block.style.color);
+            }
+        }
+    }
+}
+
 } // namespace Urho3D
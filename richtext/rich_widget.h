@@ -3,6 +3,7 @@
 #pragma once
 
 #include "rich_batch.h"
+#include "rich_layout.h"
 #include "Urho3D/Container/Ptr.h"
 #include "Urho3D/Math/Rect.h"
 #include "Urho3D/Graphics/VertexBuffer.h"
@@ -45,6 +46,18 @@ struct FontState
     unsigned size{};
     bool bold{};
     bool italic{};
+
+    bool operator ==(const FontState& rhs) const { return size == rhs.size && bold == rhs.bold && italic == rhs.italic && face == rhs.face; }
+    bool operator !=(const FontState& rhs) const { return !(*this == rhs); }
+
+    /// Return a 32-bit key of a font, RichWidgetText uses it as the id of its text batch.
+    static unsigned MakeKey(const String& face, unsigned size, bool bold, bool italic)
+    {
+        unsigned key = face.ToHash();
+        key = key * 31 + size;
+        key = key * 31 + ((unsigned)bold | (unsigned)italic << 1);
+        return key;
+    }
 };
 
 struct BlockFormat
@@ -59,6 +72,106 @@ struct BlockFormat
   bool striked{};
   bool superscript{};
   bool subscript{};
+
+  bool operator ==(const BlockFormat& rhs) const
+  {
+      return font == rhs.font && align == rhs.align && color == rhs.color && underlined == rhs.underlined &&
+        striked == rhs.striked && superscript == rhs.superscript && subscript == rhs.subscript;
+  }
+  bool operator !=(const BlockFormat& rhs) const { return !(*this == rhs); }
+  /// Return hash value for HashSet & HashMap.
+  unsigned ToHash() const
+  {
+      unsigned hash = font.face.ToHash();
+      hash = hash * 31 + font.size;
+      hash = hash * 31 + color.ToUInt();
+      hash = hash * 31 + align;
+      hash = hash * 31 + ((unsigned)font.bold | (unsigned)font.italic << 1 | (unsigned)underlined << 2 |
+        (unsigned)striked << 3 | (unsigned)superscript << 4 | (unsigned)subscript << 5);
+      return hash;
+  }
+};
+
+/// ID of a format in the RichStyleTable, 0 is the default BlockFormat.
+typedef unsigned short StyleId;
+
+struct BlockStyle;
+
+/// A process-wide table of the block formats in use, blocks store a StyleId and their color instead of a full
+/// BlockFormat. The color is not part of the interned format, so colored and animated text doesn't use up IDs.
+/// Formats are counted by the styles referring to them, their IDs are reused once no block uses them.
+class RichStyleTable
+{
+public:
+    /// Maximum number of formats.
+    static const unsigned MAX_STYLES = 65536;
+
+    /// Return the style of a format: its ID and color, or a copy of the format if the table is full. Thread-safe.
+    static BlockStyle MakeStyle(const BlockFormat& format);
+    /// Return the format of an ID, its color is white. Valid while a style refers to the ID. Thread-safe.
+    static const BlockFormat& Get(StyleId id);
+    /// Add a reference to an ID.
+    static void AddRef(StyleId id);
+    /// Remove a reference from an ID, the ID is reused when the last one is gone.
+    static void ReleaseRef(StyleId id);
+    /// Return number of formats in use.
+    static unsigned GetNumStyles();
+};
+
+/// The format of a block, an ID of the RichStyleTable and the color. Formats that did not fit into the full table are
+/// copied along with the block instead.
+struct BlockStyle
+{
+    BlockStyle() {}
+    BlockStyle(const BlockStyle& rhs) : id(rhs.id), color(rhs.color), overflow(rhs.overflow ? new BlockFormat(*rhs.overflow) : nullptr)
+    {
+        if (id)
+            RichStyleTable::AddRef(id);
+    }
+    ~BlockStyle()
+    {
+        if (id)
+            RichStyleTable::ReleaseRef(id);
+        delete overflow;
+    }
+
+    BlockStyle& operator =(const BlockStyle& rhs)
+    {
+        if (this != &rhs)
+        {
+            if (rhs.id)
+                RichStyleTable::AddRef(rhs.id);
+            if (id)
+                RichStyleTable::ReleaseRef(id);
+            delete overflow;
+            id = rhs.id;
+            color = rhs.color;
+            overflow = rhs.overflow ? new BlockFormat(*rhs.overflow) : nullptr;
+        }
+        return *this;
+    }
+    bool operator ==(const BlockStyle& rhs) const
+    {
+        return overflow || rhs.overflow ? Get() == rhs.Get() : id == rhs.id && color == rhs.color;
+    }
+    bool operator !=(const BlockStyle& rhs) const { return !(*this == rhs); }
+
+    /// Return the format without the color, shared by the blocks of the same ID. Its color is not the block color.
+    const BlockFormat& GetShared() const { return overflow ? *overflow : RichStyleTable::Get(id); }
+    /// Return a copy of the format with the block color.
+    BlockFormat Get() const
+    {
+        BlockFormat format = GetShared();
+        format.color = color;
+        return format;
+    }
+
+    /// ID in the style table, 0 for copied formats
+    StyleId id{};
+    /// Color of the block
+    Color color{Color::WHITE};
+    /// Copy of the format when the table was full, null otherwise
+    BlockFormat* overflow{};
 };
 
 /// A block of text or an image
@@ -73,13 +186,29 @@ struct TextBlock
     BlockType type{BlockType_Text};
     /// Text or image/material source, or tag data of plugins
     String text;
-
-    BlockFormat format;
+    /// The text of text blocks decoded to UTF-32, see DecodeText()
+    PODVector<unsigned> chars;
+    /// Format of the block, see RichStyleTable
+    BlockStyle style;
 
     float image_width{};
     float image_height{};
+    /// Advance of the text measured by the layout, negative while not measured
+    float width{-1.0f};
     bool is_visible{true};
     bool is_line_break{};
+
+    /// Return a copy of the format of the block.
+    BlockFormat GetFormat() const { return style.Get(); }
+    /// Set the format of the block.
+    void SetFormat(const BlockFormat& format) { style = RichStyleTable::MakeStyle(format); }
+    /// Decode the text to chars. Must be called again after the text of a text block changes.
+    void DecodeText()
+    {
+        chars.Clear();
+        for (unsigned i = 0; i < text.Length();)
+            chars.Push(text.NextUTF8Char(i));
+    }
 };
 
 /// A line inside the text layout
@@ -97,6 +226,11 @@ struct TextLine
 
 class RichWidgetBatch;
 class RichWidget;
+class RichWidgetText;
+class RichTextBatcher;
+
+/// Return the quad index buffer shared by the widgets, grown to hold at least num_quads quads of 4 vertices.
+SharedPtr<IndexBuffer> GetQuadIndexBuffer(Context* context, unsigned num_quads);
 
 enum WidgetFlags
 {
@@ -134,6 +268,18 @@ public:
     void SetDrawOrigin(const Urho3D::Vector3& point);
     /// Get the draw origin, e.g. the point in 3D local space where the render items draw, default Vector3::ZERO.
     Vector3 GetDrawOrigin() const {	return draw_origin_; }
+    /// Set scrolling by transform. The scroll offset then moves the batches with their world transform. The geometry is
+    /// clipped with one window of margin around the clip region and only rebuilt when the offset passes the margin.
+    /// Until then up to one window of content may show outside the clip region.
+    void SetScrollByTransform(bool enable);
+    /// Return whether scrolling by transform, default false.
+    bool GetScrollByTransform() const { return scroll_by_transform_; }
+    /// Set the scroll offset in pixels, only used when scrolling by transform.
+    void SetScrollOffset(const Vector2& offset);
+    /// Get the scroll offset in pixels, default Vector2::ZERO.
+    Vector2 GetScrollOffset() const { return scroll_offset_; }
+    /// Get the scroll offset the geometry was built at, Vector2::ZERO when not scrolling by transform.
+    Vector2 GetScrollBuiltOffset() const;
     /// Set padding.
     void SetPadding(const IntRect& padding);
     /// Get padding, default IntRect::ZERO.
@@ -145,11 +291,18 @@ public:
     /// Templated cache a widget.
     template<typename T> T* CacheWidgetBatch(StringHash id);
     /// Creates a WidgetBatch with the specified texture and type. If it already exists, returns the existing instance.
+    /// Text batches use the font key of RichWidgetText::MakeFontKey() as id.
     RichWidgetBatch* CacheWidgetBatchT(StringHash type, StringHash id);
     /// Remove all batches.
     void RemoveWidgetBatches();
     /// Remove unused batches (cached but not referenced).
     void RemoveUnusedWidgetBatches();
+    /// Mark the start of a new layout line in all batches, the quads added next belong to it.
+    void MarkLineStart();
+    /// Remove the quads of the first layout lines and move the remaining quads up by offset_y pixels.
+    void RemoveLeadingLines(unsigned count, float offset_y);
+    /// Get number of marked layout lines.
+    unsigned GetNumMarkedLines() const { return num_marked_lines_; }
     /// Get a list of cached batches.
     const Vector<SharedPtr<RichWidgetBatch>>& GetWidgetBatches() const { return items_; }
 
@@ -204,14 +357,31 @@ public:
     void SetFixedScreenSize(bool enable);
     /// Return whether text has fixed screen size.
     bool IsFixedScreenSize() const { return fixedScreenSize_; }
+    /// Set compact vertices for the 3D geometry: 2D positions, packed color and UV, 20 bytes instead of 24. A glyph quad
+    /// takes 80 bytes of vertex data instead of 96, a sixth less upload and vertex fetch. The depth is dropped, the
+    /// quads of a batch are drawn back to front by it instead, so shadows stay behind the glyphs as long as the
+    /// material does not write depth. Default false.
+    void SetCompactVertices(bool enable);
+    /// Return whether the 3D geometry uses compact vertices.
+    bool GetCompactVertices() const { return compact_vertices_; }
     /// Set how the text should rotate in relation to the camera. Default is to not rotate (FC_NONE.)
     void SetFaceCameraMode(FaceCameraMode mode);
     /// Return how the text rotates in relation to the camera.
     FaceCameraMode GetFaceCameraMode() const { return faceCameraMode_; }
+    /// Set whether the RichTextBatcher of the scene draws the widget, merged with the other widgets of the same
+    /// material. Widgets facing the camera or with fixed screen size draw themselves. Default false.
+    void SetUseBatcher(bool enable);
+    /// Return whether the batcher of the scene draws the widget.
+    bool GetUseBatcher() const { return use_batcher_; }
+    /// Return whether a batcher draws the widget now.
+    bool IsBatched() const;
     /// A cache of the used render items, all unused render items (those with no quads) will be freed.
     Vector<SharedPtr<RichWidgetBatch>> items_;
 protected:
+    /// Cached render items by (type, id), see CacheWidgetBatchT().
+    HashMap<unsigned long long, RichWidgetBatch*> item_index_;
     friend class RichWidgetBatch;
+    friend class RichTextBatcher;
     /// The clipping region, default 0, no clipping.
     IntRect clip_region_;
     /// Draw padding, default 0, no padding.
@@ -246,6 +416,8 @@ protected:
     Vector<SharedPtr<Geometry>> geometries_;
     /// Vertex buffer.
     SharedPtr<VertexBuffer> vertex_buffer_;
+    /// Quad index buffer shared by all widgets, used by the 3D geometry.
+    SharedPtr<IndexBuffer> index_buffer_;
     /// Link between item index and sourcebatch index
     PODVector<int> batch_index_to_item_index_;
     /// Horizontal alignment.
@@ -263,7 +435,31 @@ protected:
     float minAngle_;
     /// Fixed screen size flag.
     bool fixedScreenSize_;
+    /// Number of layout lines marked in the batches since the last Clear().
+    unsigned num_marked_lines_;
+    /// Scroll by transform flag.
+    bool scroll_by_transform_;
+    /// Scroll offset in pixels.
+    Vector2 scroll_offset_;
+    /// Scroll offset at the last geometry build.
+    Vector2 scroll_built_offset_;
+    /// World transform including the scroll offset.
+    Matrix3x4 scrollWorldTransform_;
+    /// Compact vertices flag.
+    bool compact_vertices_;
+    /// Vertex data converted to the compact format.
+    PODVector<float> compact_vertex_data_;
+    /// First vertices of the quads of a batch in compact draw order.
+    PODVector<unsigned> compact_quad_order_;
+    /// Use batcher flag.
+    bool use_batcher_;
+    /// The batcher drawing the widget.
+    WeakPtr<RichTextBatcher> batcher_;
+    /// Have the vertices or the transform changed since the batcher copied them?
+    bool batcher_dirty_;
 
+    /// Return the scroll offset since the last geometry build in local space.
+    Vector3 GetScrollTranslation() const;
     /// The clip region after scaling. TODO: remove
     Rect GetActualDrawArea(bool withPadding = true) const;
     /// Draw all render items.
@@ -275,6 +471,13 @@ protected:
     //void UpdateTextMaterials(UIElement* uiElement = NULL, PODVector<UIBatch>* batches = NULL, PODVector<float>* vertexData = NULL, const IntRect* currentScissor = NULL);
     /// Recalculate camera facing and fixed screen size.
     void CalculateFixedScreenSize(const FrameInfo& frame);
+    /// Join or leave the batcher of a scene.
+    void UpdateBatcher(Scene* scene);
+
+    /// Handle scene being assigned.
+    void OnSceneSet(Scene* scene) override;
+    /// Handle node transform being dirtied.
+    void OnMarkedDirty(Node* node) override;
 
     /// Calculate distance and prepare batches for rendering. May be called from worker thread(s), possibly re-entrantly.
     void UpdateBatches(const FrameInfo& frame) override;
@@ -283,13 +486,47 @@ protected:
      void UpdateGeometry(const FrameInfo& frame) override;
     /// Return whether a geometry update is necessary, and if it can happen in a worker thread.
     UpdateGeometryType GetUpdateGeometryType() override;
+    /// Copy the vertices of a batch to the compact format, back to front by their depth.
+    void CompactBatchVertices(unsigned vertexStart, unsigned vertexEnd);
     /// Recalculate the world-space bounding box.
     void OnWorldBoundingBoxUpdate() override;
 };
 
+/// Measures text with the text batches of a widget and draws layout runs into the widget batches.
+class RichWidgetLayout: public RichLayoutMeasurer
+{
+public:
+    /// Construct. Blocks without a font face or size use the ones of default_format.
+    RichWidgetLayout(RichWidget* widget, const BlockFormat& default_format);
+
+    /// Select the font of a block format, the next measurements use it.
+    void SetFormat(const BlockFormat& format) override;
+    /// Get the size of a text in the selected font.
+    Vector2 MeasureText(const String& text) override;
+    /// Get the size of a decoded text in the selected font.
+    Vector2 MeasureChars(const PODVector<unsigned>& chars) override;
+    /// Get the width of every prefix of a text in the selected font.
+    void MeasurePrefixes(const String& text, PODVector<unsigned>& char_ends, PODVector<float>& widths) override;
+    /// Get the row height of the selected font.
+    float GetRowHeight() override;
+    /// Get the width/height ratio of an image, 0 if not known.
+    float GetImageAspect(const String& source) override;
+    /// Add the quads of runs placed in num_lines lines, moved by origin. Every line is marked in the widget batches.
+    void Draw(const PODVector<RichLayoutRun>& runs, unsigned num_lines, const Vector3& origin);
+private:
+    RichWidget* widget_;
+    const BlockFormat& default_format_;
+    /// Font key of the selected format.
+    unsigned font_key_;
+    /// Text batch of the selected format.
+    RichWidgetText* text_batch_;
+};
+
 template<typename T> T* RichWidget::AddWidgetBatch() {
     T* new_t = new T(context_);
     new_t->use_count_ = 1;
+    if (num_marked_lines_)
+        new_t->MarkLineStart(num_marked_lines_ - 1);
     items_.Push(new_t);
     new_t->SetNode(node_);
     return new_t;